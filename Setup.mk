@@ -15,6 +15,6 @@ USUAL_OBJS = $(addprefix $(USUAL_OBJDIR)/, $(notdir $(USUAL_SRCS:.c=.o)))
 #	$(CC) -c -o $@ $< $(DEFS) $(CPPFLAGS) $(CFLAGS)
 
 # target: libusual.a
-USUAL_LIBS = -lusual
+USUAL_LIBS = -lusual -lpthread
 USUAL_LDFLAGS = -L$(USUAL_DIR)
 
@@ -0,0 +1,43 @@
+/*
+ * Shared helpers for microbenchmarks.
+ *
+ * Each result is one line of space-separated key=value pairs,
+ * starting with bench=MODULE.  Timings are best of BENCH_RUNS,
+ * inputs come from fixed-seed generator, so runs are comparable.
+ */
+
+#ifndef _TEST_BENCH_H_
+#define _TEST_BENCH_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_RUNS 3
+
+static inline double bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* xorshift64, deterministic */
+static inline uint64_t bench_rand(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return x;
+}
+
+/* keep best time over runs */
+static inline void bench_best(double *best, double t)
+{
+	if (*best == 0 || t < *best)
+		*best = t;
+}
+
+#endif
@@ -0,0 +1,113 @@
+/*
+ * Slab allocator against malloc.
+ *
+ * Output: bench=alloc impl=NAME size=N pattern=P ns=NS_PER_OP
+ * pattern "pair" frees right after alloc, "batch" allocates
+ * BATCH objects then frees them in random order.
+ */
+
+#include <usual/slab.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+
+#define OPS (4 * 1000 * 1000)
+#define BATCH 10000
+
+static void *objs[BATCH];
+static unsigned order[BATCH];
+
+static void shuffle(void)
+{
+	uint64_t seed = 42;
+	unsigned i, j, tmp;
+
+	for (i = 0; i < BATCH; i++)
+		order[i] = i;
+	for (i = BATCH - 1; i > 0; i--) {
+		j = bench_rand(&seed) % (i + 1);
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+}
+
+static double run_slab(unsigned size, bool batch)
+{
+	struct Slab *slab = slab_create("bench", size, 0, NULL);
+	double t0, t1;
+	unsigned i, j;
+	void *p;
+
+	t0 = bench_now_ns();
+	if (batch) {
+		for (i = 0; i < OPS / BATCH / 2; i++) {
+			for (j = 0; j < BATCH; j++)
+				objs[j] = slab_alloc(slab);
+			for (j = 0; j < BATCH; j++)
+				slab_free(slab, objs[order[j]]);
+		}
+	} else {
+		for (i = 0; i < OPS / 2; i++) {
+			objs[0] = p = slab_alloc(slab);
+			slab_free(slab, p);
+		}
+	}
+	t1 = bench_now_ns();
+	slab_destroy(slab);
+	return (t1 - t0) / OPS;
+}
+
+static double run_malloc(unsigned size, bool batch)
+{
+	double t0, t1;
+	unsigned i, j;
+	void *p;
+
+	t0 = bench_now_ns();
+	if (batch) {
+		for (i = 0; i < OPS / BATCH / 2; i++) {
+			for (j = 0; j < BATCH; j++) {
+				objs[j] = malloc(size);
+				memset(objs[j], 0, size);
+			}
+			for (j = 0; j < BATCH; j++)
+				free(objs[order[j]]);
+		}
+	} else {
+		for (i = 0; i < OPS / 2; i++) {
+			/* global store keeps compiler from eliding the pair */
+			objs[0] = p = malloc(size);
+			/* slab gives zeroed memory */
+			memset(p, 0, size);
+			free(p);
+		}
+	}
+	t1 = bench_now_ns();
+	return (t1 - t0) / OPS;
+}
+
+int main(void)
+{
+	static const unsigned sizes[] = { 16, 64, 256, 1024 };
+	unsigned i, r, b;
+	double ts, tm;
+
+	shuffle();
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		for (b = 0; b < 2; b++) {
+			ts = tm = 0;
+			for (r = 0; r < BENCH_RUNS; r++) {
+				bench_best(&ts, run_slab(sizes[i], b));
+				bench_best(&tm, run_malloc(sizes[i], b));
+			}
+			printf("bench=alloc impl=slab size=%u pattern=%s ns=%.2f\n",
+			       sizes[i], b ? "batch" : "pair", ts);
+			printf("bench=alloc impl=malloc size=%u pattern=%s ns=%.2f\n",
+			       sizes[i], b ? "batch" : "pair", tm);
+		}
+	}
+	return 0;
+}
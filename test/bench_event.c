@@ -0,0 +1,258 @@
+/*
+ * Event loop costs per backend.
+ *
+ * Output:
+ *   bench=event backend=NAME op=timer_churn wheel=0|1 pending=N ns=NS_PER_ADD_DEL
+ *   bench=event backend=NAME op=fd_churn ns=NS_PER_ADD_DEL
+ *   bench=event backend=NAME op=wakeup idle_fds=N ns=NS_PER_ROUNDTRIP
+ *   bench=event backend=NAME op=wheel_idle iterations=N
+ *
+ * Wakeup is write to socketpair + one loop iteration that reads it,
+ * with N idle pipes registered for reading.
+ *
+ * Wheel_idle counts loop iterations while only far-away timers are
+ * pending, it fails if the loop spins instead of sleeping.
+ */
+
+#include <usual/event.h>
+#include <usual/socket.h>
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define CHURN_OPS 200000
+#define WAKEUPS 50000
+
+static const char *backends[] = { "epoll", "kqueue", "poll", "io_uring", NULL };
+
+static void noop_cb(int fd, short flags, void *arg)
+{
+}
+
+static void read_cb(int fd, short flags, void *arg)
+{
+	char buf[16];
+	if (read(fd, buf, sizeof(buf)) < 0)
+		abort();
+}
+
+static void timer_churn(const char *name, bool wheel, unsigned pending)
+{
+	struct event_base *base = event_init_backend(name);
+	struct event *bg, ev;
+	struct timeval tv;
+	double best = 0, t0, t1;
+	unsigned i, r;
+	uint64_t seed = 11;
+
+	if (wheel && event_base_set_timer_wheel(base, true) < 0)
+		abort();
+
+	/* background timers */
+	bg = calloc(pending + 1, sizeof(*bg));
+	for (i = 0; i < pending; i++) {
+		tv.tv_sec = 10 + bench_rand(&seed) % 1000;
+		tv.tv_usec = bench_rand(&seed) % 1000000;
+		event_assign(&bg[i], base, -1, 0, noop_cb, NULL);
+		if (event_add(&bg[i], &tv) < 0)
+			abort();
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	event_assign(&ev, base, -1, 0, noop_cb, NULL);
+	for (r = 0; r < BENCH_RUNS; r++) {
+		t0 = bench_now_ns();
+		for (i = 0; i < CHURN_OPS; i++) {
+			tv.tv_sec = 1 + (i & 63);
+			tv.tv_usec = i & 1023;
+			if (event_add(&ev, &tv) < 0)
+				abort();
+			event_del(&ev);
+		}
+		t1 = bench_now_ns();
+		bench_best(&best, (t1 - t0) / CHURN_OPS);
+	}
+	printf("bench=event backend=%s op=timer_churn wheel=%d pending=%u ns=%.2f\n",
+	       name, wheel ? 1 : 0, pending, best);
+
+	for (i = 0; i < pending; i++)
+		event_del(&bg[i]);
+	free(bg);
+	event_base_free(base);
+}
+
+/*
+ * Timers about one level-1 rotation away land in slot with same index
+ * as current one.  After short timer fires the loop must still sleep.
+ */
+static void wheel_idle(const char *name)
+{
+	struct event_base *base = event_init_backend(name);
+	struct EventBaseStats st;
+	struct event far[10], near;
+	struct timeval tv;
+	unsigned i;
+
+	if (event_base_set_timer_wheel(base, true) < 0 || event_base_enable_stats(base, true) < 0)
+		abort();
+	memset(far, 0, sizeof(far));
+	memset(&near, 0, sizeof(near));
+	for (i = 0; i < 10; i++) {
+		tv.tv_sec = 16;
+		tv.tv_usec = (200 + i * 20) * 1000;
+		event_assign(&far[i], base, -1, 0, noop_cb, NULL);
+		if (event_add(&far[i], &tv) < 0)
+			abort();
+	}
+	tv.tv_sec = 0;
+	tv.tv_usec = 10000;
+	event_assign(&near, base, -1, 0, noop_cb, NULL);
+	if (event_add(&near, &tv) < 0)
+		abort();
+
+	tv.tv_usec = 300000;
+	if (event_base_loopexit(base, &tv) < 0 || event_base_loop(base, 0) < 0)
+		abort();
+	if (event_base_get_stats(base, &st) < 0)
+		abort();
+	printf("bench=event backend=%s op=wheel_idle iterations=%llu\n",
+	       name, (unsigned long long)st.iterations);
+	if (st.iterations > 10) {
+		fprintf(stderr, "bench_event: timer wheel spins\n");
+		exit(1);
+	}
+
+	for (i = 0; i < 10; i++)
+		event_del(&far[i]);
+	event_base_free(base);
+}
+
+static void fd_churn(const char *name)
+{
+	struct event_base *base = event_init_backend(name);
+	struct event ev;
+	double best = 0, t0, t1;
+	unsigned i, r;
+	int sp[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) < 0)
+		abort();
+	memset(&ev, 0, sizeof(ev));
+	for (r = 0; r < BENCH_RUNS; r++) {
+		t0 = bench_now_ns();
+		for (i = 0; i < CHURN_OPS; i++) {
+			event_assign(&ev, base, sp[1], EV_READ, noop_cb, NULL);
+			if (event_add(&ev, NULL) < 0)
+				abort();
+			event_del(&ev);
+		}
+		/* let batched backends flush */
+		if (event_base_loop(base, EVLOOP_NONBLOCK) < 0)
+			abort();
+		t1 = bench_now_ns();
+		bench_best(&best, (t1 - t0) / CHURN_OPS);
+	}
+	printf("bench=event backend=%s op=fd_churn ns=%.2f\n", name, best);
+	close(sp[0]);
+	close(sp[1]);
+	event_base_free(base);
+}
+
+static void wakeup(const char *name, unsigned idle)
+{
+	struct event_base *base = event_init_backend(name);
+	struct event ev, *idle_ev;
+	int (*pipes)[2];
+	double best = 0, t0, t1;
+	unsigned i, r;
+	int sp[2];
+
+	idle_ev = calloc(idle + 1, sizeof(*idle_ev));
+	pipes = calloc(idle + 1, sizeof(*pipes));
+	for (i = 0; i < idle; i++) {
+		if (pipe(pipes[i]) < 0)
+			abort();
+		event_assign(&idle_ev[i], base, pipes[i][0], EV_READ | EV_PERSIST, noop_cb, NULL);
+		if (event_add(&idle_ev[i], NULL) < 0)
+			abort();
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) < 0)
+		abort();
+	memset(&ev, 0, sizeof(ev));
+	event_assign(&ev, base, sp[1], EV_READ | EV_PERSIST, read_cb, NULL);
+	if (event_add(&ev, NULL) < 0)
+		abort();
+
+	for (r = 0; r < BENCH_RUNS; r++) {
+		t0 = bench_now_ns();
+		for (i = 0; i < WAKEUPS; i++) {
+			if (write(sp[0], "x", 1) != 1)
+				abort();
+			if (event_base_loop(base, EVLOOP_ONCE) < 0)
+				abort();
+		}
+		t1 = bench_now_ns();
+		bench_best(&best, (t1 - t0) / WAKEUPS);
+	}
+	printf("bench=event backend=%s op=wakeup idle_fds=%u ns=%.2f\n", name, idle, best);
+
+	event_del(&ev);
+	close(sp[0]);
+	close(sp[1]);
+	for (i = 0; i < idle; i++) {
+		event_del(&idle_ev[i]);
+		close(pipes[i][0]);
+		close(pipes[i][1]);
+	}
+	free(pipes);
+	free(idle_ev);
+	event_base_free(base);
+}
+
+/* idle pipes need 2 fds each */
+static unsigned max_idle(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+		return 100;
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+	getrlimit(RLIMIT_NOFILE, &rl);
+	return rl.rlim_cur > 64 ? (rl.rlim_cur - 64) / 2 : 0;
+}
+
+int main(void)
+{
+	static const unsigned idle_counts[] = { 0, 100, 1000, 10000 };
+	struct event_base *base;
+	unsigned i, limit = max_idle();
+	const char **be;
+
+	for (be = backends; *be; be++) {
+		/* skip unavailable backends */
+		base = event_init_backend(*be);
+		if (!base)
+			continue;
+		event_base_free(base);
+
+		timer_churn(*be, false, 0);
+		timer_churn(*be, false, 100000);
+		timer_churn(*be, true, 0);
+		timer_churn(*be, true, 100000);
+		wheel_idle(*be);
+		fd_churn(*be);
+		for (i = 0; i < sizeof(idle_counts) / sizeof(idle_counts[0]); i++) {
+			if (idle_counts[i] <= limit)
+				wakeup(*be, idle_counts[i]);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * Compare hash functions across key sizes.
+ *
+ * Output is one line per measurement:
+ *   bench=hash hash=NAME keylen=N ns=NS_PER_HASH mbs=MB_PER_SEC bpc=BYTES_PER_CYCLE
+ * bpc is 0 if cycle counter is not available.  For md5 keylen
+ * is the size of md5_update() chunk, ns is per chunk.
+ */
+
+#include <usual/lookup3.h>
+#include <usual/md5.h>
+#include <usual/wyhash.h>
+
+#include <string.h>
+
+#include "bench.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC
+#endif
+
+#define TOTAL_BYTES (64 * 1024 * 1024)
+
+static uint64_t sink;
+
+static uint64_t do_lookup3(const void *p, size_t len)
+{
+	return hash_lookup3(p, len);
+}
+
+static uint64_t do_wyhash(const void *p, size_t len)
+{
+	return hash_wy(p, len, 0x1234);
+}
+
+static struct md5_ctx md5_ctx;
+
+static uint64_t do_md5(const void *p, size_t len)
+{
+	md5_update(&md5_ctx, p, len);
+	return md5_ctx.nbytes;
+}
+
+static void run(const char *name, uint64_t (*fn)(const void *, size_t),
+		const unsigned char *buf, size_t keylen)
+{
+	size_t i, count = TOTAL_BYTES / keylen;
+	double t0, t1;
+	uint64_t c0 = 0, c1 = 0;
+
+	if (count > 20 * 1000 * 1000)
+		count = 20 * 1000 * 1000;
+
+#ifdef HAVE_RDTSC
+	c0 = __rdtsc();
+#endif
+	t0 = bench_now_ns();
+	for (i = 0; i < count; i++)
+		sink += fn(buf + (i & 63), keylen);
+	t1 = bench_now_ns();
+#ifdef HAVE_RDTSC
+	c1 = __rdtsc();
+#endif
+
+	printf("bench=hash hash=%s keylen=%u ns=%.2f mbs=%.1f bpc=%.3f\n", name, (unsigned)keylen,
+	       (t1 - t0) / count,
+	       (double)keylen * count * 1000 / (t1 - t0),
+	       c1 > c0 ? (double)keylen * count / (c1 - c0) : 0.0);
+}
+
+int main(void)
+{
+	static unsigned char buf[4096 + 64];
+	static const size_t sizes[] = { 4, 8, 16, 32, 64, 256, 1024, 4096 };
+	unsigned i;
+
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = i * 31 + 7;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		run("lookup3", do_lookup3, buf, sizes[i]);
+		run("wyhash", do_wyhash, buf, sizes[i]);
+	}
+	md5_reset(&md5_ctx);
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		if (sizes[i] >= 64)
+			run("md5", do_md5, buf, sizes[i]);
+	}
+	return sink == 1;
+}
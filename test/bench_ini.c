@@ -0,0 +1,152 @@
+/*
+ * Config parsing on large generated file.
+ *
+ * Output: bench=ini op=NAME sections=N keys=K ms=MS_PER_PARSE mbs=MB_PER_SEC
+ *
+ * op: parse - parse_ini_file(), mapped - parse_ini_mapped(),
+ * snapshot - cf_snapshot_load(), reload - load_ini_file_diff()
+ * on unchanged file.
+ */
+
+#include <usual/cfparser.h>
+#include <usual/fileutil.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define KEYS_PER_SECT 10
+
+static unsigned nkeys;
+
+static bool count_handler(void *arg, enum CfKeyType ktype, const char *key, const char *val)
+{
+	nkeys++;
+	return true;
+}
+
+static bool count_slice(void *arg, enum CfKeyType ktype, const char *key, unsigned klen,
+			const char *val, unsigned vlen)
+{
+	nkeys++;
+	return true;
+}
+
+/* loader target, all sections share it */
+struct BenchCfg {
+	int num[KEYS_PER_SECT];
+};
+static struct BenchCfg bench_cfg;
+
+static void *get_target(void *top_arg)
+{
+	return &bench_cfg;
+}
+
+#define K(n) { "key" #n, cf_set_int, offsetof(struct BenchCfg, num[n]), NULL }
+static const struct CfKey bench_keys[] = {
+	K(0), K(1), K(2), K(3), K(4), K(5), K(6), K(7), K(8), K(9),
+	{ NULL },
+};
+static const struct CfSect bench_sects[] = {
+	{ "sect", get_target, bench_keys },
+	{ NULL },
+};
+
+static size_t write_config(const char *fn, unsigned sections)
+{
+	FILE *f = fopen(fn, "w");
+	unsigned i, k;
+	long size;
+
+	if (!f)
+		abort();
+	for (i = 0; i < sections; i++) {
+		fprintf(f, "[sect]\n; section %u\n", i);
+		for (k = 0; k < KEYS_PER_SECT; k++)
+			fprintf(f, "key%u = %u\n", k, i * KEYS_PER_SECT + k);
+		fprintf(f, "\n");
+	}
+	size = ftell(f);
+	fclose(f);
+	return size;
+}
+
+static void report(const char *op, unsigned sections, size_t size, double best)
+{
+	printf("bench=ini op=%s sections=%u keys=%u ms=%.3f mbs=%.1f\n",
+	       op, sections, sections * KEYS_PER_SECT, best / 1e6, size * 1e3 / best);
+}
+
+static void run(const char *fn, unsigned sections)
+{
+	size_t size = write_config(fn, sections);
+	double best, t0, t1;
+	struct CfSnapshot *snap = NULL, *tmp;
+	unsigned r;
+
+	best = 0;
+	for (r = 0; r < BENCH_RUNS; r++) {
+		t0 = bench_now_ns();
+		if (!parse_ini_file(fn, count_handler, NULL))
+			abort();
+		t1 = bench_now_ns();
+		bench_best(&best, t1 - t0);
+	}
+	report("parse", sections, size, best);
+
+	best = 0;
+	for (r = 0; r < BENCH_RUNS; r++) {
+		t0 = bench_now_ns();
+		if (!parse_ini_mapped(fn, count_slice, NULL))
+			abort();
+		t1 = bench_now_ns();
+		bench_best(&best, t1 - t0);
+	}
+	report("mapped", sections, size, best);
+
+	best = 0;
+	for (r = 0; r < BENCH_RUNS; r++) {
+		t0 = bench_now_ns();
+		tmp = cf_snapshot_load(fn);
+		t1 = bench_now_ns();
+		if (!tmp)
+			abort();
+		cf_snapshot_free(tmp);
+		bench_best(&best, t1 - t0);
+	}
+	report("snapshot", sections, size, best);
+
+	if (!load_ini_file_diff(fn, bench_sects, NULL, &snap))
+		abort();
+	best = 0;
+	for (r = 0; r < BENCH_RUNS; r++) {
+		t0 = bench_now_ns();
+		if (!load_ini_file_diff(fn, bench_sects, NULL, &snap))
+			abort();
+		t1 = bench_now_ns();
+		bench_best(&best, t1 - t0);
+	}
+	report("reload", sections, size, best);
+	cf_snapshot_free(snap);
+}
+
+int main(void)
+{
+	char fn[] = "/tmp/bench_ini.XXXXXX";
+	unsigned n;
+	int fd;
+
+	fd = mkstemp(fn);
+	if (fd < 0)
+		return 1;
+	close(fd);
+
+	for (n = 100; n <= 100000; n *= 10)
+		run(fn, n);
+
+	unlink(fn);
+	return 0;
+}
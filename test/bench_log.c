@@ -0,0 +1,62 @@
+/*
+ * Logging throughput.
+ *
+ * Output: bench=log mode=sync|async dest=file|null lines_s=LINES_PER_SEC
+ *
+ * Lines go to a temporary file, async mode includes
+ * the time to flush the queue on log_async_stop().
+ */
+
+#include <usual/logging.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define LINES 200000
+
+static void run(const char *mode, const char *dest, const char *fn, bool async)
+{
+	double best = 0, t0, t1;
+	unsigned i, r;
+
+	cf_logfile = fn;
+	for (r = 0; r < BENCH_RUNS; r++) {
+		if (async && !log_async_start(64 * 1024, LOG_ASYNC_BLOCK))
+			abort();
+		t0 = bench_now_ns();
+		for (i = 0; i < LINES; i++)
+			log_generic(LG_INFO, "bench line %u: client=%s port=%d state=%s", i, "127.0.0.1", 6432, "active");
+		if (async)
+			log_async_stop();
+		t1 = bench_now_ns();
+		reset_logging();
+		bench_best(&best, t1 - t0);
+	}
+	cf_logfile = NULL;
+	printf("bench=log mode=%s dest=%s lines_s=%.0f\n", mode, dest, LINES * 1e9 / best);
+}
+
+int main(void)
+{
+	char fn[] = "/tmp/bench_log.XXXXXX";
+	int fd;
+
+	fd = mkstemp(fn);
+	if (fd < 0)
+		return 1;
+	close(fd);
+
+	/* no stderr copy */
+	cf_quiet = 1;
+
+	run("sync", "file", fn, false);
+	run("async", "file", fn, true);
+	run("sync", "null", "/dev/null", false);
+	run("async", "null", "/dev/null", true);
+
+	unlink(fn);
+	return 0;
+}
@@ -0,0 +1,117 @@
+/*
+ * Lookup cost in CBTree and AATree by tree size.
+ *
+ * Output: bench=tree impl=NAME keys=N op=insert|lookup ns=NS_PER_OP
+ * Keys are 16-byte hex strings of random 64-bit values,
+ * AATree uses the same values as longs.
+ */
+
+#include <usual/aatree.h>
+#include <usual/cbtree.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+
+#define LOOKUPS (2 * 1000 * 1000)
+
+struct Item {
+	struct AANode node;
+	long value;
+	char key[24];
+};
+
+static const char *item_key(void *obj)
+{
+	struct Item *it = obj;
+	return it->key;
+}
+
+static int item_cmp(long value, struct AANode *node)
+{
+	struct Item *it = container_of(node, struct Item, node);
+	if (value == it->value)
+		return 0;
+	return value < it->value ? -1 : 1;
+}
+
+static struct Item *make_items(unsigned count)
+{
+	struct Item *items = calloc(count, sizeof(*items));
+	uint64_t seed = 7;
+	unsigned i;
+
+	for (i = 0; i < count; i++) {
+		uint64_t v = bench_rand(&seed);
+		items[i].value = (long)(v >> 1);
+		snprintf(items[i].key, sizeof(items[i].key), "%016llx", (unsigned long long)v);
+	}
+	return items;
+}
+
+static void run(unsigned count)
+{
+	struct Item *items = make_items(count);
+	double ins_cb = 0, ins_aa = 0, look_cb = 0, look_aa = 0, t0, t1;
+	uint64_t seed;
+	unsigned i, r;
+	struct CBTree *cbt;
+	struct AATree aat;
+	long found = 0;
+
+	for (r = 0; r < BENCH_RUNS; r++) {
+		cbt = cbtree_create(item_key);
+		t0 = bench_now_ns();
+		for (i = 0; i < count; i++) {
+			if (!cbtree_insert(cbt, &items[i]))
+				abort();
+		}
+		t1 = bench_now_ns();
+		bench_best(&ins_cb, (t1 - t0) / count);
+
+		seed = 3;
+		t0 = bench_now_ns();
+		for (i = 0; i < LOOKUPS; i++) {
+			struct Item *it = &items[bench_rand(&seed) % count];
+			found += cbtree_lookup(cbt, it->key) != NULL;
+		}
+		t1 = bench_now_ns();
+		bench_best(&look_cb, (t1 - t0) / LOOKUPS);
+		cbtree_destroy(cbt);
+
+		aatree_init(&aat, item_cmp, NULL);
+		t0 = bench_now_ns();
+		for (i = 0; i < count; i++)
+			aatree_insert(&aat, items[i].value, &items[i].node);
+		t1 = bench_now_ns();
+		bench_best(&ins_aa, (t1 - t0) / count);
+
+		seed = 3;
+		t0 = bench_now_ns();
+		for (i = 0; i < LOOKUPS; i++) {
+			struct Item *it = &items[bench_rand(&seed) % count];
+			found += aatree_search(&aat, it->value) != NULL;
+		}
+		t1 = bench_now_ns();
+		bench_best(&look_aa, (t1 - t0) / LOOKUPS);
+		aatree_destroy(&aat);
+	}
+
+	printf("bench=tree impl=cbtree keys=%u op=insert ns=%.2f\n", count, ins_cb);
+	printf("bench=tree impl=cbtree keys=%u op=lookup ns=%.2f\n", count, look_cb);
+	printf("bench=tree impl=aatree keys=%u op=insert ns=%.2f\n", count, ins_aa);
+	printf("bench=tree impl=aatree keys=%u op=lookup ns=%.2f\n", count, look_aa);
+	if (found != (long)BENCH_RUNS * LOOKUPS * 2)
+		printf("bench=tree error=missing_keys\n");
+	free(items);
+}
+
+int main(void)
+{
+	unsigned n;
+
+	for (n = 1000; n <= 1000000; n *= 10)
+		run(n);
+	return 0;
+}
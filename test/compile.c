@@ -6,16 +6,21 @@
 #include <usual/daemon.h>
 #include <usual/event.h>
 #include <usual/fileutil.h>
+#include <usual/forward.h>
+#include <usual/hashmap.h>
 #include <usual/list.h>
 #include <usual/logging.h>
 #include <usual/lookup3.h>
+#include <usual/mbuf.h>
 #include <usual/md5.h>
+#include <usual/mempool.h>
 #include <usual/safeio.h>
 #include <usual/slab.h>
 #include <usual/socket.h>
 #include <usual/statlist.h>
 #include <usual/string.h>
 #include <usual/time.h>
+#include <usual/wyhash.h>
 
 int main(void)
 {
@@ -46,6 +46,7 @@
 #include "aatree.h"
 
 #include <stddef.h>   /* for NULL */
+#include <stdbool.h>
 
 typedef struct AATree Tree;
 typedef struct AANode Node;
@@ -135,78 +136,123 @@ static Node *rebalance_on_remove(Node *current)
 }
 
 /*
- * Recursive insertion
+ * Insertion.  Descent path is kept as array of links,
+ * so rebalancing can be done bottom-up without recursion.
  */
 
-static Node * insert_sub(Tree *tree, Node *current, long value, Node *node)
+void aatree_insert(Tree *tree, long value, Node *node)
 {
-	int cmp;
+	Node **path[AATREE_MAX_DEPTH];
+	Node **link = &tree->root;
+	int depth = 0, cmp;
+	bool is_min = true, is_max = true;
 
-	if (current == NIL) {
-		/*
-		 * Init node as late as possible, to avoid corrupting
-		 * the tree in case it is already added.
-		 */
-		node->left = node->right = NIL;
-		node->level = 1;
+	while (*link != NIL) {
+		cmp = tree->node_cmp(value, *link);
+		/* already exists? */
+		if (cmp == 0)
+			return;
+		path[depth++] = link;
+		if (cmp > 0) {
+			is_min = false;
+			link = &(*link)->right;
+		} else {
+			is_max = false;
+			link = &(*link)->left;
+		}
+	}
 
-		tree->count++;
-		return node;
+	/*
+	 * Init node as late as possible, to avoid corrupting
+	 * the tree in case it is already added.
+	 */
+	node->left = node->right = NIL;
+	node->level = 1;
+	*link = node;
+	tree->count++;
+	if (is_min)
+		tree->first = node;
+	if (is_max)
+		tree->last = node;
+
+	while (depth > 0) {
+		link = path[--depth];
+		*link = rebalance_on_insert(*link);
 	}
+}
 
-	/* recursive insert */
-	cmp = tree->node_cmp(value, current);
-	if (cmp > 0)
-		current->right = insert_sub(tree, current->right, value, node);
-	else if (cmp < 0)
-		current->left = insert_sub(tree, current->left, value, node);
-	else
-		/* already exists? */
-		return current;
+/*
+ * Removal.
+ */
 
-	return rebalance_on_insert(current);
+static Node *leftmost(Node *node)
+{
+	if (node == NIL)
+		return NULL;
+	while (node->left != NIL)
+		node = node->left;
+	return node;
 }
 
-void aatree_insert(Tree *tree, long value, Node *node)
+static Node *rightmost(Node *node)
 {
-	tree->root = insert_sub(tree, tree->root, value, node);
+	if (node == NIL)
+		return NULL;
+	while (node->right != NIL)
+		node = node->right;
+	return node;
 }
 
-/*
- * Recursive removal
- */
-
-/* remove_sub could be used for that, but want to avoid comparisions */
-static Node *steal_leftmost(Tree *tree, Node *current, Node **save_p)
+void aatree_remove(Tree *tree, long value)
 {
-	if (current->left == NIL) {
-		*save_p = current;
-		return current->right;
+	Node **path[AATREE_MAX_DEPTH];
+	Node **link = &tree->root, **sub;
+	Node *old, *new;
+	int depth = 0, old_depth, cmp;
+
+	while (*link != NIL) {
+		cmp = tree->node_cmp(value, *link);
+		if (cmp == 0)
+			break;
+		path[depth++] = link;
+		link = (cmp > 0) ? &(*link)->right : &(*link)->left;
 	}
 
-	current->left = steal_leftmost(tree, current->left, save_p);
-	return rebalance_on_remove(current);
-}
+	/* not found? */
+	if (*link == NIL)
+		return;
 
-/* drop this node from tree */
-static Node *drop_this_node(Tree *tree, Node *old)
-{
-	Node *new = NIL;
+	old = *link;
+	old_depth = depth;
+	path[depth++] = link;
 
-	if (old->left == NIL)
-		new = old->right;
-	else if (old->right == NIL)
-		new = old->left;
-	else {
+	if (old->left == NIL) {
+		*link = old->right;
+	} else if (old->right == NIL) {
+		*link = old->left;
+	} else {
 		/*
 		 * Picking nearest from right is better than from left,
 		 * due to asymmetry of the AA-tree.  It will result in
 		 * less tree operations in the long run,
 		 */
-		old->right = steal_leftmost(tree, old->right, &new);
+		sub = &old->right;
+		while ((*sub)->left != NIL) {
+			path[depth++] = sub;
+			sub = &(*sub)->left;
+		}
+		new = *sub;
+		*sub = new->right;
+
+		/* rebalance stolen path while it still hangs on old node */
+		while (depth > old_depth + 1) {
+			sub = path[--depth];
+			*sub = rebalance_on_remove(*sub);
+		}
 
 		/* take old node's place */
 		*new = *old;
+		*link = new;
 	}
 
 	/* cleanup for old node */
@@ -214,58 +260,98 @@ static Node *drop_this_node(Tree *tree, Node *old)
 		tree->release_cb(old, tree);
 	tree->count--;
 
-	return new;
+	while (depth > 0) {
+		link = path[--depth];
+		*link = rebalance_on_remove(*link);
+	}
+
+	if (tree->first == old)
+		tree->first = leftmost(tree->root);
+	if (tree->last == old)
+		tree->last = rightmost(tree->root);
 }
 
-static Node *remove_sub(Tree *tree, Node *current, long value)
+/*
+ * Walking all nodes, with explicit stack.
+ * Children are fetched before walker is called,
+ * so walker can free the node.
+ */
+
+static void walk_in_order(Node *current, aatree_walker_f walker, void *arg)
 {
-	int cmp;
+	Node *stack[AATREE_MAX_DEPTH];
+	Node *node;
+	int depth = 0;
 
-	/* not found? */
-	if (current == NIL)
-		return current;
-
-	cmp = tree->node_cmp(value, current);
-	if (cmp > 0)
-		current->right = remove_sub(tree, current->right, value);
-	else if (cmp < 0)
-		current->left = remove_sub(tree, current->left, value);
-	else
-		current = drop_this_node(tree, current);
- 
-	return rebalance_on_remove(current);
+	while (current != NIL || depth > 0) {
+		if (current != NIL) {
+			stack[depth++] = current;
+			current = current->left;
+		} else {
+			node = stack[--depth];
+			current = node->right;
+			walker(node, arg);
+		}
+	}
 }
 
-void aatree_remove(Tree *tree, long value)
+static void walk_pre_order(Node *current, aatree_walker_f walker, void *arg)
 {
-	tree->root = remove_sub(tree, tree->root, value);
+	Node *stack[AATREE_MAX_DEPTH + 1];
+	Node *node, *left, *right;
+	int depth = 0;
+
+	if (current == NIL)
+		return;
+	stack[depth++] = current;
+	while (depth > 0) {
+		node = stack[--depth];
+		left = node->left;
+		right = node->right;
+		walker(node, arg);
+		if (right != NIL)
+			stack[depth++] = right;
+		if (left != NIL)
+			stack[depth++] = left;
+	}
 }
 
-/*
- * Walking all nodes
- */
+static void walk_post_order(Node *current, aatree_walker_f walker, void *arg)
+{
+	Node *stack[AATREE_MAX_DEPTH];
+	Node *node, *last = NIL;
+	int depth = 0;
+
+	while (current != NIL || depth > 0) {
+		if (current != NIL) {
+			stack[depth++] = current;
+			current = current->left;
+			continue;
+		}
+		node = stack[depth - 1];
+		if (node->right != NIL && node->right != last) {
+			current = node->right;
+		} else {
+			/* 'last' is only compared, it may be freed */
+			depth--;
+			last = node;
+			walker(node, arg);
+		}
+	}
+}
 
 static void walk_sub(Node *current, enum AATreeWalkType wtype,
 		     aatree_walker_f walker, void *arg)
 {
-	if (current == NIL)
-		return;
-
 	switch (wtype) {
 	case AA_WALK_IN_ORDER:
-		walk_sub(current->left, wtype, walker, arg);
-		walker(current, arg);
-		walk_sub(current->right, wtype, walker, arg);
+		walk_in_order(current, walker, arg);
 		break;
 	case AA_WALK_POST_ORDER:
-		walk_sub(current->left, wtype, walker, arg);
-		walk_sub(current->right, wtype, walker, arg);
-		walker(current, arg);
+		walk_post_order(current, walker, arg);
 		break;
 	case AA_WALK_PRE_ORDER:
-		walker(current, arg);
-		walk_sub(current->left, wtype, walker, arg);
-		walk_sub(current->right, wtype, walker, arg);
+		walk_pre_order(current, walker, arg);
 		break;
 	}
 }
@@ -279,10 +365,12 @@ void aatree_walk(Tree *tree, enum AATreeWalkType wtype, aatree_walker_f walker,
 /* walk tree in bottom-up order, so that walker can destroy the nodes */
 void aatree_destroy(Tree *tree)
 {
-	walk_sub(tree->root, AA_WALK_POST_ORDER, tree->release_cb, tree);
+	if (tree->release_cb)
+		walk_sub(tree->root, AA_WALK_POST_ORDER, tree->release_cb, tree);
 
 	/* reset tree */
 	tree->root = NIL;
+	tree->first = tree->last = NULL;
 	tree->count = 0;
 }
 
@@ -290,6 +378,7 @@ void aatree_destroy(Tree *tree)
 void aatree_init(Tree *tree, aatree_cmp_f cmpfn, aatree_walker_f release_cb)
 {
 	tree->root = NIL;
+	tree->first = tree->last = NULL;
 	tree->count = 0;
 	tree->node_cmp = cmpfn;
 	tree->release_cb = release_cb;
@@ -313,3 +402,32 @@ Node *aatree_search(Tree *tree, long value)
 	return NULL;
 }
 
+/*
+ * Cursor.  Stack holds path to current node
+ * on which we went left.
+ */
+
+static Node *push_left(struct AATreeIter *iter, Node *node)
+{
+	while (node != NIL) {
+		iter->stack[iter->depth++] = node;
+		node = node->left;
+	}
+	return iter->depth > 0 ? iter->stack[iter->depth - 1] : NULL;
+}
+
+Node *aatree_first(Tree *tree, struct AATreeIter *iter)
+{
+	iter->depth = 0;
+	return push_left(iter, tree->root);
+}
+
+Node *aatree_next(struct AATreeIter *iter)
+{
+	Node *cur;
+
+	if (iter->depth == 0)
+		return NULL;
+	cur = iter->stack[--iter->depth];
+	return push_left(iter, cur->right);
+}
@@ -25,11 +25,16 @@ struct AANode;
 typedef int (*aatree_cmp_f)(long, struct AANode *node);
 typedef void (*aatree_walker_f)(struct AANode *n, void *arg);
 
+/* enough for 2^64 nodes, AA-tree height is max 2*log2(n) */
+#define AATREE_MAX_DEPTH 128
+
 /*
  * Tree header, for storing helper functions.
  */
 struct AATree {
 	struct AANode *root;
+	struct AANode *first;	/* smallest node, NULL if empty */
+	struct AANode *last;	/* largest node, NULL if empty */
 	int count;
 	aatree_cmp_f node_cmp;
 	aatree_walker_f release_cb;
@@ -60,6 +65,27 @@ void aatree_remove(struct AATree *tree, long value);
 void aatree_walk(struct AATree *tree, enum AATreeWalkType wtype, aatree_walker_f walker, void *arg);
 void aatree_destroy(struct AATree *tree);
 
+/*
+ * In-order cursor, tree must not be modified while in use.
+ */
+struct AATreeIter {
+	struct AANode *stack[AATREE_MAX_DEPTH];
+	int depth;
+};
+struct AANode *aatree_first(struct AATree *tree, struct AATreeIter *iter);
+struct AANode *aatree_next(struct AATreeIter *iter);
+
+/* smallest and largest node, O(1) */
+static inline struct AANode *aatree_min(struct AATree *tree)
+{
+	return tree->first;
+}
+
+static inline struct AANode *aatree_max(struct AATree *tree)
+{
+	return tree->last;
+}
+
 /* aatree does not use NULL pointers */
 static inline int aatree_is_nil_node(struct AANode *node)
 {
@@ -58,6 +58,7 @@
 #define _DEPRECATED             __attribute__((deprecated))
 #define _PRINTF(fmtpos, argpos) __attribute__((format(printf, fmtpos, argpos)))
 #define _MALLOC                 __attribute__((malloc))
+#define _TLS                    __thread
 
 /* compiler hints - those do not seem to work well */
 #define unlikely(x) __builtin_expect(!!(x), 0)
@@ -69,6 +70,11 @@
 #define _DEPRECATED
 #define _PRINTF(x,y)
 #define _MALLOC
+#if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L)
+#define _TLS _Thread_local
+#else
+#define _TLS
+#endif
 #define unlikely(x) x
 #define likely(x) x
 
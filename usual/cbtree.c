@@ -17,7 +17,7 @@
  */ 
 
 /*
- * Associates a C string with user pointer (called "obj").
+ * Associates a C string or binary key with user pointer (called "obj").
  *
  * Requires it's own internal nodes, thus not embeddable
  * to user structs.
@@ -30,6 +30,10 @@
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+
+#include <usual/mempool.h>
+#include <usual/slab.h>
 
 /*
  * - Childs are either other nodes or user pointers.
@@ -37,8 +41,10 @@
  *
  * - All nodes have both childs.
  *
- * - Keys are handled as having infinite length,
- *   zero-filled after actual end.
+ * - Each key byte is handled as 9 bits: first is 1 if the byte
+ *   exists, followed by the 8 data bits.  After end the key
+ *   is zero-filled.  Thus a key sorts before keys it is prefix of
+ *   and binary keys with zero bytes work too.
  */
 
 struct Node {
@@ -48,7 +54,13 @@ struct Node {
 
 struct CBTree {
 	struct Node *root;
-	const char *(*get_key)(void *obj);
+	cbtree_getkey_func get_key;
+	cbtree_getkey_len_func get_key_len;
+
+	/* node allocation, malloc if both NULL */
+	struct Slab *node_slab;
+	struct MemPool *node_pool;
+	bool own_slab;
 };
 
 #define SAME_KEY 0xFFFFFFFF
@@ -76,41 +88,56 @@ static inline void *get_external(void *extval)
 	return (void*)((uintptr_t)(extval) & (~1));
 }
 
-/* get specific bit from string */
-static inline unsigned get_bit(unsigned bitpos, const char *key, unsigned klen)
+/* get specific bit from key */
+static inline unsigned get_bit(unsigned bitpos, const unsigned char *key, unsigned klen)
 {
-	unsigned pos = bitpos / 8;
-	unsigned bit = 7 - (bitpos % 8);
-	return (pos < klen) && (key[pos] & (1 << bit));
+	unsigned pos = bitpos / 9;
+	unsigned bit = bitpos % 9;
+
+	if (pos >= klen)
+		return 0;
+	if (bit == 0)
+		return 1;
+	return (key[pos] >> (8 - bit)) & 1;
 }
 
 /* use callback to get key for a stored object */
-static inline const char *get_key(struct CBTree *tree, void *obj)
+static inline const unsigned char *get_key(struct CBTree *tree, void *obj, unsigned *klen_p)
 {
-	return tree->get_key(obj);
+	const char *key;
+	const void *bkey;
+
+	if (tree->get_key_len) {
+		*klen_p = tree->get_key_len(obj, &bkey);
+		return bkey;
+	}
+	key = tree->get_key(obj);
+	*klen_p = strlen(key);
+	return (const unsigned char *)key;
 }
 
-/* Find first differing bit on 2 zero-terminated strings.  */
-static unsigned find_crit_bit(const char *a, const char *b)
+/* Find first differing bit on 2 keys.  */
+static unsigned find_crit_bit(const unsigned char *a, unsigned alen,
+			      const unsigned char *b, unsigned blen)
 {
 	unsigned i, c, pos;
+	unsigned minlen = alen < blen ? alen : blen;
 
 	/* find differing byte */
-	for (i = 0; ; i++) {
-		/* this handles also size difference */
+	for (i = 0; i < minlen; i++) {
 		if (a[i] != b[i])
 			break;
-
-		/* equal strings? */
-		if (a[i] == 0)
-			return SAME_KEY;
 	}
 
+	/* one is prefix of other, differs on presence bit */
+	if (i == minlen)
+		return (alen == blen) ? SAME_KEY : i * 9;
+
 	/* calculate bits that differ */
 	c = a[i] ^ b[i];
 
 	/* find the first one */
-	pos = i * 8;
+	pos = i * 9 + 1;
 	while ((c & 0x80) == 0) {
 		c <<= 1;
 		pos++;
@@ -118,13 +145,19 @@ static unsigned find_crit_bit(const char *a, const char *b)
 	return pos;
 }
 
+static inline bool same_key(const unsigned char *a, unsigned alen,
+			    const unsigned char *b, unsigned blen)
+{
+	return alen == blen && memcmp(a, b, alen) == 0;
+}
+
 
 /*
  * Lookup
  */
 
 /* walk nodes until external pointer is found */
-static void *raw_lookup(struct CBTree *tree, const char *key, unsigned klen)
+static void *raw_lookup(struct CBTree *tree, const unsigned char *key, unsigned klen)
 {
 	struct Node *node = tree->root;
 	unsigned bit;
@@ -135,39 +168,70 @@ static void *raw_lookup(struct CBTree *tree, const char *key, unsigned klen)
 	return get_external(node);
 }
 
+/* leftmost object under node */
+static void *raw_lookup_from(struct Node *node)
+{
+	while (is_node(node))
+		node = node->child[0];
+	return get_external(node);
+}
+
 /* actual lookup.  returns obj ptr or NULL of not found */
-void *cbtree_lookup(struct CBTree *tree, const char *key)
+void *cbtree_lookup_len(struct CBTree *tree, const void *key, unsigned klen)
 {
-	unsigned klen;
+	const unsigned char *okey;
+	unsigned oklen;
 	void *obj;
 
 	if (!tree->root)
 		return NULL;
 
 	/* find match based on bits we know about */
-	klen = strlen(key);
 	obj = raw_lookup(tree, key, klen);
 
 	/* need to check if the object actually matches */
-	if (strcmp(key, get_key(tree, obj)) == 0)
+	okey = get_key(tree, obj, &oklen);
+	if (same_key(key, klen, okey, oklen))
 		return obj;
 
 	return NULL;
 }
 
+void *cbtree_lookup(struct CBTree *tree, const char *key)
+{
+	return cbtree_lookup_len(tree, key, strlen(key));
+}
+
 
 /*
  * Insertion.
  */
 
 /* node allocation */
-static struct Node *new_node(void)
+static struct Node *new_node(struct CBTree *tree)
 {
-	struct Node *node = malloc(sizeof(*node));
-	memset(node, 0, sizeof(*node));
+	struct Node *node;
+
+	if (tree->node_slab)
+		return slab_alloc(tree->node_slab);
+	if (tree->node_pool)
+		node = mempool_alloc(tree->node_pool, sizeof(*node));
+	else
+		node = malloc(sizeof(*node));
+	if (node)
+		memset(node, 0, sizeof(*node));
 	return node;
 }
 
+/* pool nodes are freed with the pool */
+static void free_node(struct CBTree *tree, struct Node *node)
+{
+	if (tree->node_slab)
+		slab_free(tree->node_slab, node);
+	else if (!tree->node_pool)
+		free(node);
+}
+
 /* insert into empty tree */
 static bool insert_first(struct CBTree *tree, void *obj)
 {
@@ -176,7 +240,7 @@ static bool insert_first(struct CBTree *tree, void *obj)
 }
 
 /* insert into specific bit-position */
-static bool insert_at(struct CBTree *tree, unsigned newbit, const char *key, unsigned klen, void *obj)
+static bool insert_at(struct CBTree *tree, unsigned newbit, const unsigned char *key, unsigned klen, void *obj)
 {
 	/* location of current node/obj pointer under examination */
 	struct Node **pos = &tree->root;
@@ -189,7 +253,7 @@ static bool insert_at(struct CBTree *tree, unsigned newbit, const char *key, uns
 	}
 
 	bit = get_bit(newbit, key, klen);
-	node = new_node();
+	node = new_node(tree);
 	if (!node)
 		return false;
 	node->bitpos = newbit;
@@ -202,20 +266,20 @@ static bool insert_at(struct CBTree *tree, unsigned newbit, const char *key, uns
 /* actual insert: returns true -> insert ok or key found, false -> malloc failure */
 bool cbtree_insert(struct CBTree *tree, void *obj)
 {
-	const char *key;
-	unsigned newbit, klen;
+	const unsigned char *key, *old_key;
+	unsigned newbit, klen, old_klen;
 	void *old_obj;
 
 	if (!tree->root)
 		return insert_first(tree, obj);
 
 	/* match bits we know about */
-	key = get_key(tree, obj);
-	klen = strlen(key);
+	key = get_key(tree, obj, &klen);
 	old_obj = raw_lookup(tree, key, klen);
 
 	/* first differing bit is the target position */
-	newbit = find_crit_bit(key, get_key(tree, old_obj));
+	old_key = get_key(tree, old_obj, &old_klen);
+	newbit = find_crit_bit(key, klen, old_key, old_klen);
 	if (newbit == SAME_KEY)
 		return true;
 	return insert_at(tree, newbit, key, klen, obj);
@@ -227,11 +291,12 @@ bool cbtree_insert(struct CBTree *tree, void *obj)
  */
 
 /* true -> object was found and removed, false -> not found */
-bool cbtree_delete(struct CBTree *tree, const char *key)
+bool cbtree_delete_len(struct CBTree *tree, const void *key, unsigned klen)
 {
+	const unsigned char *okey;
+	unsigned oklen;
 	void *obj, *tmp;
 	unsigned bit = 0;
-	unsigned klen = strlen(key);
 	/* location of current node/obj pointer under examination */
 	struct Node **pos = &tree->root;
 	/* if 'pos' has user obj, prev_pos has internal node pointing to it */
@@ -249,20 +314,118 @@ bool cbtree_delete(struct CBTree *tree, const char *key)
 
 	/* does the key actually matches */
 	obj = get_external(*pos);
-	if (strcmp(key, get_key(tree, obj)) != 0)
+	okey = get_key(tree, obj, &oklen);
+	if (!same_key(key, klen, okey, oklen))
 		return false;
 
 	/* drop the internal node pointing to our key */
 	if (prev_pos) {
 		tmp = *prev_pos;
 		*prev_pos = (*prev_pos)->child[bit ^ 1];
-		free(tmp);
+		free_node(tree, tmp);
 	} else {
 		tree->root = NULL;
 	}
 	return true;
 }
 
+bool cbtree_delete(struct CBTree *tree, const char *key)
+{
+	return cbtree_delete_len(tree, key, strlen(key));
+}
+
+/*
+ * Iteration, in key order.
+ */
+
+/* visit all objects under node */
+static bool walk_all(struct Node *node, cbtree_walker_func cb_func, void *cb_arg)
+{
+	if (!is_node(node))
+		return cb_func(cb_arg, get_external(node));
+	if (!walk_all(node->child[0], cb_func, cb_arg))
+		return false;
+	return walk_all(node->child[1], cb_func, cb_arg);
+}
+
+/* true -> walked all, false -> callback stopped it */
+bool cbtree_walk(struct CBTree *tree, cbtree_walker_func cb_func, void *cb_arg)
+{
+	if (!tree->root)
+		return true;
+	return walk_all(tree->root, cb_func, cb_arg);
+}
+
+/* all keys starting with prefix */
+bool cbtree_walk_prefix(struct CBTree *tree, const void *prefix, unsigned plen,
+			cbtree_walker_func cb_func, void *cb_arg)
+{
+	struct Node *node = tree->root;
+	const unsigned char *key;
+	unsigned klen, bit;
+
+	if (!node)
+		return true;
+
+	/* find subtree where all keys share prefix bits */
+	while (is_node(node) && node->bitpos < plen * 9) {
+		bit = get_bit(node->bitpos, prefix, plen);
+		node = node->child[bit];
+	}
+
+	/* check one leaf, whole subtree matches or none */
+	key = get_key(tree, raw_lookup_from(node), &klen);
+	if (klen < plen || memcmp(key, prefix, plen) != 0)
+		return true;
+	return walk_all(node, cb_func, cb_arg);
+}
+
+/*
+ * Walk keys >= start.  Subtree under first node with bitpos at or
+ * after crit bit is either fully below or fully above start,
+ * on the path above it right-side siblings are fully above.
+ */
+static bool walk_from(struct Node *node, unsigned crit, unsigned above,
+		      const unsigned char *key, unsigned klen,
+		      cbtree_walker_func cb_func, void *cb_arg)
+{
+	unsigned bit;
+
+	if (!is_node(node) || node->bitpos >= crit) {
+		if (above)
+			return walk_all(node, cb_func, cb_arg);
+		return true;
+	}
+
+	bit = get_bit(node->bitpos, key, klen);
+	if (!walk_from(node->child[bit], crit, above, key, klen, cb_func, cb_arg))
+		return false;
+	if (bit == 0)
+		return walk_all(node->child[1], cb_func, cb_arg);
+	return true;
+}
+
+/* keys >= start in order, stop by returning false from callback */
+bool cbtree_walk_from(struct CBTree *tree, const void *start, unsigned slen,
+		      cbtree_walker_func cb_func, void *cb_arg)
+{
+	const unsigned char *okey;
+	unsigned oklen, crit, above;
+	void *obj;
+
+	if (!tree->root)
+		return true;
+
+	obj = raw_lookup(tree, start, slen);
+	okey = get_key(tree, obj, &oklen);
+	crit = find_crit_bit(start, slen, okey, oklen);
+	if (crit == SAME_KEY)
+		above = 1;
+	else
+		above = get_bit(crit, okey, oklen);
+	return walk_from(tree->root, crit, above, start, slen, cb_func, cb_arg);
+}
+
 /*
  * Management.
  */
@@ -271,26 +434,158 @@ bool cbtree_delete(struct CBTree *tree, const char *key)
 struct CBTree *cbtree_create(cbtree_getkey_func get_key_fn)
 {
 	struct CBTree *tree = malloc(sizeof(*tree));
+	if (!tree)
+		return NULL;
 	tree->root = NULL;
 	tree->get_key = get_key_fn;
+	tree->get_key_len = NULL;
+	tree->node_slab = NULL;
+	tree->node_pool = NULL;
+	tree->own_slab = false;
 	return tree;
 }
 
+/* same, but for keys with explicit length */
+struct CBTree *cbtree_create_len(cbtree_getkey_len_func get_key_fn)
+{
+	struct CBTree *tree = cbtree_create(NULL);
+	if (tree)
+		tree->get_key_len = get_key_fn;
+	return tree;
+}
+
+/* forget previous allocator, private slab is empty as tree is */
+static void drop_allocator(struct CBTree *tree)
+{
+	if (tree->own_slab)
+		slab_destroy(tree->node_slab);
+	tree->node_slab = NULL;
+	tree->node_pool = NULL;
+	tree->own_slab = false;
+}
+
+/*
+ * Take internal nodes from slab or pool, tree must be empty.
+ * With NULL slab, private slab is created and freed as whole
+ * on destroy.  Pool nodes are not freed on delete.
+ */
+bool cbtree_use_slab(struct CBTree *tree, struct Slab *slab)
+{
+	bool own = false;
+
+	if (tree->root) {
+		errno = EBUSY;
+		return false;
+	}
+	if (!slab) {
+		slab = slab_create("cbtree_node", sizeof(struct Node), 0, NULL);
+		if (!slab)
+			return false;
+		own = true;
+	}
+	drop_allocator(tree);
+	tree->node_slab = slab;
+	tree->own_slab = own;
+	return true;
+}
+
+bool cbtree_use_pool(struct CBTree *tree, struct MemPool *pool)
+{
+	if (tree->root) {
+		errno = EBUSY;
+		return false;
+	}
+	drop_allocator(tree);
+	tree->node_pool = pool;
+	return true;
+}
+
+/*
+ * Bulk build.
+ *
+ * Crit-bit tree of sorted keys is the Cartesian tree of crit bits
+ * between neighbours, so it can be built in one pass by keeping
+ * the right spine on a stack.
+ */
+
+static void destroy_node(struct CBTree *tree, struct Node *node);
+
+bool cbtree_build(struct CBTree *tree, void **obj_list, unsigned count)
+{
+	const unsigned char *key, *prev_key;
+	unsigned klen, prev_klen, bit, i, depth = 0;
+	struct Node **spine, *node;
+
+	if (tree->root) {
+		errno = EBUSY;
+		return false;
+	}
+	if (count == 0)
+		return true;
+
+	spine = malloc(count * sizeof(struct Node *));
+	if (!spine)
+		return false;
+
+	tree->root = set_external(obj_list[0]);
+	prev_key = get_key(tree, obj_list[0], &prev_klen);
+	for (i = 1; i < count; i++) {
+		key = get_key(tree, obj_list[i], &klen);
+		bit = find_crit_bit(prev_key, prev_klen, key, klen);
+		if (bit == SAME_KEY || !get_bit(bit, key, klen)) {
+			errno = EINVAL;
+			goto failed;
+		}
+		node = new_node(tree);
+		if (!node)
+			goto failed;
+		node->bitpos = bit;
+		node->child[1] = set_external(obj_list[i]);
+
+		/* lower nodes on spine become left subtree */
+		while (depth > 0 && spine[depth - 1]->bitpos > bit)
+			depth--;
+		if (depth == 0) {
+			node->child[0] = tree->root;
+			tree->root = node;
+		} else {
+			node->child[0] = spine[depth - 1]->child[1];
+			spine[depth - 1]->child[1] = node;
+		}
+		spine[depth++] = node;
+
+		prev_key = key;
+		prev_klen = klen;
+	}
+	free(spine);
+	return true;
+
+failed:
+	free(spine);
+	if (is_node(tree->root))
+		destroy_node(tree, tree->root);
+	tree->root = NULL;
+	return false;
+}
+
 /* recursive freeing */
-static void destroy_node(struct Node *node)
+static void destroy_node(struct CBTree *tree, struct Node *node)
 {
 	if (is_node(node->child[0]))
-		destroy_node(node->child[0]);
+		destroy_node(tree, node->child[0]);
 	if (is_node(node->child[1]))
-		destroy_node(node->child[1]);
-	free(node);
+		destroy_node(tree, node->child[1]);
+	free_node(tree, node);
 }
 
 /* Free tree and all it's internal nodes. */
 void cbtree_destroy(struct CBTree *tree)
 {
-	if (tree->root && is_node(tree->root))
-		destroy_node(tree->root);
+	/* private slab and pool are freed as whole */
+	if (tree->own_slab)
+		slab_destroy(tree->node_slab);
+	else if (tree->root && is_node(tree->root) && !tree->node_pool)
+		destroy_node(tree, tree->root);
 	tree->root = NULL;
 	free(tree);
 }
@@ -23,15 +23,44 @@
 
 typedef const char *(*cbtree_getkey_func)(void *obj);
 
+/* return key length, store key pointer */
+typedef unsigned (*cbtree_getkey_len_func)(void *obj, const void **key_p);
+
+/* return false to stop walk */
+typedef bool (*cbtree_walker_func)(void *arg, void *obj);
+
 struct CBTree;
+struct Slab;
+struct MemPool;
 
 struct CBTree *cbtree_create(cbtree_getkey_func get_key_fn);
+struct CBTree *cbtree_create_len(cbtree_getkey_len_func get_key_fn);
 void cbtree_destroy(struct CBTree *tree);
 
+/* node allocation, only on empty tree */
+bool cbtree_use_slab(struct CBTree *tree, struct Slab *slab) _MUSTCHECK;
+bool cbtree_use_pool(struct CBTree *tree, struct MemPool *pool) _MUSTCHECK;
+
+/* fill empty tree from objects sorted by key, keys must be unique */
+bool cbtree_build(struct CBTree *tree, void **obj_list, unsigned count) _MUSTCHECK;
+
 bool cbtree_insert(struct CBTree *tree, void *obj) _MUSTCHECK;
 bool cbtree_delete(struct CBTree *tree, const char *key);
+bool cbtree_delete_len(struct CBTree *tree, const void *key, unsigned klen);
 
 void *cbtree_lookup(struct CBTree *tree, const char *key);
+void *cbtree_lookup_len(struct CBTree *tree, const void *key, unsigned klen);
+
+/*
+ * Walk in key order.  Return false if callback stopped the walk.
+ * Tree must not be modified meanwhile.
+ */
+bool cbtree_walk(struct CBTree *tree, cbtree_walker_func cb_func, void *cb_arg);
+bool cbtree_walk_prefix(struct CBTree *tree, const void *prefix, unsigned plen,
+			cbtree_walker_func cb_func, void *cb_arg);
+/* keys >= start, for ranges stop when past end */
+bool cbtree_walk_from(struct CBTree *tree, const void *start, unsigned slen,
+		      cbtree_walker_func cb_func, void *cb_arg);
 
 #endif
 
@@ -19,11 +19,15 @@
 #include <usual/cfparser.h>
 
 #include <ctype.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <usual/alloc.h>
 #include <usual/fileutil.h>
+#include <usual/hashmap.h>
 #include <usual/logging.h>
+#include <usual/mempool.h>
 #include <usual/time.h>
 
 /*
@@ -40,102 +44,163 @@ static int count_lines(const char *s, const char *end)
 	return lineno;
 }
 
-bool parse_ini_file(const char *fn, cf_handler_f user_handler, void *arg)
+static inline bool is_space(char c)
 {
-	char *buf;
-	char *p, *key, *val;
-	int klen, vlen;
-	char o1, o2;
-	bool ok;
+	return isspace((unsigned char)c);
+}
 
-	buf = load_file(fn);
-	if (buf == NULL)
-		return false;
+static inline bool is_keychar(char c)
+{
+	return isalnum((unsigned char)c) || (c && strchr("_.-*", c));
+}
 
-	p = buf;
-	while (*p) {
+/*
+ * Core parser, works on [buf, end) without writing
+ * to it or expecting NUL at end.
+ */
+static bool parse_ini_buf(const char *fn, const char *buf, const char *end,
+			  cf_slice_handler_f user_handler, void *arg)
+{
+	const char *p = buf, *key, *val;
+	unsigned klen, vlen;
+
+	while (p < end) {
 		/* space at the start of line - including empty lines */
-		while (*p && isspace(*p)) p++;
+		while (p < end && is_space(*p)) p++;
+
+		/* done? */
+		if (p >= end)
+			break;
 
 		/* skip comment lines */
 		if (*p == '#' || *p == ';') {
-			while (*p && *p != '\n') p++;
+			while (p < end && *p != '\n') p++;
 			continue;
 		}
 		/* got new section */
 		if (*p == '[') {
 			key = ++p;
-			while (*p && *p != ']' && *p != '\n') p++;
-			if (*p != ']')
+			while (p < end && *p != ']' && *p != '\n') p++;
+			if (p >= end || *p != ']')
 				goto syntax_error;
-			o1 = *p;
-			*p = 0;
-
-			log_debug("parse_ini_file: [%s]", key);
-			ok = user_handler(arg, CF_SECT, key, NULL);
-			*p++ = o1;
-			if (!ok)
-				goto failed;
+			klen = p++ - key;
+
+			log_debug("parse_ini_file: [%.*s]", klen, key);
+			if (!user_handler(arg, CF_SECT, key, klen, NULL, 0))
+				return false;
 			continue;
 		}
 
-		/* done? */
-		if (*p == 0)
-			break;
-
 		/* read key val */
 		key = p;
-		while (*p && (isalnum(*p) || strchr("_.-*", *p))) p++;
+		while (p < end && is_keychar(*p)) p++;
 		klen = p - key;
 
 		/* expect '=', skip it */
-		while (*p && (*p == ' ' || *p == '\t')) p++;
-		if (*p != '=') {
+		while (p < end && (*p == ' ' || *p == '\t')) p++;
+		if (p >= end || *p != '=')
 			goto syntax_error;
-		} else
-			p++;
-		while (*p && (*p == ' ' || *p == '\t')) p++;
+		p++;
+		while (p < end && (*p == ' ' || *p == '\t')) p++;
 
 		/* now read value */
 		val = p;
-		while (*p && (*p != '\n'))
+		while (p < end && *p != '\n')
 			p++;
 		vlen = p - val;
 		/* eat space at end */
-		while (vlen > 0 && isspace(val[vlen - 1]))
+		while (vlen > 0 && is_space(val[vlen - 1]))
 			vlen--;
 
 		/* skip junk */
-		while (*p && isspace(*p)) p++;
+		while (p < end && is_space(*p)) p++;
 
-		/* our buf is r/w, so take it easy */
-		o1 = key[klen];
-		o2 = val[vlen];
-		key[klen] = 0;
-		val[vlen] = 0;
+		log_debug("parse_ini_file: '%.*s' = '%.*s'", klen, key, vlen, val);
 
-		log_debug("parse_ini_file: '%s' = '%s'", key, val);
+		if (!user_handler(arg, CF_KEY, key, klen, val, vlen))
+			return false;
+	}
+	return true;
+
+syntax_error:
+	log_error("syntax error in configuration (%s:%d), stopping loading", fn, count_lines(buf, p));
+	return false;
+}
 
-		ok = user_handler(arg, CF_KEY, key, val);
+/* old-style handler on top of slices */
+struct StrHandler {
+	cf_handler_f user_handler;
+	void *arg;
+};
 
-		/* restore data, to keep count_lines() working */
-		key[klen] = o1;
-		val[vlen] = o2;
+static bool str_handler(void *arg, enum CfKeyType ktype,
+			const char *key, unsigned klen,
+			const char *val, unsigned vlen)
+{
+	struct StrHandler *h = arg;
+	char *k = (char *)key, *v = (char *)val;
+	char o1, o2 = 0;
+	bool ok;
 
-		if (!ok)
-			goto failed;
+	/* buffer from load_file() is r/w, so take it easy */
+	o1 = k[klen];
+	k[klen] = 0;
+	if (v) {
+		o2 = v[vlen];
+		v[vlen] = 0;
 	}
 
-	free(buf);
-	return true;
+	ok = h->user_handler(h->arg, ktype, k, v);
 
-syntax_error:
-	log_error("syntax error in configuration (%s:%d), stopping loading", fn, count_lines(buf, p));
-failed:
+	/* restore data, to keep count_lines() working */
+	k[klen] = o1;
+	if (v)
+		v[vlen] = o2;
+	return ok;
+}
+
+bool parse_ini_file(const char *fn, cf_handler_f user_handler, void *arg)
+{
+	struct StrHandler h = { user_handler, arg };
+	char *buf;
+	bool ok;
+
+	buf = load_file(fn);
+	if (buf == NULL)
+		return false;
+
+	ok = parse_ini_buf(fn, buf, buf + strlen(buf), str_handler, &h);
 	free(buf);
-	return false;
+	return ok;
 }
 
+bool parse_ini_mapped(const char *fn, cf_slice_handler_f user_handler, void *arg)
+{
+	struct MappedFile m;
+	ssize_t len;
+	bool ok;
+
+	/* mmap() does not like empty files */
+	len = file_size(fn);
+	if (len < 0) {
+		log_error("parse_ini_mapped: %s: %s", fn, strerror(errno));
+		return false;
+	}
+	if (len == 0)
+		return true;
+
+	if (map_file(&m, fn, 0) < 0) {
+		log_error("parse_ini_mapped: %s: %s", fn, strerror(errno));
+		return false;
+	}
+	ok = parse_ini_buf(fn, m.ptr, (char *)m.ptr + m.len, user_handler, arg);
+	unmap_file(&m);
+	return ok;
+}
+
+/* string storage for load_ini_file_pool() */
+static _TLS struct MemPool *cf_str_pool;
+
 struct LoaderCtx {
 	const struct CfSect *sect_list;
 	const struct CfSect *cur_sect;
@@ -157,25 +222,31 @@ static bool fill_defaults(struct LoaderCtx *ctx)
 	return true;
 }
 
+static bool start_section(struct LoaderCtx *ctx, const char *name, bool defaults)
+{
+	const struct CfSect *s;
+
+	for (s = ctx->sect_list; s->sect_name; s++) {
+		if (strcmp(s->sect_name, name) != 0)
+			continue;
+		ctx->cur_sect = s;
+		ctx->target = s->create_target_fn(ctx->top_arg);
+		if (!ctx->target)
+			return false;
+		return defaults ? fill_defaults(ctx) : true;
+	}
+	log_error("load_init_file: unknown section: %s", name);
+	return false;
+}
+
 static bool load_handler(void *arg, enum CfKeyType ktype, const char *key, const char *val)
 {
 	struct LoaderCtx *ctx = arg;
-	const struct CfSect *s;
 	const struct CfKey *k;
 	void *dst;
 
 	if (ktype == CF_SECT) {
-		for (s = ctx->sect_list; s->sect_name; s++) {
-			if (strcmp(s->sect_name, key) != 0)
-				continue;
-			ctx->cur_sect = s;
-			ctx->target = s->create_target_fn(ctx->top_arg);
-			if (!ctx->target)
-				return false;
-			return fill_defaults(ctx);
-		}
-		log_error("load_init_file: unknown section: %s", key);
-		return false;
+		return start_section(ctx, key, true);
 	} else if (!ctx->cur_sect) {
 		log_error("load_init_file: value without section: %s", key);
 		return false;
@@ -205,6 +276,370 @@ bool load_ini_file(const char *fn, const struct CfSect *sect_list, void *top_arg
 	return parse_ini_file(fn, load_handler, &ctx);
 }
 
+bool load_ini_file_pool(const char *fn, const struct CfSect *sect_list, void *top_arg,
+			struct MemPool *pool)
+{
+	bool res;
+
+	cf_str_pool = pool;
+	res = load_ini_file(fn, sect_list, top_arg);
+	cf_str_pool = NULL;
+	return res;
+}
+
+/*
+ * Config snapshots for incremental reload.
+ *
+ * Parsed file is copied into single pool.  Sections are
+ * identified by occurrence number + name, keys by section
+ * index + key name, both are found via hash maps.
+ */
+
+struct CfSnapKey {
+	struct CfSnapKey *next;
+	const char *val;
+	unsigned vlen;
+	unsigned klen;
+	/* section index + key name + NUL */
+	char ckey[];
+};
+
+struct CfSnapSect {
+	struct CfSnapSect *next;
+	/* last section with same name, valid in first one */
+	struct CfSnapSect *dup_last;
+	const char *name;
+	unsigned nlen;
+	unsigned index;
+	unsigned occur;
+	struct CfSnapKey *keys, **keys_tail;
+	/* occurrence + name + NUL */
+	char ckey[];
+};
+
+struct CfSnapshot {
+	struct MemPool *pool;
+	struct HashMap *sect_map;
+	struct HashMap *key_map;
+	struct CfSnapSect *sects, **sects_tail;
+	struct CfSnapSect *cur;
+	unsigned nsects;
+};
+
+#define CKEY_OFS sizeof(uint32_t)
+
+static inline const char *snap_key_name(const struct CfSnapKey *k)
+{
+	return k->ckey + CKEY_OFS;
+}
+
+static const void *snap_sect_getkey(void *obj, size_t *len_p)
+{
+	struct CfSnapSect *s = obj;
+	*len_p = CKEY_OFS + s->nlen;
+	return s->ckey;
+}
+
+static const void *snap_key_getkey(void *obj, size_t *len_p)
+{
+	struct CfSnapKey *k = obj;
+	*len_p = CKEY_OFS + k->klen;
+	return k->ckey;
+}
+
+/* index + name as map key, long names use heap, false on ENOMEM */
+static bool snap_lookup(struct HashMap *map, uint32_t idx, const char *name, unsigned nlen,
+			void **obj_p)
+{
+	char sbuf[CKEY_OFS + 128];
+	char *buf = sbuf;
+
+	if (nlen > sizeof(sbuf) - CKEY_OFS) {
+		buf = malloc(CKEY_OFS + nlen);
+		if (!buf)
+			return false;
+	}
+	memcpy(buf, &idx, CKEY_OFS);
+	memcpy(buf + CKEY_OFS, name, nlen);
+	*obj_p = hashmap_lookup(map, buf, CKEY_OFS + nlen);
+	if (buf != sbuf)
+		free(buf);
+	return true;
+}
+
+static bool snap_find_sect(struct CfSnapshot *snap, const char *name, unsigned nlen,
+			   unsigned occur, struct CfSnapSect **sect_p)
+{
+	void *obj;
+
+	if (!snap_lookup(snap->sect_map, occur, name, nlen, &obj))
+		return false;
+	*sect_p = obj;
+	return true;
+}
+
+static bool snap_find_key(struct CfSnapshot *snap, const struct CfSnapSect *sect,
+			  const char *key, unsigned klen, struct CfSnapKey **key_p)
+{
+	void *obj;
+
+	if (!snap_lookup(snap->key_map, sect->index, key, klen, &obj))
+		return false;
+	*key_p = obj;
+	return true;
+}
+
+static bool snap_add_sect(struct CfSnapshot *snap, const char *name, unsigned nlen)
+{
+	struct CfSnapSect *s, *first;
+	uint32_t idx;
+
+	s = mempool_zalloc(snap->pool, sizeof(*s) + CKEY_OFS + nlen + 1);
+	if (!s)
+		return false;
+	s->name = s->ckey + CKEY_OFS;
+	memcpy(s->ckey + CKEY_OFS, name, nlen);
+	s->nlen = nlen;
+	s->index = snap->nsects++;
+	s->keys_tail = &s->keys;
+
+	if (!snap_find_sect(snap, name, nlen, 0, &first))
+		return false;
+	if (first) {
+		s->occur = first->dup_last->occur + 1;
+		first->dup_last = s;
+	} else {
+		s->dup_last = s;
+	}
+	idx = s->occur;
+	memcpy(s->ckey, &idx, CKEY_OFS);
+	if (!hashmap_insert(snap->sect_map, s))
+		return false;
+
+	*snap->sects_tail = s;
+	snap->sects_tail = &s->next;
+	snap->cur = s;
+	return true;
+}
+
+static bool snap_add_key(struct CfSnapshot *snap, const char *key, unsigned klen,
+			 const char *val, unsigned vlen)
+{
+	struct CfSnapSect *s = snap->cur;
+	struct CfSnapKey *k;
+	uint32_t idx;
+
+	if (!s) {
+		log_error("load_init_file: value without section: %.*s", klen, key);
+		return false;
+	}
+
+	/* last value wins, as with setters */
+	if (!snap_find_key(snap, s, key, klen, &k))
+		return false;
+	if (!k) {
+		k = mempool_alloc(snap->pool, sizeof(*k) + CKEY_OFS + klen + 1);
+		if (!k)
+			return false;
+		idx = s->index;
+		memcpy(k->ckey, &idx, CKEY_OFS);
+		memcpy(k->ckey + CKEY_OFS, key, klen);
+		k->ckey[CKEY_OFS + klen] = 0;
+		k->klen = klen;
+		k->next = NULL;
+		if (!hashmap_insert(snap->key_map, k))
+			return false;
+		*s->keys_tail = k;
+		s->keys_tail = &k->next;
+	}
+	k->val = mempool_strndup(snap->pool, val, vlen);
+	if (!k->val)
+		return false;
+	k->vlen = vlen;
+	return true;
+}
+
+static bool snap_handler(void *arg, enum CfKeyType ktype,
+			 const char *key, unsigned klen,
+			 const char *val, unsigned vlen)
+{
+	struct CfSnapshot *snap = arg;
+
+	if (ktype == CF_SECT)
+		return snap_add_sect(snap, key, klen);
+	return snap_add_key(snap, key, klen, val, vlen);
+}
+
+void cf_snapshot_free(struct CfSnapshot *snap)
+{
+	if (!snap)
+		return;
+	hashmap_destroy(snap->sect_map);
+	hashmap_destroy(snap->key_map);
+	mempool_destroy(snap->pool);
+	free(snap);
+}
+
+struct CfSnapshot *cf_snapshot_load(const char *fn)
+{
+	struct CfSnapshot *snap;
+	ssize_t fsize;
+
+	snap = zmalloc(sizeof(*snap));
+	if (!snap)
+		return NULL;
+	snap->sects_tail = &snap->sects;
+
+	/* strings take roughly file size */
+	fsize = file_size(fn);
+	snap->pool = mempool_create(fsize > 0 ? (size_t)fsize + 1024 : 0);
+	snap->sect_map = hashmap_create(snap_sect_getkey, 0);
+	snap->key_map = hashmap_create(snap_key_getkey, 0);
+	if (!snap->pool || !snap->sect_map || !snap->key_map)
+		goto failed;
+
+	if (!parse_ini_mapped(fn, snap_handler, snap))
+		goto failed;
+	snap->cur = NULL;
+	return snap;
+
+failed:
+	cf_snapshot_free(snap);
+	return NULL;
+}
+
+/* emit SECT_CHANGED once, before first change in section */
+static bool diff_touch(bool *touched, const struct CfSnapSect *s,
+		       cf_diff_f diff_cb, void *arg)
+{
+	if (*touched)
+		return true;
+	*touched = true;
+	return diff_cb(arg, CF_DIFF_SECT_CHANGED, s->name, NULL, NULL);
+}
+
+static bool diff_sect(struct CfSnapshot *old, struct CfSnapSect *os,
+		      struct CfSnapshot *new, struct CfSnapSect *s,
+		      cf_diff_f diff_cb, void *arg)
+{
+	struct CfSnapKey *k, *ok;
+	bool touched = false;
+
+	for (k = s->keys; k; k = k->next) {
+		if (!snap_find_key(old, os, snap_key_name(k), k->klen, &ok))
+			return false;
+		if (ok && ok->vlen == k->vlen && memcmp(ok->val, k->val, k->vlen) == 0)
+			continue;
+		if (!diff_touch(&touched, s, diff_cb, arg))
+			return false;
+		if (!diff_cb(arg, CF_DIFF_KEY_SET, s->name, snap_key_name(k), k->val))
+			return false;
+	}
+	for (ok = os->keys; ok; ok = ok->next) {
+		if (!snap_find_key(new, s, snap_key_name(ok), ok->klen, &k))
+			return false;
+		if (k)
+			continue;
+		if (!diff_touch(&touched, s, diff_cb, arg))
+			return false;
+		if (!diff_cb(arg, CF_DIFF_KEY_REMOVED, s->name, snap_key_name(ok), NULL))
+			return false;
+	}
+	return true;
+}
+
+bool cf_snapshot_diff(struct CfSnapshot *old, struct CfSnapshot *new,
+		      cf_diff_f diff_cb, void *arg)
+{
+	struct CfSnapSect *s, *os;
+	struct CfSnapKey *k;
+
+	for (s = new->sects; s; s = s->next) {
+		os = NULL;
+		if (old && !snap_find_sect(old, s->name, s->nlen, s->occur, &os))
+			return false;
+		if (os) {
+			if (!diff_sect(old, os, new, s, diff_cb, arg))
+				return false;
+			continue;
+		}
+		if (!diff_cb(arg, CF_DIFF_SECT_ADDED, s->name, NULL, NULL))
+			return false;
+		for (k = s->keys; k; k = k->next) {
+			if (!diff_cb(arg, CF_DIFF_KEY_SET, s->name, snap_key_name(k), k->val))
+				return false;
+		}
+	}
+
+	if (!old)
+		return true;
+	for (os = old->sects; os; os = os->next) {
+		if (!snap_find_sect(new, os->name, os->nlen, os->occur, &s))
+			return false;
+		if (s)
+			continue;
+		if (!diff_cb(arg, CF_DIFF_SECT_REMOVED, os->name, NULL, NULL))
+			return false;
+	}
+	return true;
+}
+
+static bool diff_load_handler(void *arg, enum CfDiffOp op, const char *sect,
+			      const char *key, const char *val)
+{
+	struct LoaderCtx *ctx = arg;
+	const struct CfKey *k;
+
+	switch (op) {
+	case CF_DIFF_SECT_ADDED:
+		return start_section(ctx, sect, true);
+	case CF_DIFF_SECT_CHANGED:
+		return start_section(ctx, sect, false);
+	case CF_DIFF_KEY_SET:
+		return load_handler(ctx, CF_KEY, key, val);
+	case CF_DIFF_KEY_REMOVED:
+		for (k = ctx->cur_sect->key_list; k->key_name; k++) {
+			if (strcmp(k->key_name, key) != 0)
+				continue;
+			if (!k->def_value) {
+				log_info("load_ini_file: key %s removed from [%s], keeping old value", key, sect);
+				return true;
+			}
+			return k->set_fn((char *)ctx->target + k->key_ofs, k->def_value);
+		}
+		return true;
+	case CF_DIFF_SECT_REMOVED:
+		log_info("load_ini_file: section [%s] removed, ignoring", sect);
+		return true;
+	}
+	return true;
+}
+
+bool load_ini_file_diff(const char *fn, const struct CfSect *sect_list, void *top_arg,
+			struct CfSnapshot **snap_p)
+{
+	struct LoaderCtx ctx = {
+		.top_arg = top_arg,
+		.sect_list = sect_list,
+		.cur_sect = NULL,
+		.target = NULL,
+	};
+	struct CfSnapshot *snap;
+
+	snap = cf_snapshot_load(fn);
+	if (!snap)
+		return false;
+
+	if (!cf_snapshot_diff(*snap_p, snap, diff_load_handler, &ctx)) {
+		/* keep old one, next reload diffs against it again */
+		cf_snapshot_free(snap);
+		return false;
+	}
+	cf_snapshot_free(*snap_p);
+	*snap_p = snap;
+	return true;
+}
+
 /*
  * Various value parsers.
  */
@@ -219,8 +654,18 @@ bool cf_set_int(void *dst, const char *value)
 bool cf_set_str(void *dst, const char *value)
 {
 	char **dst_p = dst;
+	char *tmp;
+
+	/* old value belongs to pool too */
+	if (cf_str_pool) {
+		tmp = mempool_strdup(cf_str_pool, value);
+		if (!tmp)
+			return false;
+		*dst_p = tmp;
+		return true;
+	}
 
-	char *tmp = strdup(value);
+	tmp = strdup(value);
 	if (!tmp)
 		return false;
 	if (*dst_p)
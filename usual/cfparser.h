@@ -34,6 +34,17 @@ typedef bool (*cf_handler_f)(void *arg, enum CfKeyType, const char *key, const c
 
 bool parse_ini_file(const char *fn, cf_handler_f user_handler, void *arg) _MUSTCHECK;
 
+/*
+ * Parse directly from mmap()-ed file.  Key and value are given
+ * as slices into mapping, they are not NUL-terminated and are
+ * valid only during callback.  For CF_SECT val is NULL.
+ */
+typedef bool (*cf_slice_handler_f)(void *arg, enum CfKeyType,
+				   const char *key, unsigned klen,
+				   const char *val, unsigned vlen);
+
+bool parse_ini_mapped(const char *fn, cf_slice_handler_f user_handler, void *arg) _MUSTCHECK;
+
 /*
  * Fancier one.
  */
@@ -56,6 +67,48 @@ struct CfSect {
 
 bool load_ini_file(const char *fn, const struct CfSect *sect_list, void *top_arg) _MUSTCHECK;
 
+/*
+ * Same, but cf_set_str() takes strings from pool and does not
+ * free old values.  Whole config is released with the pool.
+ */
+struct MemPool;
+bool load_ini_file_pool(const char *fn, const struct CfSect *sect_list, void *top_arg,
+			struct MemPool *pool) _MUSTCHECK;
+
+/*
+ * Incremental reload.  Snapshot keeps parsed copy of file,
+ * diff reports what changed between two snapshots.
+ */
+struct CfSnapshot;
+
+enum CfDiffOp {
+	CF_DIFF_SECT_ADDED,	/* all its keys follow as KEY_SET */
+	CF_DIFF_SECT_CHANGED,	/* only changed keys follow */
+	CF_DIFF_SECT_REMOVED,
+	CF_DIFF_KEY_SET,	/* key is new or value differs */
+	CF_DIFF_KEY_REMOVED,	/* val is NULL */
+};
+
+typedef bool (*cf_diff_f)(void *arg, enum CfDiffOp op, const char *sect,
+			  const char *key, const char *val);
+
+struct CfSnapshot *cf_snapshot_load(const char *fn) _MUSTCHECK;
+void cf_snapshot_free(struct CfSnapshot *snap);
+
+/* old can be NULL, then everything in new is added; false on callback failure or ENOMEM */
+bool cf_snapshot_diff(struct CfSnapshot *old, struct CfSnapshot *new,
+		      cf_diff_f diff_cb, void *arg) _MUSTCHECK;
+
+/*
+ * Like load_ini_file(), but calls setters only for keys that
+ * changed since snapshot in *snap_p, which is then replaced.
+ * Start with *snap_p == NULL.  Defaults are filled only for
+ * new sections, removed keys get default value if there is one.
+ * create_target_fn must return same object for same section.
+ */
+bool load_ini_file_diff(const char *fn, const struct CfSect *sect_list, void *top_arg,
+			struct CfSnapshot **snap_p) _MUSTCHECK;
+
 bool cf_set_str(void *dst, const char *value);
 bool cf_set_int(void *dst, const char *value);
 bool cf_set_time_usec(void *dst, const char *value);
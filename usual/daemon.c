@@ -20,16 +20,23 @@
 #include <usual/daemon.h>
 
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/select.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sched.h>
 #include <signal.h>
 #include <string.h>
 #include <stdio.h>
 
 #include <usual/logging.h>
+#include <usual/safeio.h>
+#include <usual/slab.h>
 
 /*
  * pidfile management.
@@ -187,6 +194,557 @@ void daemonize(const char *pidfile, bool go_background)
 	if (pid > 0)
 		_exit(0);
 
+	/* logging caches pid */
+	log_reset_pid();
+
 	write_pidfile(pidfile);
 }
 
+/*
+ * Prefork supervisor.
+ */
+
+/* worker exiting sooner than that after start is crashing */
+#define CRASH_WINDOW USEC
+
+#define DEFAULT_RESTART_DELAY USEC
+#define DEFAULT_STOP_TIMEOUT (10 * USEC)
+
+/* stats reader gives up on slot that stays busy */
+#define COLLECT_TRIES 1000
+
+struct PreforkShared {
+	unsigned nworkers;
+	struct PreforkStats slots[];
+};
+
+/* supervisor-side slot state */
+struct PreforkSlot {
+	int fd;
+	pid_t pid;
+	usec_t started;
+	usec_t restart_at;
+	/* previous generation, until it exits */
+	pid_t old_pid;
+	usec_t old_deadline;
+};
+
+struct Prefork {
+	const struct PreforkConfig *cf;
+	struct PreforkShared *shared;
+	size_t shared_size;
+	struct PreforkSlot slots[PREFORK_MAX_WORKERS];
+	unsigned generation;
+	sigset_t old_mask;
+	bool stopping;
+	usec_t stop_deadline;
+};
+
+static volatile sig_atomic_t pf_got_chld, pf_got_hup, pf_got_term;
+
+static const int pf_signals[] = { SIGCHLD, SIGHUP, SIGTERM, SIGINT };
+#define PF_NSIG (sizeof(pf_signals) / sizeof(pf_signals[0]))
+
+static void pf_sig_handler(int sig)
+{
+	if (sig == SIGCHLD)
+		pf_got_chld = 1;
+	else if (sig == SIGHUP)
+		pf_got_hup = 1;
+	else
+		pf_got_term = 1;
+}
+
+static void pf_signals_setup(struct Prefork *pf)
+{
+	struct sigaction sa;
+	sigset_t set;
+	unsigned i;
+
+	sigemptyset(&set);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = pf_sig_handler;
+	sigemptyset(&sa.sa_mask);
+	for (i = 0; i < PF_NSIG; i++) {
+		sigaddset(&set, pf_signals[i]);
+		sigaction(pf_signals[i], &sa, NULL);
+	}
+	/* delivered only inside pselect() */
+	sigprocmask(SIG_BLOCK, &set, &pf->old_mask);
+}
+
+static void pf_signals_reset(struct Prefork *pf)
+{
+	struct sigaction sa;
+	unsigned i;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_DFL;
+	sigemptyset(&sa.sa_mask);
+	for (i = 0; i < PF_NSIG; i++)
+		sigaction(pf_signals[i], &sa, NULL);
+	sigprocmask(SIG_SETMASK, &pf->old_mask, NULL);
+}
+
+/* unix sockets cannot be bound twice, slots share one */
+static bool pf_open_listeners(struct Prefork *pf)
+{
+	const struct PreforkConfig *cf = pf->cf;
+	unsigned i;
+
+	for (i = 0; i < cf->nworkers; i++) {
+		if (cf->listen_addr->sa_family == AF_UNIX && i > 0)
+			pf->slots[i].fd = dup(pf->slots[0].fd);
+		else
+			pf->slots[i].fd = socket_listen(cf->listen_addr, cf->listen_addr_len, cf->backlog,
+						       cf->listen_addr->sa_family == AF_UNIX ? 0 : SOCKET_REUSEPORT,
+						       cf->profile);
+		if (pf->slots[i].fd < 0)
+			return false;
+	}
+	return true;
+}
+
+static void pf_worker_main(struct Prefork *pf, unsigned idx)
+{
+	struct PreforkStats *st = &pf->shared->slots[idx];
+	struct PreforkWorker w;
+	unsigned i;
+	int res;
+
+	/* pidfile belongs to supervisor */
+	free(g_pidfile);
+	g_pidfile = NULL;
+	log_reset_pid();
+	pf_signals_reset(pf);
+
+	for (i = 0; i < pf->cf->nworkers; i++) {
+		if (i != idx)
+			safe_close(pf->slots[i].fd);
+	}
+
+	/* supervisor sets it too, whoever is first */
+	__atomic_store_n(&st->pid, getpid(), __ATOMIC_RELAXED);
+
+	memset(&w, 0, sizeof(w));
+	w.index = idx;
+	w.generation = pf->generation;
+	w.listen_fd = pf->slots[idx].fd;
+	w.shared = pf->shared;
+	res = pf->cf->worker_func(&w, pf->cf->worker_arg);
+	exit(res);
+}
+
+static void pf_spawn(struct Prefork *pf, unsigned idx)
+{
+	struct PreforkSlot *slot = &pf->slots[idx];
+	struct PreforkStats *st = &pf->shared->slots[idx];
+	usec_t now = get_monotonic_usec();
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		log_error("prefork: fork failed: %s", strerror(errno));
+		slot->pid = 0;
+		slot->restart_at = now + pf->cf->restart_delay;
+		return;
+	}
+	if (pid == 0)
+		pf_worker_main(pf, idx);
+
+	slot->pid = pid;
+	slot->started = now;
+	slot->restart_at = 0;
+	__atomic_store_n(&st->pid, pid, __ATOMIC_RELAXED);
+	st->generation = pf->generation;
+	st->start_time = get_time_usec();
+	log_info("prefork: worker %u started, pid %d, generation %u", idx, (int)pid, pf->generation);
+}
+
+/* new generation on same sockets, then retire old one */
+static void pf_reload(struct Prefork *pf)
+{
+	struct PreforkSlot *slot;
+	unsigned i;
+	pid_t old;
+
+	pf->generation++;
+	log_info("prefork: reload, generation %u", pf->generation);
+	for (i = 0; i < pf->cf->nworkers; i++) {
+		slot = &pf->slots[i];
+		/* retiring too slowly from previous reload */
+		if (slot->old_pid > 0)
+			kill(slot->old_pid, SIGKILL);
+
+		old = slot->pid;
+		pf_spawn(pf, i);
+		slot->old_pid = old;
+		if (old > 0) {
+			kill(old, SIGTERM);
+			slot->old_deadline = get_monotonic_usec() + pf->cf->stop_timeout;
+		}
+	}
+}
+
+static void pf_log_exit(unsigned idx, pid_t pid, int status, const char *what)
+{
+	if (WIFSIGNALED(status))
+		log_warning("prefork: %s worker %u (pid %d) killed by signal %d",
+			    what, idx, (int)pid, WTERMSIG(status));
+	else if (WEXITSTATUS(status) != 0)
+		log_warning("prefork: %s worker %u (pid %d) exited with %d",
+			    what, idx, (int)pid, WEXITSTATUS(status));
+	else
+		log_info("prefork: %s worker %u (pid %d) exited", what, idx, (int)pid);
+}
+
+/* release write side if dead worker held it, half-done write is discarded */
+static void pf_release_writer(struct PreforkStats *st, pid_t pid)
+{
+	uint32_t seq;
+
+	if (__atomic_load_n(&st->writer, __ATOMIC_ACQUIRE) != pid)
+		return;
+	seq = __atomic_load_n(&st->seq, __ATOMIC_RELAXED);
+	if (seq & 1)
+		__atomic_store_n(&st->seq, seq + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&st->writer, 0, __ATOMIC_RELEASE);
+}
+
+static void pf_reap(struct Prefork *pf)
+{
+	struct PreforkSlot *slot;
+	usec_t now;
+	unsigned i;
+	int status;
+	pid_t pid;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		now = get_monotonic_usec();
+		for (i = 0; i < pf->cf->nworkers; i++) {
+			slot = &pf->slots[i];
+			if (slot->old_pid == pid) {
+				pf_log_exit(i, pid, status, "old");
+				pf_release_writer(&pf->shared->slots[i], pid);
+				slot->old_pid = 0;
+				break;
+			}
+			if (slot->pid != pid)
+				continue;
+
+			pf_log_exit(i, pid, status, "current");
+			slot->pid = 0;
+			__atomic_store_n(&pf->shared->slots[i].pid, 0, __ATOMIC_RELAXED);
+			pf_release_writer(&pf->shared->slots[i], pid);
+			if (pf->stopping)
+				break;
+
+			/* restart, with delay if crash loop */
+			pf->shared->slots[i].restarts++;
+			if (now - slot->started < CRASH_WINDOW)
+				slot->restart_at = now + pf->cf->restart_delay;
+			else
+				slot->restart_at = now;
+			break;
+		}
+	}
+}
+
+static void pf_stop(struct Prefork *pf)
+{
+	unsigned i;
+
+	log_info("prefork: stopping workers");
+	pf->stopping = true;
+	pf->stop_deadline = get_monotonic_usec() + pf->cf->stop_timeout;
+	for (i = 0; i < pf->cf->nworkers; i++) {
+		if (pf->slots[i].pid > 0)
+			kill(pf->slots[i].pid, SIGTERM);
+		if (pf->slots[i].old_pid > 0)
+			kill(pf->slots[i].old_pid, SIGTERM);
+	}
+}
+
+/* start due restarts, kill overdue workers, returns time of next action or 0 */
+static usec_t pf_timers(struct Prefork *pf, bool *done_p)
+{
+	struct PreforkSlot *slot;
+	usec_t now = get_monotonic_usec(), next = 0;
+	bool alive = false;
+	unsigned i;
+
+#define NEXT(t) do { if (!next || (t) < next) next = (t); } while (0)
+	for (i = 0; i < pf->cf->nworkers; i++) {
+		slot = &pf->slots[i];
+		if (!pf->stopping && slot->pid == 0) {
+			if (slot->restart_at <= now)
+				pf_spawn(pf, i);
+			else
+				NEXT(slot->restart_at);
+		}
+		if (slot->old_pid > 0) {
+			if (slot->old_deadline <= now) {
+				log_warning("prefork: old worker %u (pid %d) did not exit, killing",
+					    i, (int)slot->old_pid);
+				kill(slot->old_pid, SIGKILL);
+				slot->old_deadline = now + pf->cf->stop_timeout;
+			}
+			NEXT(slot->old_deadline);
+		}
+		if ((slot->pid > 0 || slot->old_pid > 0) && pf->stopping) {
+			alive = true;
+			if (pf->stop_deadline <= now) {
+				if (slot->pid > 0)
+					kill(slot->pid, SIGKILL);
+				if (slot->old_pid > 0)
+					kill(slot->old_pid, SIGKILL);
+			}
+		}
+	}
+	if (pf->stopping && alive) {
+		if (pf->stop_deadline <= now)
+			pf->stop_deadline = now + pf->cf->stop_timeout;
+		NEXT(pf->stop_deadline);
+	}
+#undef NEXT
+	*done_p = pf->stopping && !alive;
+	return next;
+}
+
+static void pf_cleanup(struct Prefork *pf)
+{
+	unsigned i;
+
+	for (i = 0; i < pf->cf->nworkers; i++) {
+		if (pf->slots[i].fd >= 0)
+			safe_close(pf->slots[i].fd);
+	}
+	if (pf->shared)
+		munmap(pf->shared, pf->shared_size);
+}
+
+int prefork_run(const struct PreforkConfig *cf)
+{
+	struct PreforkConfig cfcopy = *cf;
+	struct Prefork pf;
+	struct timespec ts;
+	usec_t next, now;
+	bool done = false;
+	unsigned i;
+	int err;
+
+	if (cf->nworkers == 0 || cf->nworkers > PREFORK_MAX_WORKERS || !cf->worker_func || !cf->listen_addr) {
+		errno = EINVAL;
+		return -1;
+	}
+	/* workers would inherit queue without writer thread */
+	if (log_async_running()) {
+		log_error("prefork: stop async logging before prefork_run()");
+		errno = EBUSY;
+		return -1;
+	}
+	if (!cfcopy.restart_delay)
+		cfcopy.restart_delay = DEFAULT_RESTART_DELAY;
+	if (!cfcopy.stop_timeout)
+		cfcopy.stop_timeout = DEFAULT_STOP_TIMEOUT;
+
+	memset(&pf, 0, sizeof(pf));
+	pf.cf = &cfcopy;
+	for (i = 0; i < PREFORK_MAX_WORKERS; i++)
+		pf.slots[i].fd = -1;
+
+	/* anonymous shared mapping survives in all children */
+	pf.shared_size = sizeof(struct PreforkShared) + cf->nworkers * sizeof(struct PreforkStats);
+	pf.shared = mmap(NULL, pf.shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (pf.shared == MAP_FAILED) {
+		pf.shared = NULL;
+		return -1;
+	}
+	pf.shared->nworkers = cf->nworkers;
+
+	if (!pf_open_listeners(&pf)) {
+		err = errno;
+		pf_cleanup(&pf);
+		errno = err;
+		return -1;
+	}
+
+	pf_signals_setup(&pf);
+	for (i = 0; i < cf->nworkers; i++)
+		pf_spawn(&pf, i);
+
+	while (1) {
+		if (pf_got_chld) {
+			pf_got_chld = 0;
+			pf_reap(&pf);
+		}
+		if (pf_got_term && !pf.stopping)
+			pf_stop(&pf);
+		if (pf_got_hup) {
+			pf_got_hup = 0;
+			if (!pf.stopping)
+				pf_reload(&pf);
+		}
+
+		next = pf_timers(&pf, &done);
+		if (done)
+			break;
+
+		/* signals are unblocked only while waiting */
+		if (next) {
+			now = get_monotonic_usec();
+			next = next > now ? next - now : 0;
+			ts.tv_sec = next / USEC;
+			ts.tv_nsec = (next % USEC) * 1000;
+		}
+		if (!pf_got_chld && !pf_got_hup && !(pf_got_term && !pf.stopping))
+			pselect(0, NULL, NULL, NULL, next ? &ts : NULL, &pf.old_mask);
+	}
+
+	pf_signals_reset(&pf);
+	pf_got_term = 0;
+	pf_cleanup(&pf);
+	log_info("prefork: all workers stopped");
+	return 0;
+}
+
+/*
+ * Worker-side stats.
+ */
+
+void prefork_counter_add(struct PreforkWorker *w, unsigned counter, uint64_t delta)
+{
+	if (counter < PREFORK_COUNTERS)
+		__atomic_fetch_add(&w->shared->slots[w->index].counters[counter], delta, __ATOMIC_RELAXED);
+}
+
+static void pf_slab_sum(void *arg, const struct SlabStats *s)
+{
+	struct PreforkStats *st = arg;
+	st->slab_objects += s->total;
+	st->slab_free += s->free;
+	st->slab_bytes += (uint64_t)s->frag_count * s->frag_size;
+}
+
+void prefork_publish_stats(struct PreforkWorker *w, struct event_base *base)
+{
+	struct PreforkStats *st = &w->shared->slots[w->index];
+	struct PreforkStats tmp;
+	pid_t me = getpid(), free_pid = 0;
+	uint32_t seq;
+
+	if (__atomic_load_n(&st->pid, __ATOMIC_RELAXED) != me)
+		return;
+
+	memset(&tmp, 0, sizeof(tmp));
+	if (base && event_base_get_stats(base, &tmp.loop) < 0)
+		memset(&tmp.loop, 0, sizeof(tmp.loop));
+	slab_stats_ext(pf_slab_sum, &tmp);
+
+	/* other generation is writing, skip this round */
+	if (!__atomic_compare_exchange_n(&st->writer, &free_pid, me, false,
+					 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+	/* old generation does not overwrite new one */
+	if (__atomic_load_n(&st->pid, __ATOMIC_RELAXED) != me) {
+		__atomic_store_n(&st->writer, 0, __ATOMIC_RELEASE);
+		return;
+	}
+
+	/* odd seq means write in progress */
+	seq = __atomic_load_n(&st->seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&st->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	st->publish_time = get_time_usec();
+	st->loop = tmp.loop;
+	st->slab_objects = tmp.slab_objects;
+	st->slab_free = tmp.slab_free;
+	st->slab_bytes = tmp.slab_bytes;
+	__atomic_store_n(&st->seq, seq + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&st->writer, 0, __ATOMIC_RELEASE);
+}
+
+/* writer may be stopped or dead, do not wait for it forever */
+static void collect_one(const struct PreforkStats *st, struct PreforkStats *dst)
+{
+	uint32_t s1, s2;
+	int tries;
+
+	for (tries = 0; tries < COLLECT_TRIES; tries++) {
+		s1 = __atomic_load_n(&st->seq, __ATOMIC_ACQUIRE);
+		memcpy(dst, st, sizeof(*st));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		s2 = __atomic_load_n(&st->seq, __ATOMIC_RELAXED);
+		if (!(s1 & 1) && s1 == s2)
+			return;
+		sched_yield();
+	}
+
+	/* fields outside seqlock are fine */
+	dst->publish_time = 0;
+	memset(&dst->loop, 0, sizeof(dst->loop));
+	dst->slab_objects = dst->slab_free = dst->slab_bytes = 0;
+}
+
+unsigned prefork_collect_stats(struct PreforkShared *shared, struct PreforkStats *dst, unsigned max)
+{
+	unsigned i, n = shared->nworkers;
+
+	if (n > max)
+		n = max;
+	for (i = 0; i < n; i++)
+		collect_one(&shared->slots[i], &dst[i]);
+	return n;
+}
+
+/* keep slowest callbacks over all workers */
+static void merge_slowest(struct EventBaseStats *dst, const struct EventCallbackStat *cs)
+{
+	unsigned i, min = 0;
+
+	if (!cs->cb_func)
+		return;
+	for (i = 1; i < EVENT_STATS_SLOWEST; i++) {
+		if (dst->slowest[i].max_usec < dst->slowest[min].max_usec)
+			min = i;
+	}
+	if (cs->max_usec > dst->slowest[min].max_usec)
+		dst->slowest[min] = *cs;
+}
+
+void prefork_sum_stats(struct PreforkShared *shared, struct PreforkStats *total)
+{
+	struct EventBaseStats *dl = &total->loop;
+	struct PreforkStats st;
+	unsigned i, j;
+
+	memset(total, 0, sizeof(*total));
+	for (i = 0; i < shared->nworkers; i++) {
+		collect_one(&shared->slots[i], &st);
+
+		if (st.generation > total->generation)
+			total->generation = st.generation;
+		total->restarts += st.restarts;
+		for (j = 0; j < PREFORK_COUNTERS; j++)
+			total->counters[j] += st.counters[j];
+		if (st.publish_time > total->publish_time)
+			total->publish_time = st.publish_time;
+		total->slab_objects += st.slab_objects;
+		total->slab_free += st.slab_free;
+		total->slab_bytes += st.slab_bytes;
+
+		dl->iterations += st.loop.iterations;
+		dl->poll_usec += st.loop.poll_usec;
+		dl->callback_usec += st.loop.callback_usec;
+		dl->callbacks += st.loop.callbacks;
+		for (j = 0; j < EVENT_STATS_HIST_BUCKETS; j++)
+			dl->cb_hist[j] += st.loop.cb_hist[j];
+		for (j = 0; j < EVENT_STATS_SLOWEST; j++)
+			merge_slowest(dl, &st.loop.slowest[j]);
+		dl->timeouts_fired += st.loop.timeouts_fired;
+		dl->signal_wakeups += st.loop.signal_wakeups;
+		dl->timeouts_pending += st.loop.timeouts_pending;
+		dl->fd_count += st.loop.fd_count;
+		dl->active_count += st.loop.active_count;
+	}
+}
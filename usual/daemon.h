@@ -21,7 +21,94 @@
 
 #include <stdbool.h>
 
+#include <usual/event.h>
+#include <usual/socket.h>
+#include <usual/time.h>
+
 void daemonize(const char *pidfile, bool go_background);
 
+/*
+ * Prefork supervisor.
+ *
+ * Supervisor owns one SO_REUSEPORT listen socket per worker slot,
+ * workers get it over fork().  Restarted or reloaded worker takes
+ * over same socket, so connections queued on it are not lost.
+ *
+ * SIGHUP starts new generation of workers, then sends SIGTERM to old
+ * ones.  SIGTERM or SIGINT stops all workers and returns.  Worker
+ * should stop accepting on SIGTERM, finish its connections and exit.
+ */
+
+#define PREFORK_MAX_WORKERS 64
+#define PREFORK_COUNTERS 16
+
+/* per-slot stats in shared memory */
+struct PreforkStats {
+	/* set by supervisor */
+	pid_t pid;
+	unsigned generation;
+	unsigned restarts;
+	usec_t start_time;
+
+	/* atomic adds from workers, kept over restarts */
+	uint64_t counters[PREFORK_COUNTERS];
+
+	/* snapshot from prefork_publish_stats(), seqlock-protected */
+	pid_t writer;		/* pid holding write side, 0 if free */
+	uint32_t seq;
+	usec_t publish_time;
+	struct EventBaseStats loop;
+	uint64_t slab_objects;
+	uint64_t slab_free;
+	uint64_t slab_bytes;
+};
+
+struct PreforkShared;
+
+struct PreforkWorker {
+	unsigned index;
+	unsigned generation;
+	int listen_fd;
+	struct PreforkShared *shared;
+};
+
+/* worker main, return value is exit code */
+typedef int (*prefork_worker_f)(struct PreforkWorker *w, void *arg);
+
+struct PreforkConfig {
+	unsigned nworkers;
+	const struct sockaddr *listen_addr;
+	socklen_t listen_addr_len;
+	int backlog;
+	const struct SocketProfile *profile;
+
+	prefork_worker_f worker_func;
+	void *worker_arg;
+
+	/* wait before restarting worker that died within a second, default 1s */
+	usec_t restart_delay;
+	/* SIGKILL for workers still running after SIGTERM, default 10s */
+	usec_t stop_timeout;
+};
+
+/*
+ * Runs in caller until SIGTERM/SIGINT, -1 with errno on setup failure.
+ * Async logging must not be running, start it in workers.
+ */
+int prefork_run(const struct PreforkConfig *cf) _MUSTCHECK;
+
+/* worker side, counters are shared by all generations of slot */
+void prefork_counter_add(struct PreforkWorker *w, unsigned counter, uint64_t delta);
+void prefork_publish_stats(struct PreforkWorker *w, struct event_base *base);
+
+/*
+ * Consistent copy of all slots without IPC, returns slot count.
+ * Snapshot of slot that stays busy too long is left zeroed.
+ */
+unsigned prefork_collect_stats(struct PreforkShared *shared, struct PreforkStats *dst, unsigned max);
+
+/* sums of counters and loop totals over all slots */
+void prefork_sum_stats(struct PreforkShared *shared, struct PreforkStats *total);
+
 #endif
 
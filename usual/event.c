@@ -17,9 +17,14 @@
  */ 
 
 /*
- * Small poll()-based async event loop, API-compatible with libevent.
+ * Small async event loop, API-compatible with libevent.
  *
  * For sitations where full libevent is not necessary.
+ *
+ * Uses epoll() on Linux and kqueue() on BSD/OSX, where fd registration
+ * is incremental in event_add()/event_del().  poll() is kept as fallback,
+ * it rebuilds pollfd array on each loop iteration.  io_uring is optional
+ * on Linux, it batches fd changes and EventOp requests.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -30,18 +35,54 @@
 
 #include <sys/socket.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <string.h>
 #include <unistd.h>
 #include <poll.h>
 #include <stdlib.h>
+#include <pthread.h>
+
+#ifdef __linux__
+#define USE_EPOLL
+#define USE_EVENTFD
+#define USE_SIGNALFD
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_FEAT_EXT_ARG
+#define USE_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+#endif
+#endif
+
+#if defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__) \
+	|| defined(__DragonFly__) || defined(__APPLE__)
+#define USE_KQUEUE
+#include <sys/event.h>
+#endif
 
 #include <usual/statlist.h>
 #include <usual/socket.h>
+#include <usual/safeio.h>
 #include <usual/alloc.h>
+#include <usual/slab.h>
+#include <usual/time.h>
 
-/* max number of signals we care about */
-#define MAX_SIGNAL 32
+/* max number of signals we care about, includes realtime ones */
+#ifdef NSIG
+#define MAX_SIGNAL NSIG
+#else
+#define MAX_SIGNAL 65
+#endif
 
 /* if tv_sec is larger, it's absolute timeout */
 #define MAX_REL_TIMEOUT (30*24*60*60)
@@ -52,37 +93,126 @@
 /* extra event flag to track if event is added */
 #define EV_ACTIVE 0x80
 
+/* event is in active list, waiting for callback */
+#define EV_QUEUED 0x100
+
+/* initial size for backend result array */
+#define MIN_BACKEND_EVENTS 64
+
+/*
+ * Backend operations, selected in event_init().
+ *
+ * add/del are called for fd events only. dispatch() waits
+ * for events, puts them to active lists and returns -1 on
+ * non-EINTR error.
+ * op_submit/op_cancel are optional, without them EventOp
+ * waits for readiness via plain event.
+ */
+struct EventOps {
+	const char *name;
+	bool (*init)(struct event_base *base);
+	void (*release)(struct event_base *base);
+	int (*add)(struct event_base *base, struct event *ev);
+	void (*del)(struct event_base *base, struct event *ev);
+	int (*dispatch)(struct event_base *base, int timeout_ms);
+	int (*op_submit)(struct event_base *base, struct EventOp *op);
+	int (*op_cancel)(struct event_base *base, struct EventOp *op);
+};
+
+/* events registered for one fd, for epoll/kqueue */
+struct FdSlot {
+	/* chains via rd_next/wr_next */
+	struct event *rd_ev;
+	struct event *wr_ev;
+#ifdef USE_URING
+	/* armed poll and its generation */
+	unsigned poll_mask;
+	unsigned poll_gen;
+	/* fixed file index + 1 */
+	int fixed_idx;
+#endif
+};
+
 struct event_base {
 	struct AATree timeout_tree;
+	struct TimerWheel *timer_wheel;
 
 	struct StatList fd_list;
+
+	/* backend */
+	const struct EventOps *ops;
+
+	/* poll backend */
 	struct event **pfd_event;
 	struct pollfd *pfd_list;
 	int pfd_size;
 
+	/* epoll/kqueue backends */
+	int be_fd;
+	struct FdSlot *fd_slots;
+	int fd_slots_size;
+	void *be_events;
+	int be_events_size;
+
+	/* io_uring backend */
+	struct Uring *uring;
+
 	bool loop_break;
 	bool loop_exit;
+	bool in_loop;
+
+	/* ready events waiting for callback, per priority */
+	struct List active_list[EVENT_MAX_PRIORITIES];
+	int active_count;
+	int npriorities;
+
+	/* per-iteration limits, 0 means unlimited */
+	int cb_budget;
+	int timer_budget;
 
 	/* signal handling */
-	struct List sig_node;
 	struct List sig_waiters[MAX_SIGNAL];
 	int sig_send, sig_recv;
 	struct event sig_ev;
 	unsigned int sig_seen[MAX_SIGNAL];
+#ifdef USE_SIGNALFD
+	/* signals blocked in loop thread and read via signalfd */
+	sigset_t sig_mask;
+	pthread_t sig_thread;
+#endif
+	/* signals are registered in kqueue */
+	bool sig_kqueue;
+
+	/* one-time events and loopexit timer */
+	struct Slab *once_slab;
+	struct event exit_ev;
+
+	/* NULL if not enabled */
+	struct EventBaseStats *stats;
 };
 
-/* default event base */
-static struct event_base *current_base = NULL;
+/* default event base, per thread */
+static _TLS struct event_base *current_base = NULL;
 
 /* global signal data */
 static volatile unsigned int sig_count[MAX_SIGNAL];
 static bool signal_set_up[MAX_SIGNAL];
 static struct sigaction old_handler[MAX_SIGNAL];
-static LIST(sig_base_list);
+
+/* the only base that receives signals, protected by sig_lock */
+static struct event_base *volatile sig_base;
+static pthread_mutex_t sig_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
 static bool sig_init(struct event_base *base, int sig);
 static void sig_close(struct event_base *base);
+static void deliver_signal(struct event_base *base, int sig);
+static int timeout_count(struct event_base *base);
+
+static inline usec_t tv_to_usec(const struct timeval *tv)
+{
+	return (usec_t)tv->tv_sec * USEC + tv->tv_usec;
+}
 
 /*
  * Debugging.
@@ -90,7 +220,6 @@ static void sig_close(struct event_base *base);
 
 #ifdef CASSERT
 #include <usual/logging.h>
-#include <usual/time.h>
 #include <stdarg.h>
 #include <stdio.h>
 static void base_dbg(struct event_base *base, const char *s, ...)
@@ -102,10 +231,10 @@ static void base_dbg(struct event_base *base, const char *s, ...)
 	vsnprintf(buf, sizeof(buf), s, ap);
 	va_end(ap);
 
-	log_noise("event base=%p: fdlist=%u timeouts=%d pfds=%d: %s",
-	       base, statlist_count(&base->fd_list),
-	       base->timeout_tree.count,
-	       base->pfd_size, buf);
+	log_noise("event base=%p (%s): fdlist=%u timeouts=%d: %s",
+	       base, base->ops->name,
+	       statlist_count(&base->fd_list),
+	       timeout_count(base), buf);
 }
 
 static void ev_dbg(struct event *ev, const char *s, ...)
@@ -118,15 +247,19 @@ static void ev_dbg(struct event *ev, const char *s, ...)
 	vsnprintf(buf, sizeof(buf), s, ap);
 	va_end(ap);
 
+	/* timeouts are in monotonic time, show relative */
+	if (ev->flags & EV_TIMEOUT)
+		snprintf(tval, sizeof(tval), "%+lldms",
+			 ((long long)tv_to_usec(&ev->timeout)
+			  - (long long)get_monotonic_usec()) / 1000);
+
 	log_noise("event %s %d (flags=%s%s%s%s%s) [%s]: %s", typ, ev->fd,
 	       (ev->flags & EV_ACTIVE) ? "A" : "",
 	       (ev->flags & EV_PERSIST) ? "P" : "",
 	       (ev->flags & EV_TIMEOUT) ? "T" : "",
 	       (ev->flags & EV_READ) ? "R" : "",
 	       (ev->flags & EV_WRITE) ? "W" : "",
-	       (ev->flags & EV_TIMEOUT)
-	       ? format_time_ms(&ev->timeout, tval, sizeof(tval))
-	       : "-",
+	       (ev->flags & EV_TIMEOUT) ? tval : "-",
 	       buf);
 }
 #else
@@ -138,16 +271,32 @@ static void ev_dbg(struct event *ev, const char *s, ...)
  * Helper functions.
  */
 
-/* convert user tv to absolute tv */
-static void fill_timeout(struct timeval *dst, struct timeval *tv)
+/* current monotonic time, cached inside loop */
+static usec_t loop_now(struct event_base *base)
+{
+	if (base->in_loop)
+		return get_cached_monotonic();
+	return get_monotonic_usec();
+}
+
+/*
+ * Convert user tv to absolute tv in monotonic time.
+ * Absolute user timeouts are in wall-clock time.
+ */
+static void fill_timeout(struct event_base *base, struct timeval *dst, struct timeval *tv)
 {
+	usec_t now = loop_now(base);
+	usec_t res;
+
 	if (tv->tv_sec < MAX_REL_TIMEOUT) {
-		struct timeval now;
-		gettimeofday(&now, NULL);
-		timeradd(&now, tv, dst);
+		res = now + tv_to_usec(tv);
 	} else {
-		*dst = *tv;
+		usec_t abs = tv_to_usec(tv);
+		usec_t wall = get_time_usec();
+		res = (abs > wall) ? now + (abs - wall) : now;
 	}
+	dst->tv_sec = res / USEC;
+	dst->tv_usec = res % USEC;
 }
 
 /* compare timevals */
@@ -178,277 +327,398 @@ static int cmp_timeout(long item, struct AANode *n1)
 	return (ev0 < ev1) ? -1 : 1;
 }
 
-/* enlarge pollfd array if needed */
-static bool make_room(struct event_base *base, int need)
+/* put ready event to active list, flags are merged if already there */
+static void queue_event(struct event_base *base, struct event *ev, short flags)
 {
-	int total;
-	void *tmp1;
-	void *tmp2;
+	int pri;
 
-	if (need < base->pfd_size)
-		return true;
+	if (ev->flags & EV_QUEUED) {
+		ev->res_flags |= flags;
+		return;
+	}
+	/* priorities may have been reduced after event_assign() */
+	pri = ev->priority < base->npriorities ? ev->priority : base->npriorities - 1;
+	ev->flags |= EV_QUEUED;
+	ev->res_flags = flags;
+	list_append(&base->active_list[pri], &ev->active_node);
+	base->active_count++;
+}
 
-	total = base->pfd_size * 2;
-	if (total < 8) total = 8;
-	while (total < need)
-		total *= 2;
+static void unqueue_event(struct event_base *base, struct event *ev)
+{
+	list_del(&ev->active_node);
+	ev->flags &= ~EV_QUEUED;
+	ev->res_flags = 0;
+	base->active_count--;
+}
 
-	tmp1 = realloc(base->pfd_list, total * sizeof(struct pollfd));
-	if (!tmp1)
-		return false;
-	base->pfd_list = tmp1;
+static void stats_callback(struct EventBaseStats *st, uevent_cb_f cb_func, usec_t start);
 
-	tmp2 = realloc(base->pfd_event, total * sizeof(struct event *));
-	if (!tmp2)
-		return false;
-	base->pfd_event = tmp2;
+static void deliver_event(struct event *ev, short flags)
+{
+	struct EventBaseStats *st = ev->base->stats;
+	uevent_cb_f cb_func = ev->cb_func;
+	usec_t start;
 
-	base->pfd_size = total;
-	return true;
+	ev_dbg(ev, "deliver_event: %d", flags);
+
+	/* remove non-persitant event before calling user func */
+	if ((ev->flags & EV_PERSIST) == 0)
+		event_del(ev);
+
+	/* now call user func */
+	if (!st) {
+		cb_func(ev->fd, flags, ev->cb_arg);
+		return;
+	}
+	if (flags & EV_TIMEOUT)
+		st->timeouts_fired++;
+	start = get_cached_monotonic();
+	cb_func(ev->fd, flags, ev->cb_arg);
+	stats_callback(st, cb_func, start);
 }
 
 /*
- * Single base functions.
+ * Hierarchical timer wheel, optional replacement for timeout tree.
+ *
+ * Tick is 1 msec.  Level 0 has 256 slots for exact ticks,
+ * each upper level has 64 slots, each covering whole rotation
+ * of the level below.  Events in upper levels are cascaded down
+ * when lower level wraps around.  Timeouts beyond the last level
+ * are clamped there and re-cascaded until they are near.
+ *
+ * Slot bitmaps are hints - they may contain bits for slots that
+ * became empty via event_del(), those are cleared lazily.
  */
 
-int event_loop(int loop_flags)
-{
-	return event_base_loop(current_base, loop_flags);
-}
+#define WHEEL_L0_BITS	8
+#define WHEEL_LN_BITS	6
+#define WHEEL_LEVELS	4
+#define WHEEL_L0_SIZE	(1 << WHEEL_L0_BITS)
+#define WHEEL_LN_SIZE	(1 << WHEEL_LN_BITS)
+#define WHEEL_L0_MASK	(WHEEL_L0_SIZE - 1)
+#define WHEEL_LN_MASK	(WHEEL_LN_SIZE - 1)
+#define WHEEL_SHIFT(lv)	(WHEEL_L0_BITS + ((lv) - 1) * WHEEL_LN_BITS)
+#define WHEEL_MAX_DELTA	((usec_t)1 << WHEEL_SHIFT(WHEEL_LEVELS))
+
+struct TimerWheel {
+	/* level 0 slots, and levels 1..N-1 */
+	struct List l0[WHEEL_L0_SIZE];
+	struct List ln[WHEEL_LEVELS - 1][WHEEL_LN_SIZE];
+	uint64_t l0_map[WHEEL_L0_SIZE / 64];
+	uint64_t ln_map[WHEEL_LEVELS - 1];
+
+	/* all ticks before that have been processed */
+	usec_t cur_tick;
+
+	/* cached lower bound for earliest expiry */
+	usec_t next_tick;
+	bool next_valid;
+
+	int count;
+};
 
-int event_loopbreak(void)
+/* convert absolute timeval to msec tick, rounding up */
+static inline usec_t tv_to_tick(const struct timeval *tv)
 {
-	return event_base_loopbreak(current_base);
+	return (usec_t)tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000;
 }
 
-void event_set(struct event *ev, int fd, short flags, uevent_cb_f cb, void *arg)
+static inline usec_t now_tick(struct event_base *base)
 {
-	event_assign(ev, current_base, fd, flags, cb, arg);
+	return loop_now(base) / 1000;
 }
 
-int event_once(int fd, short flags, uevent_cb_f cb_func, void *cb_arg, struct timeval *timeout)
+/* find first set bit in circular bitmap, starting from 'start' */
+static int find_bit_circular(const uint64_t *map, int nbits, int start)
 {
-	return event_base_once(current_base, fd, flags, cb_func, cb_arg, timeout);
+	int i, pos, nwords = (nbits + 63) / 64;
+
+	for (i = 0; i <= nwords; i++) {
+		int word = ((start / 64) + i) % nwords;
+		uint64_t bits = map[word];
+		if (i == 0)
+			bits &= ~(uint64_t)0 << (start % 64);
+		else if (i == nwords)
+			bits &= ((uint64_t)1 << (start % 64)) - 1;
+		if (!bits)
+			continue;
+		for (pos = 0; (bits & 1) == 0; pos++)
+			bits >>= 1;
+		return ((word * 64 + pos - start) + nbits) % nbits;
+	}
+	return -1;
 }
 
-int event_loopexit(struct timeval *timeout)
+static void wheel_init(struct TimerWheel *w, struct event_base *base)
 {
-	return event_base_loopexit(current_base, timeout);
+	int i, lv;
+
+	memset(w, 0, sizeof(*w));
+	for (i = 0; i < WHEEL_L0_SIZE; i++)
+		list_init(&w->l0[i]);
+	for (lv = 0; lv < WHEEL_LEVELS - 1; lv++) {
+		for (i = 0; i < WHEEL_LN_SIZE; i++)
+			list_init(&w->ln[lv][i]);
+	}
+	w->cur_tick = now_tick(base);
 }
 
-/*
- * Event base initialization.
- */
-
-struct event_base *event_init(void)
+/* add event to slot, decided by distance from current tick */
+static void wheel_place(struct TimerWheel *w, struct event *ev)
 {
-	struct event_base *base;
-	int i;
-
-	base = calloc(1, sizeof(*base));
-
-	/* initialize timeout and fd areas */
-	aatree_init(&base->timeout_tree, cmp_timeout, NULL);
-	statlist_init(&base->fd_list, "fd_list");
-
-	/* initialize signal areas */
-	for (i = 0; i < MAX_SIGNAL; i++)
-		list_init(&base->sig_waiters[i]);
-	list_init(&base->sig_node);
-	base->sig_send = base->sig_recv = -1;
-
-	/* allocate pollfds */
-	if (!make_room(base, 8)) {
-		event_base_free(base);
-		return NULL;
+	usec_t tick = tv_to_tick(&ev->timeout);
+	usec_t delta;
+	int lv, idx;
+
+	if (tick < w->cur_tick)
+		tick = w->cur_tick;
+	delta = tick - w->cur_tick;
+
+	if (delta < WHEEL_L0_SIZE) {
+		idx = tick & WHEEL_L0_MASK;
+		w->l0_map[idx / 64] |= (uint64_t)1 << (idx % 64);
+		list_append(&w->l0[idx], &ev->wheel_node);
+		return;
 	}
 
-	if (!current_base)
-		current_base = base;
-	return base;
+	if (delta >= WHEEL_MAX_DELTA)
+		tick = w->cur_tick + WHEEL_MAX_DELTA - 1;
+	for (lv = 1; lv < WHEEL_LEVELS - 1; lv++) {
+		if (delta < ((usec_t)1 << WHEEL_SHIFT(lv + 1)))
+			break;
+	}
+	idx = (tick >> WHEEL_SHIFT(lv)) & WHEEL_LN_MASK;
+	w->ln_map[lv - 1] |= (uint64_t)1 << idx;
+	list_append(&w->ln[lv - 1][idx], &ev->wheel_node);
 }
 
-void event_base_free(struct event_base *base)
+static void wheel_insert(struct TimerWheel *w, struct event *ev)
 {
-	if (!base) {
-		if (!current_base)
-			return;
-		base = current_base;
+	usec_t tick = tv_to_tick(&ev->timeout);
+
+	if (tick < w->cur_tick)
+		tick = w->cur_tick;
+	if (w->count == 0 || (w->next_valid && tick < w->next_tick)) {
+		w->next_tick = tick;
+		w->next_valid = true;
 	}
-	if (base == current_base)
-		current_base = NULL;
-	free(base->pfd_event);
-	free(base->pfd_list);
-	sig_close(base);
-	free(base);
+	wheel_place(w, ev);
+	w->count++;
 }
 
-int event_base_loopbreak(struct event_base *base)
+static void wheel_remove(struct TimerWheel *w, struct event *ev)
 {
-	base->loop_break = true;
-	return 0;
-}
+	/* bitmap bit is left in place */
+	list_del(&ev->wheel_node);
+	w->count--;
 
-/*
- * Multi-base functions.
- */
+	/* cached value may be too early now */
+	if (w->next_valid && tv_to_tick(&ev->timeout) <= w->next_tick)
+		w->next_valid = false;
+}
 
-void event_assign(struct event *ev, struct event_base *base, int fd, short flags, uevent_cb_f cb, void *arg)
+/* move all items from src to empty dst */
+static void move_list(struct List *dst, struct List *src)
 {
-	Assert(base);
-	Assert((ev->flags & EV_ACTIVE) == 0);
+	list_init(dst);
+	if (list_empty(src))
+		return;
+	dst->next = src->next;
+	dst->prev = src->prev;
+	dst->next->prev = dst;
+	dst->prev->next = dst;
+	list_init(src);
+}
 
-	ev->fd = fd;
-	ev->base = base;
-	ev->flags = flags;
-	ev->cb_func = cb;
-	ev->cb_arg = arg;
-	ev->ev_idx = -1;
-	list_init(&ev->node);
-	ev_dbg(ev, "event_set");
+/* redistribute events from upper level slot, returns slot index */
+static int wheel_cascade(struct TimerWheel *w, int lv)
+{
+	int idx = (w->cur_tick >> WHEEL_SHIFT(lv)) & WHEEL_LN_MASK;
+	struct List tmp, *node;
+
+	move_list(&tmp, &w->ln[lv - 1][idx]);
+	w->ln_map[lv - 1] &= ~((uint64_t)1 << idx);
+	while ((node = list_pop(&tmp)) != NULL)
+		wheel_place(w, container_of(node, struct event, wheel_node));
+	return idx;
 }
 
-int event_del(struct event *ev)
+/* move to new tick, must not jump over level 0 wraparound */
+static void wheel_set_tick(struct TimerWheel *w, usec_t tick)
 {
-	struct event_base *base = ev->base;
+	int lv;
 
-	/* allow repeated deletions */
-	if ((ev->flags & EV_ACTIVE) == 0) {
-		ev_dbg(ev, "event_del for inactive event??");
-		return 0;
+	w->cur_tick = tick;
+	if ((tick & WHEEL_L0_MASK) != 0)
+		return;
+	w->next_valid = false;
+	for (lv = 1; lv < WHEEL_LEVELS; lv++) {
+		if (wheel_cascade(w, lv) != 0)
+			break;
 	}
-	ev_dbg(ev, "event_del");
+}
 
-	/* remove from fd/signal list */
-	if (ev->flags & EV_SIGNAL)
-		list_del(&ev->node);
-	else if (ev->flags & (EV_READ | EV_WRITE))
-		statlist_remove(&base->fd_list, &ev->node);
+/* calculate earliest possible expiry tick, exact if in level 0 */
+static usec_t wheel_next_tick(struct TimerWheel *w)
+{
+	usec_t best, tick;
+	int lv, d, idx;
 
-	/* remove from timeout tree */
-	if (ev->flags & EV_TIMEOUT) {
-		aatree_remove(&ev->base->timeout_tree, (long)&ev->timeout_node);
-		ev->flags &= ~EV_TIMEOUT;
-	}
+	if (w->next_valid)
+		return w->next_tick;
 
-	/* clear reference to pollfd area */
-	if (ev->ev_idx >= 0) {
-		ev->base->pfd_event[ev->ev_idx] = NULL;
-		ev->ev_idx = -1;
+	/* level 0 contains exact ticks */
+	best = w->cur_tick + WHEEL_MAX_DELTA;
+	while (1) {
+		d = find_bit_circular(w->l0_map, WHEEL_L0_SIZE, w->cur_tick & WHEEL_L0_MASK);
+		if (d < 0)
+			break;
+		idx = (w->cur_tick + d) & WHEEL_L0_MASK;
+		if (!list_empty(&w->l0[idx])) {
+			best = w->cur_tick + d;
+			break;
+		}
+		w->l0_map[idx / 64] &= ~((uint64_t)1 << (idx % 64));
 	}
 
-	/* tag inactive */
-	ev->flags &= ~EV_ACTIVE;
+	/* upper levels give start of slot range */
+	for (lv = 1; lv < WHEEL_LEVELS; lv++) {
+		int shift = WHEEL_SHIFT(lv);
+		int cur = (w->cur_tick >> shift) & WHEEL_LN_MASK;
+		while (1) {
+			d = find_bit_circular(&w->ln_map[lv - 1], WHEEL_LN_SIZE, cur);
+			if (d < 0)
+				break;
+			idx = (cur + d) & WHEEL_LN_MASK;
+			if (!list_empty(&w->ln[lv - 1][idx])) {
+				/* current slot was cascaded already, so it is next revolution */
+				if (d == 0)
+					d = WHEEL_LN_SIZE;
+				tick = ((w->cur_tick >> shift) + d) << shift;
+				if (tick < best)
+					best = tick;
+				break;
+			}
+			w->ln_map[lv - 1] &= ~((uint64_t)1 << idx);
+		}
+	}
 
-	return 0;
+	w->next_tick = best;
+	w->next_valid = true;
+	return best;
 }
 
-
-/* handles only relarive timeouts */
-int event_add(struct event *ev, struct timeval *timeout)
+/* fire events up to and including tick 'now', at most 'budget' if > 0 */
+static void wheel_process(struct event_base *base, struct TimerWheel *w, usec_t now, int budget)
 {
-	struct event_base *base = ev->base;
-
-	Assert((ev->flags & EV_ACTIVE) == 0);
-	Assert(base);
-
-	/* timeout sanity check, but dont use it yet */
-	if (timeout) {
-		if (ev->flags & EV_PERSIST) {
-			errno = EINVAL;
-			return -1;
+	struct List tmp, *node;
+	usec_t next, wrap;
+	bool stop = false;
+	int idx, fired = 0;
+
+	while (w->cur_tick <= now) {
+		if (w->count == 0) {
+			w->cur_tick = now + 1;
+			w->next_valid = false;
+			break;
 		}
-	} else if (ev->flags & EV_TIMEOUT) {
-		ev->flags &= ~EV_TIMEOUT;
-	}
 
-	/* setup signal/fd */
-	if (ev->flags & EV_SIGNAL) {
-		if (ev->flags & (EV_READ|EV_WRITE)) {
-			errno = EINVAL;
-			return -1;
+		/* skip empty ticks, stopping at wraparound for cascade */
+		next = wheel_next_tick(w);
+		if (next > w->cur_tick) {
+			wrap = (w->cur_tick | WHEEL_L0_MASK) + 1;
+			if (next > wrap)
+				next = wrap;
+			if (next > now + 1)
+				next = now + 1;
+			wheel_set_tick(w, next);
+			continue;
 		}
-		if (!sig_init(base, ev->fd))
-			return -1;
-		list_append(&base->sig_waiters[ev->fd], &ev->node);
-	} else if (ev->flags & (EV_READ|EV_WRITE)) {
-		statlist_append(&base->fd_list, &ev->node);
-	}
 
-	/* now act on timeout */
-	if (timeout) {
-		fill_timeout(&ev->timeout, timeout);
-		ev->flags |= EV_TIMEOUT;
-		aatree_insert(&base->timeout_tree, (long)&ev->timeout_node, &ev->timeout_node);
+		/* take events for current tick, then move on */
+		idx = w->cur_tick & WHEEL_L0_MASK;
+		move_list(&tmp, &w->l0[idx]);
+		w->l0_map[idx / 64] &= ~((uint64_t)1 << (idx % 64));
+		w->next_valid = false;
+		wheel_set_tick(w, w->cur_tick + 1);
+
+		while ((node = list_pop(&tmp)) != NULL) {
+			struct event *ev = container_of(node, struct event, wheel_node);
+			if (stop) {
+				/* put back, goes to next tick */
+				wheel_place(w, ev);
+				continue;
+			}
+			deliver_event(ev, EV_TIMEOUT);
+			fired++;
+			stop = base->loop_break || (budget > 0 && fired >= budget);
+		}
+		if (stop)
+			break;
 	}
-	ev->ev_idx = -1;
-	ev->flags |= EV_ACTIVE;
-
-	ev_dbg(ev, "event_add");
-
-	return 0;
 }
 
 /*
- * Event loop functions.
+ * poll() backend.
  */
 
-static void deliver_event(struct event *ev, short flags)
+/* enlarge pollfd array if needed */
+static bool make_room(struct event_base *base, int need)
 {
-	ev_dbg(ev, "deliver_event: %d", flags);
+	int total;
+	void *tmp1;
+	void *tmp2;
 
-	/* remove non-persitant event before calling user func */
-	if ((ev->flags & EV_PERSIST) == 0)
-		event_del(ev);
+	if (need < base->pfd_size)
+		return true;
 
-	/* now call user func */
-	ev->cb_func(ev->fd, flags, ev->cb_arg);
-}
+	total = base->pfd_size * 2;
+	if (total < 8) total = 8;
+	while (total < need)
+		total *= 2;
 
-static inline struct event *get_smallest_timeout(struct event_base *base)
-{
-	struct AANode *node = base->timeout_tree.root;
-	struct AANode *first = NULL;
-	struct event *ev;
+	tmp1 = realloc(base->pfd_list, total * sizeof(struct pollfd));
+	if (!tmp1)
+		return false;
+	base->pfd_list = tmp1;
 
-	while (!aatree_is_nil_node(node)) {
-		first = node;
-		node = node->left;
-	}
-	if (first) {
-		ev = container_of(first, struct event, timeout_node);
-		return ev;
-	}
-	return NULL;
+	tmp2 = realloc(base->pfd_event, total * sizeof(struct event *));
+	if (!tmp2)
+		return false;
+	base->pfd_event = tmp2;
+
+	base->pfd_size = total;
+	return true;
 }
 
-static int calc_timeout(struct event_base *base)
+static bool poll_init(struct event_base *base)
 {
-	struct event *ev;
-	int res, secs, usecs;
-	struct timeval now;
-
-	ev = get_smallest_timeout(base);
-	if (!ev)
-		return MAX_SLEEP * 1000;
+	return make_room(base, 8);
+}
 
-	gettimeofday(&now, NULL);
+static void poll_free(struct event_base *base)
+{
+	free(base->pfd_event);
+	free(base->pfd_list);
+	base->pfd_event = NULL;
+	base->pfd_list = NULL;
+	base->pfd_size = 0;
+}
 
-	if (now.tv_sec + MAX_SLEEP < ev->timeout.tv_sec)
-		return MAX_SLEEP * 1000;
-	if (ev->timeout.tv_sec < now.tv_sec)
-		return 0;
+static int poll_add(struct event_base *base, struct event *ev)
+{
+	ev->ev_idx = -1;
+	return 0;
+}
 
-	secs = ev->timeout.tv_sec - now.tv_sec;
-	usecs = ev->timeout.tv_usec - now.tv_usec;
-	if (usecs < 0) {
-		secs--;
-		usecs += 1000000;
+static void poll_del(struct event_base *base, struct event *ev)
+{
+	/* clear reference to pollfd area */
+	if (ev->ev_idx >= 0) {
+		base->pfd_event[ev->ev_idx] = NULL;
+		ev->ev_idx = -1;
 	}
-	res = (secs * 1000) + ((usecs + 999) / 1000);
-	if (res < 0)
-		return 0;
-	return res;
 }
 
 static void process_fds(struct event_base *base, int pf_cnt)
@@ -462,48 +732,16 @@ static void process_fds(struct event_base *base, int pf_cnt)
 			continue;
 		base->pfd_event[i] = NULL;
 		ev->ev_idx = -1; // is it needed?
-		if (pf->revents & (POLLIN | POLLOUT | POLLERR | POLLHUP)) {
-			int flags = ev->flags & (EV_READ | EV_WRITE);
-			deliver_event(ev, flags);
-		}
-		if (base->loop_break)
-			break;
-	}
-}
-
-static void process_timeouts(struct event_base *base)
-{
-	struct timeval now;
-	struct event *ev;
-
-	ev = get_smallest_timeout(base);
-	if (!ev)
-		return;
-
-	gettimeofday(&now, NULL);
-
-	while (ev) {
-		if (timercmp(&now, &ev->timeout, <))
-			break;
-		deliver_event(ev, EV_TIMEOUT);
-		if (base->loop_break)
-			break;
-		ev = get_smallest_timeout(base);
+		if (pf->revents & (POLLIN | POLLOUT | POLLERR | POLLHUP))
+			queue_event(base, ev, ev->flags & (EV_READ | EV_WRITE));
 	}
 }
 
-int event_base_loop(struct event_base *base, int loop_flags)
+static int poll_dispatch(struct event_base *base, int timeout_ms)
 {
-	int pf_cnt, res, timeout_ms;
+	int pf_cnt, res;
 	struct List *node;
 
-	/* don't loop if non-block was requested */
-	if (loop_flags & EVLOOP_NONBLOCK)
-		loop_flags |= EVLOOP_ONCE;
-
-	base->loop_break = false;
-	base->loop_exit = false;
-loop:
 	if (!make_room(base, statlist_count(&base->fd_list)))
 		return -1;
 
@@ -525,74 +763,1513 @@ loop:
 			pf->events |= POLLOUT;
 	}
 
+	res = poll(base->pfd_list, pf_cnt, timeout_ms);
+	reset_time_cache();
+	base_dbg(base, "poll(%d, timeout=%d) = res=%d errno=%d",
+		 pf_cnt, timeout_ms, res, res < 0 ? errno : 0);
+
+	if (res == -1 && errno != EINTR)
+		return -1;
+
+	if (res > 0)
+		process_fds(base, pf_cnt);
+	return 0;
+}
+
+static const struct EventOps poll_ops = {
+	"poll", poll_init, poll_free, poll_add, poll_del, poll_dispatch, NULL, NULL
+};
+
+/*
+ * Per-fd registration table, shared by epoll and kqueue.
+ *
+ * Each fd has a chain of reader and of writer events, as with
+ * poll any number of events can wait on same fd.  Event that
+ * waits for both is in both chains.
+ */
+
+#if defined(USE_EPOLL) || defined(USE_KQUEUE)
+
+static struct FdSlot *get_fd_slot(struct event_base *base, int fd)
+{
+	int total;
+	void *tmp;
+
+	if (fd < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (fd < base->fd_slots_size)
+		return &base->fd_slots[fd];
+
+	total = base->fd_slots_size * 2;
+	if (total < 64) total = 64;
+	while (total <= fd)
+		total *= 2;
+
+	tmp = realloc(base->fd_slots, total * sizeof(struct FdSlot));
+	if (!tmp)
+		return NULL;
+	base->fd_slots = tmp;
+	memset(base->fd_slots + base->fd_slots_size, 0,
+	       (total - base->fd_slots_size) * sizeof(struct FdSlot));
+	base->fd_slots_size = total;
+	return &base->fd_slots[fd];
+}
+
+/* ensure result array is large enough, called before waiting */
+static bool make_event_room(struct event_base *base, unsigned elem_size)
+{
+	int need = statlist_count(&base->fd_list);
+	int total = base->be_events_size;
+	void *tmp;
+
+	if (need < MIN_BACKEND_EVENTS)
+		need = MIN_BACKEND_EVENTS;
+	if (total >= need && base->be_events)
+		return true;
+	if (total < MIN_BACKEND_EVENTS)
+		total = MIN_BACKEND_EVENTS;
+	while (total < need)
+		total *= 2;
+
+	tmp = realloc(base->be_events, total * elem_size);
+	if (!tmp)
+		return base->be_events != NULL;
+	base->be_events = tmp;
+	base->be_events_size = total;
+	return true;
+}
+
+/* append to chains, keeps callback order same as add order */
+static void fill_fd_slot(struct FdSlot *slot, struct event *ev)
+{
+	struct event **pp;
+
+	ev->rd_next = ev->wr_next = NULL;
+	if (ev->flags & EV_READ) {
+		for (pp = &slot->rd_ev; *pp; pp = &(*pp)->rd_next);
+		*pp = ev;
+	}
+	if (ev->flags & EV_WRITE) {
+		for (pp = &slot->wr_ev; *pp; pp = &(*pp)->wr_next);
+		*pp = ev;
+	}
+}
+
+static void clear_fd_slot(struct FdSlot *slot, struct event *ev)
+{
+	struct event **pp;
+
+	for (pp = &slot->rd_ev; *pp; pp = &(*pp)->rd_next) {
+		if (*pp == ev) {
+			*pp = ev->rd_next;
+			break;
+		}
+	}
+	for (pp = &slot->wr_ev; *pp; pp = &(*pp)->wr_next) {
+		if (*pp == ev) {
+			*pp = ev->wr_next;
+			break;
+		}
+	}
+	ev->rd_next = ev->wr_next = NULL;
+}
+
+/* queue readiness on fd, combined event gets single callback */
+static void queue_fd_ready(struct event_base *base, int fd, bool rd, bool wr)
+{
+	struct FdSlot *slot;
+	struct event *ev;
+
+	if (fd < 0 || fd >= base->fd_slots_size)
+		return;
+	slot = &base->fd_slots[fd];
+
+	/* as with poll, callback gets all flags it waits for */
+	if (rd) {
+		for (ev = slot->rd_ev; ev; ev = ev->rd_next)
+			queue_event(base, ev, ev->flags & (EV_READ | EV_WRITE));
+	}
+	if (wr) {
+		for (ev = slot->wr_ev; ev; ev = ev->wr_next)
+			queue_event(base, ev, ev->flags & (EV_READ | EV_WRITE));
+	}
+}
+
+static void fdslot_free(struct event_base *base)
+{
+	if (base->be_fd >= 0)
+		close(base->be_fd);
+	base->be_fd = -1;
+	free(base->fd_slots);
+	free(base->be_events);
+	base->fd_slots = NULL;
+	base->be_events = NULL;
+	base->fd_slots_size = 0;
+	base->be_events_size = 0;
+}
+
+#endif
+
+/*
+ * epoll() backend.
+ */
+
+#ifdef USE_EPOLL
+
+static unsigned epoll_mask(const struct FdSlot *slot)
+{
+	unsigned mask = 0;
+	if (slot->rd_ev)
+		mask |= EPOLLIN;
+	if (slot->wr_ev)
+		mask |= EPOLLOUT;
+	return mask;
+}
+
+static bool epoll_init(struct event_base *base)
+{
+	base->be_fd = epoll_create(MIN_BACKEND_EVENTS);
+	if (base->be_fd < 0)
+		return false;
+	if (fcntl(base->be_fd, F_SETFD, FD_CLOEXEC) < 0) {
+		close(base->be_fd);
+		base->be_fd = -1;
+		return false;
+	}
+	return true;
+}
+
+static int epoll_add(struct event_base *base, struct event *ev)
+{
+	struct epoll_event eev;
+	struct FdSlot *slot;
+	unsigned old_mask;
+	int op;
+
+	slot = get_fd_slot(base, ev->fd);
+	if (!slot)
+		return -1;
+	old_mask = epoll_mask(slot);
+	fill_fd_slot(slot, ev);
+	if (epoll_mask(slot) == old_mask)
+		return 0;
+
+	memset(&eev, 0, sizeof(eev));
+	eev.events = epoll_mask(slot);
+	eev.data.fd = ev->fd;
+	op = old_mask ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	if (epoll_ctl(base->be_fd, op, ev->fd, &eev) < 0) {
+		clear_fd_slot(slot, ev);
+		return -1;
+	}
+	return 0;
+}
+
+static void epoll_del(struct event_base *base, struct event *ev)
+{
+	struct epoll_event eev;
+	struct FdSlot *slot;
+	unsigned old_mask;
+
+	if (ev->fd < 0 || ev->fd >= base->fd_slots_size)
+		return;
+	slot = &base->fd_slots[ev->fd];
+	old_mask = epoll_mask(slot);
+	clear_fd_slot(slot, ev);
+	if (epoll_mask(slot) == old_mask)
+		return;
+
+	/* errors are ignored, fd may be closed already */
+	memset(&eev, 0, sizeof(eev));
+	eev.events = epoll_mask(slot);
+	eev.data.fd = ev->fd;
+	if (eev.events)
+		epoll_ctl(base->be_fd, EPOLL_CTL_MOD, ev->fd, &eev);
+	else
+		epoll_ctl(base->be_fd, EPOLL_CTL_DEL, ev->fd, &eev);
+}
+
+static int epoll_dispatch(struct event_base *base, int timeout_ms)
+{
+	struct epoll_event *list;
+	int i, res;
+
+	if (!make_event_room(base, sizeof(struct epoll_event)))
+		return -1;
+	list = base->be_events;
+
+	res = epoll_wait(base->be_fd, list, base->be_events_size, timeout_ms);
+	reset_time_cache();
+	base_dbg(base, "epoll_wait(%d, timeout=%d) = res=%d errno=%d",
+		 base->be_events_size, timeout_ms, res, res < 0 ? errno : 0);
+
+	if (res == -1 && errno != EINTR)
+		return -1;
+
+	for (i = 0; i < res; i++) {
+		unsigned ready = list[i].events;
+		bool err = (ready & (EPOLLERR | EPOLLHUP)) != 0;
+		queue_fd_ready(base, list[i].data.fd,
+			       err || (ready & EPOLLIN),
+			       err || (ready & EPOLLOUT));
+	}
+	return 0;
+}
+
+static const struct EventOps epoll_ops = {
+	"epoll", epoll_init, fdslot_free, epoll_add, epoll_del, epoll_dispatch, NULL, NULL
+};
+
+#endif
+
+/*
+ * kqueue() backend.
+ */
+
+#ifdef USE_KQUEUE
+
+static bool kqueue_init(struct event_base *base)
+{
+	base->be_fd = kqueue();
+	if (base->be_fd < 0)
+		return false;
+	if (fcntl(base->be_fd, F_SETFD, FD_CLOEXEC) < 0) {
+		close(base->be_fd);
+		base->be_fd = -1;
+		return false;
+	}
+	return true;
+}
+
+static int kqueue_change(struct event_base *base, int fd, int filter, int op)
+{
+	struct kevent kev;
+	EV_SET(&kev, fd, filter, op, 0, 0, NULL);
+	return kevent(base->be_fd, &kev, 1, NULL, 0, NULL);
+}
+
+static int kqueue_add(struct event_base *base, struct event *ev)
+{
+	struct FdSlot *slot;
+	bool add_rd, add_wr;
+
+	slot = get_fd_slot(base, ev->fd);
+	if (!slot)
+		return -1;
+	/* filter is registered by first event in chain */
+	add_rd = (ev->flags & EV_READ) && !slot->rd_ev;
+	add_wr = (ev->flags & EV_WRITE) && !slot->wr_ev;
+	fill_fd_slot(slot, ev);
+
+	if (add_rd) {
+		if (kqueue_change(base, ev->fd, EVFILT_READ, EV_ADD) < 0)
+			goto failed;
+	}
+	if (add_wr) {
+		if (kqueue_change(base, ev->fd, EVFILT_WRITE, EV_ADD) < 0) {
+			if (add_rd)
+				kqueue_change(base, ev->fd, EVFILT_READ, EV_DELETE);
+			goto failed;
+		}
+	}
+	return 0;
+failed:
+	clear_fd_slot(slot, ev);
+	return -1;
+}
+
+static void kqueue_del(struct event_base *base, struct event *ev)
+{
+	struct FdSlot *slot;
+
+	if (ev->fd < 0 || ev->fd >= base->fd_slots_size)
+		return;
+	slot = &base->fd_slots[ev->fd];
+	clear_fd_slot(slot, ev);
+
+	/* errors are ignored, fd may be closed already */
+	if ((ev->flags & EV_READ) && !slot->rd_ev)
+		kqueue_change(base, ev->fd, EVFILT_READ, EV_DELETE);
+	if ((ev->flags & EV_WRITE) && !slot->wr_ev)
+		kqueue_change(base, ev->fd, EVFILT_WRITE, EV_DELETE);
+}
+
+static int kqueue_dispatch(struct event_base *base, int timeout_ms)
+{
+	struct kevent *list;
+	struct timespec ts;
+	int i, res;
+
+	if (!make_event_room(base, sizeof(struct kevent)))
+		return -1;
+	list = base->be_events;
+
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+	res = kevent(base->be_fd, NULL, 0, list, base->be_events_size, &ts);
+	reset_time_cache();
+	base_dbg(base, "kevent(%d, timeout=%d) = res=%d errno=%d",
+		 base->be_events_size, timeout_ms, res, res < 0 ? errno : 0);
+
+	if (res == -1 && errno != EINTR)
+		return -1;
+
+	for (i = 0; i < res; i++) {
+		if (list[i].flags & EV_ERROR)
+			continue;
+		if (list[i].filter == EVFILT_SIGNAL) {
+			if (base->stats)
+				base->stats->signal_wakeups++;
+			deliver_signal(base, list[i].ident);
+		} else if (list[i].filter == EVFILT_READ)
+			queue_fd_ready(base, list[i].ident, true, false);
+		else if (list[i].filter == EVFILT_WRITE)
+			queue_fd_ready(base, list[i].ident, false, true);
+	}
+	return 0;
+}
+
+static const struct EventOps kqueue_ops = {
+	"kqueue", kqueue_init, fdslot_free, kqueue_add, kqueue_del, kqueue_dispatch, NULL, NULL
+};
+
+#endif
+
+/*
+ * io_uring() backend.
+ *
+ * Fd events are one-shot POLL_ADD requests, re-armed after
+ * delivery.  Poll changes and EventOp requests are queued in
+ * submission ring and sent with single io_uring_enter() that
+ * also waits for completions, so busy loop iteration costs
+ * one syscall.  Used only when asked by name.
+ *
+ * user_data: 0 - ignored, odd - poll on fd, tagged with
+ * generation to skip stale completions, even - EventOp.
+ */
+
+#ifdef USE_URING
+
+/* fixed file table size */
+#define URING_FIXED_FILES 1024
+
+#define POLL_GEN_MASK 0x7fffffff
+
+struct Uring {
+	/* submission ring */
+	void *sq_ring;
+	size_t sq_ring_size;
+	unsigned *sq_khead, *sq_ktail, *sq_kmask, *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned sq_tail;
+	unsigned sq_entries;
+
+	/* completion ring, shares mmap with sq */
+	unsigned *cq_khead, *cq_ktail, *cq_kmask;
+	struct io_uring_cqe *cqes;
+
+	/* registered buffers */
+	struct iovec *bufs;
+	unsigned nbufs;
+
+	/* fixed file slots */
+	bool fixed_ok;
+	int *fixed_free;
+	unsigned fixed_nfree;
+};
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		       unsigned flags, void *arg, size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static inline uint64_t poll_tag(int fd, unsigned gen)
+{
+	return ((((uint64_t)gen) << 32 | (uint32_t)fd) << 1) | 1;
+}
+
+static unsigned uring_unsubmitted(struct Uring *u)
+{
+	return u->sq_tail - __atomic_load_n(u->sq_khead, __ATOMIC_ACQUIRE);
+}
+
+/* give queued sqes to kernel */
+static void uring_publish(struct Uring *u)
+{
+	__atomic_store_n(u->sq_ktail, u->sq_tail, __ATOMIC_RELEASE);
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct event_base *base)
+{
+	struct Uring *u = base->uring;
+	struct io_uring_sqe *sqe;
+	unsigned idx;
+
+	/* ring full, submit without waiting */
+	if (uring_unsubmitted(u) >= u->sq_entries) {
+		uring_publish(u);
+		if (uring_enter(base->be_fd, uring_unsubmitted(u), 0, 0, NULL, 0) < 0
+		    && errno != EBUSY && errno != EINTR)
+			return NULL;
+		if (uring_unsubmitted(u) >= u->sq_entries) {
+			errno = EAGAIN;
+			return NULL;
+		}
+	}
+
+	idx = u->sq_tail & *u->sq_kmask;
+	u->sq_array[idx] = idx;
+	sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_tail++;
+	return sqe;
+}
+
+static void uring_free(struct event_base *base)
+{
+	struct Uring *u = base->uring;
+
+	if (u) {
+		if (u->sqes)
+			munmap(u->sqes, u->sqes_size);
+		if (u->sq_ring)
+			munmap(u->sq_ring, u->sq_ring_size);
+		free(u->bufs);
+		free(u->fixed_free);
+		free(u);
+		base->uring = NULL;
+	}
+	fdslot_free(base);
+}
+
+/* sparse fixed file table, optional */
+static void uring_init_fixed(struct event_base *base)
+{
+	struct Uring *u = base->uring;
+	int *fds;
+	unsigned i;
+
+	fds = malloc(URING_FIXED_FILES * sizeof(int));
+	u->fixed_free = malloc(URING_FIXED_FILES * sizeof(int));
+	if (!fds || !u->fixed_free) {
+		free(fds);
+		return;
+	}
+	for (i = 0; i < URING_FIXED_FILES; i++) {
+		fds[i] = -1;
+		u->fixed_free[i] = URING_FIXED_FILES - 1 - i;
+	}
+	if (uring_register(base->be_fd, IORING_REGISTER_FILES, fds, URING_FIXED_FILES) == 0) {
+		u->fixed_ok = true;
+		u->fixed_nfree = URING_FIXED_FILES;
+	}
+	free(fds);
+}
+
+static bool uring_init(struct event_base *base)
+{
+	const unsigned need = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+	struct io_uring_params p;
+	struct Uring *u;
+	size_t cq_size;
+	char *ring;
+
+	u = zmalloc(sizeof(*u));
+	if (!u)
+		return false;
+	base->uring = u;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = MIN_BACKEND_EVENTS * 16;
+	base->be_fd = syscall(__NR_io_uring_setup, MIN_BACKEND_EVENTS * 4, &p);
+	if (base->be_fd < 0)
+		return false;
+	if ((p.features & need) != need) {
+		errno = ENOSYS;
+		return false;
+	}
+	if (fcntl(base->be_fd, F_SETFD, FD_CLOEXEC) < 0)
+		return false;
+
+	u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (cq_size > u->sq_ring_size)
+		u->sq_ring_size = cq_size;
+	ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, base->be_fd, IORING_OFF_SQ_RING);
+	if (ring == MAP_FAILED) {
+		u->sq_ring = NULL;
+		return false;
+	}
+	u->sq_ring = ring;
+
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, base->be_fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		return false;
+	}
+
+	u->sq_khead = (unsigned *)(ring + p.sq_off.head);
+	u->sq_ktail = (unsigned *)(ring + p.sq_off.tail);
+	u->sq_kmask = (unsigned *)(ring + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)(ring + p.sq_off.array);
+	u->sq_entries = p.sq_entries;
+	u->sq_tail = *u->sq_ktail;
+
+	u->cq_khead = (unsigned *)(ring + p.cq_off.head);
+	u->cq_ktail = (unsigned *)(ring + p.cq_off.tail);
+	u->cq_kmask = (unsigned *)(ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+	uring_init_fixed(base);
+	return true;
+}
+
+/* make armed poll match wanted events */
+static bool uring_update_poll(struct event_base *base, int fd)
+{
+	struct FdSlot *slot = &base->fd_slots[fd];
+	struct io_uring_sqe *sqe;
+	unsigned want = 0;
+
+	if (slot->rd_ev)
+		want |= POLLIN;
+	if (slot->wr_ev)
+		want |= POLLOUT;
+	if (want == slot->poll_mask)
+		return true;
+
+	if (slot->poll_mask) {
+		sqe = uring_get_sqe(base);
+		if (!sqe)
+			return false;
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = poll_tag(fd, slot->poll_gen);
+		slot->poll_mask = 0;
+	}
+	slot->poll_gen = (slot->poll_gen + 1) & POLL_GEN_MASK;
+	if (!want)
+		return true;
+
+	sqe = uring_get_sqe(base);
+	if (!sqe)
+		return false;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+	want = (want << 16) | (want >> 16);
+#endif
+	sqe->poll32_events = want;
+	sqe->user_data = poll_tag(fd, slot->poll_gen);
+	slot->poll_mask = want;
+	return true;
+}
+
+static int uring_add(struct event_base *base, struct event *ev)
+{
+	struct FdSlot *slot;
+
+	slot = get_fd_slot(base, ev->fd);
+	if (!slot)
+		return -1;
+	fill_fd_slot(slot, ev);
+	if (!uring_update_poll(base, ev->fd)) {
+		clear_fd_slot(&base->fd_slots[ev->fd], ev);
+		return -1;
+	}
+	return 0;
+}
+
+static void uring_del(struct event_base *base, struct event *ev)
+{
+	if (ev->fd < 0 || ev->fd >= base->fd_slots_size)
+		return;
+	clear_fd_slot(&base->fd_slots[ev->fd], ev);
+	uring_update_poll(base, ev->fd);
+}
+
+static void uring_poll_done(struct event_base *base, uint64_t tag, int res)
+{
+	int fd = (uint32_t)(tag >> 1);
+	unsigned gen = (tag >> 33) & POLL_GEN_MASK;
+	struct FdSlot *slot;
+	bool rd, wr;
+
+	if (fd >= base->fd_slots_size)
+		return;
+	slot = &base->fd_slots[fd];
+	if (slot->poll_gen != gen || !slot->poll_mask)
+		return;
+	slot->poll_mask = 0;
+
+	if (res < 0) {
+		/* let callbacks see the error */
+		rd = wr = true;
+	} else {
+		bool err = (res & (POLLERR | POLLHUP)) != 0;
+		rd = err || (res & POLLIN);
+		wr = err || (res & POLLOUT);
+	}
+	queue_fd_ready(base, fd, rd, wr);
+
+	/* re-arm, goes out with next enter */
+	uring_update_poll(base, fd);
+}
+
+static void uring_op_done(struct EventOp *op, int res)
+{
+	op->pending = false;
+	op->cb_func(op, res, op->cb_arg);
+}
+
+static void uring_reap(struct event_base *base)
+{
+	struct Uring *u = base->uring;
+	struct io_uring_cqe *cqe;
+	unsigned head, tail;
+	uint64_t tag;
+	int res;
+
+	head = *u->cq_khead;
+	tail = __atomic_load_n(u->cq_ktail, __ATOMIC_ACQUIRE);
+	while (head != tail && !base->loop_break) {
+		cqe = &u->cqes[head & *u->cq_kmask];
+		tag = cqe->user_data;
+		res = cqe->res;
+		head++;
+		__atomic_store_n(u->cq_khead, head, __ATOMIC_RELEASE);
+
+		if (tag & 1)
+			uring_poll_done(base, tag, res);
+		else if (tag)
+			uring_op_done((struct EventOp *)(uintptr_t)tag, res);
+
+		if (head == tail)
+			tail = __atomic_load_n(u->cq_ktail, __ATOMIC_ACQUIRE);
+	}
+}
+
+static int uring_dispatch(struct event_base *base, int timeout_ms)
+{
+	struct Uring *u = base->uring;
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned to_submit, flags = 0, min_complete = 0;
+	bool cq_empty;
+	int res = 0;
+
+	uring_publish(u);
+	to_submit = uring_unsubmitted(u);
+	cq_empty = *u->cq_khead == __atomic_load_n(u->cq_ktail, __ATOMIC_ACQUIRE);
+
+	if (timeout_ms > 0 && cq_empty) {
+		memset(&arg, 0, sizeof(arg));
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+		arg.ts = (uint64_t)(uintptr_t)&ts;
+		flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+		min_complete = 1;
+	}
+	if (to_submit > 0 || min_complete > 0)
+		res = uring_enter(base->be_fd, to_submit, min_complete, flags,
+				  min_complete ? &arg : NULL, min_complete ? sizeof(arg) : 0);
+	reset_time_cache();
+	base_dbg(base, "io_uring_enter(submit=%u, timeout=%d) = res=%d errno=%d",
+		 to_submit, timeout_ms, res, res < 0 ? errno : 0);
+
+	if (res < 0 && errno != EINTR && errno != ETIME && errno != EBUSY)
+		return -1;
+
+	uring_reap(base);
+	return 0;
+}
+
+/* index of registered buffer that contains [buf, buf+len) */
+static int uring_find_buf(struct Uring *u, const void *buf, size_t len)
+{
+	const char *p = buf;
+	unsigned i;
+
+	for (i = 0; i < u->nbufs; i++) {
+		const char *start = u->bufs[i].iov_base;
+		if (p >= start && p + len <= start + u->bufs[i].iov_len)
+			return i;
+	}
+	return -1;
+}
+
+static int uring_op_submit(struct event_base *base, struct EventOp *op)
+{
+	struct io_uring_sqe *sqe;
+	struct FdSlot *slot = NULL;
+	int bufidx = -1;
+
+	sqe = uring_get_sqe(base);
+	if (!sqe)
+		return -1;
+
+	if (op->fd >= 0 && op->fd < base->fd_slots_size)
+		slot = &base->fd_slots[op->fd];
+	if (slot && slot->fixed_idx > 0) {
+		sqe->fd = slot->fixed_idx - 1;
+		sqe->flags |= IOSQE_FIXED_FILE;
+	} else {
+		sqe->fd = op->fd;
+	}
+
+	switch (op->op_type) {
+	case EV_OP_READ:
+	case EV_OP_WRITE:
+		bufidx = uring_find_buf(base->uring, op->buf, op->len);
+		if (bufidx >= 0) {
+			sqe->opcode = (op->op_type == EV_OP_READ) ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+			sqe->buf_index = bufidx;
+		} else {
+			sqe->opcode = (op->op_type == EV_OP_READ) ? IORING_OP_READ : IORING_OP_WRITE;
+		}
+		sqe->addr = (uintptr_t)op->buf;
+		sqe->len = op->len;
+		/* current position, ignored for sockets */
+		sqe->off = (uint64_t)-1;
+		break;
+	case EV_OP_ACCEPT:
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+		break;
+	}
+	sqe->user_data = (uintptr_t)op;
+	return 0;
+}
+
+static int uring_op_cancel(struct event_base *base, struct EventOp *op)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(base);
+	if (!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (uintptr_t)op;
+	return 0;
+}
+
+static int uring_register_buffers(struct event_base *base, const struct iovec *iov, unsigned count)
+{
+	struct Uring *u = base->uring;
+	struct iovec *copy = NULL;
+
+	if (count > 0) {
+		copy = malloc(count * sizeof(*iov));
+		if (!copy)
+			return -1;
+		memcpy(copy, iov, count * sizeof(*iov));
+	}
+	if (u->nbufs > 0)
+		uring_register(base->be_fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+	free(u->bufs);
+	u->bufs = NULL;
+	u->nbufs = 0;
+	if (count == 0)
+		return 0;
+
+	if (uring_register(base->be_fd, IORING_REGISTER_BUFFERS, copy, count) < 0) {
+		free(copy);
+		return -1;
+	}
+	u->bufs = copy;
+	u->nbufs = count;
+	return 0;
+}
+
+static bool uring_update_file(struct event_base *base, int idx, int fd)
+{
+	struct io_uring_files_update upd;
+
+	memset(&upd, 0, sizeof(upd));
+	upd.offset = idx;
+	upd.fds = (uint64_t)(uintptr_t)&fd;
+	return uring_register(base->be_fd, IORING_REGISTER_FILES_UPDATE, &upd, 1) == 1;
+}
+
+static int uring_register_fd(struct event_base *base, int fd)
+{
+	struct Uring *u = base->uring;
+	struct FdSlot *slot;
+	int idx;
+
+	slot = get_fd_slot(base, fd);
+	if (!slot)
+		return -1;
+	/* no table or full - just use plain fd */
+	if (slot->fixed_idx > 0 || !u->fixed_ok || u->fixed_nfree == 0)
+		return 0;
+
+	idx = u->fixed_free[u->fixed_nfree - 1];
+	if (!uring_update_file(base, idx, fd))
+		return -1;
+	u->fixed_nfree--;
+	slot->fixed_idx = idx + 1;
+	return 0;
+}
+
+static void uring_unregister_fd(struct event_base *base, int fd)
+{
+	struct Uring *u = base->uring;
+	struct FdSlot *slot;
+	int idx;
+
+	if (fd < 0 || fd >= base->fd_slots_size)
+		return;
+	slot = &base->fd_slots[fd];
+	if (slot->fixed_idx <= 0)
+		return;
+	idx = slot->fixed_idx - 1;
+	uring_update_file(base, idx, -1);
+	u->fixed_free[u->fixed_nfree++] = idx;
+	slot->fixed_idx = 0;
+}
+
+static const struct EventOps uring_ops = {
+	"io_uring", uring_init, uring_free, uring_add, uring_del, uring_dispatch,
+	uring_op_submit, uring_op_cancel
+};
+
+#endif
+
+/* backends in order of preference, io_uring only by name */
+static const struct EventOps *backend_list[] = {
+#ifdef USE_EPOLL
+	&epoll_ops,
+#endif
+#ifdef USE_KQUEUE
+	&kqueue_ops,
+#endif
+	&poll_ops,
+#ifdef USE_URING
+	&uring_ops,
+#endif
+	NULL
+};
+
+/*
+ * Single base functions.
+ */
+
+int event_loop(int loop_flags)
+{
+	return event_base_loop(current_base, loop_flags);
+}
+
+int event_loopbreak(void)
+{
+	return event_base_loopbreak(current_base);
+}
+
+void event_set(struct event *ev, int fd, short flags, uevent_cb_f cb, void *arg)
+{
+	event_assign(ev, current_base, fd, flags, cb, arg);
+}
+
+int event_once(int fd, short flags, uevent_cb_f cb_func, void *cb_arg, struct timeval *timeout)
+{
+	return event_base_once(current_base, fd, flags, cb_func, cb_arg, timeout);
+}
+
+int event_loopexit(struct timeval *timeout)
+{
+	return event_base_loopexit(current_base, timeout);
+}
+
+/*
+ * Event base initialization.
+ */
+
+struct event_base *event_init(void)
+{
+	return event_init_backend(NULL);
+}
+
+/* use named backend, or best available if NULL */
+struct event_base *event_init_backend(const char *backend)
+{
+	struct event_base *base;
+	const struct EventOps **ops;
+	int i;
+
+	base = calloc(1, sizeof(*base));
+	if (!base)
+		return NULL;
+
+	/* initialize timeout and fd areas */
+	aatree_init(&base->timeout_tree, cmp_timeout, NULL);
+	statlist_init(&base->fd_list, "fd_list");
+	base->be_fd = -1;
+
+	/* single priority by default */
+	for (i = 0; i < EVENT_MAX_PRIORITIES; i++)
+		list_init(&base->active_list[i]);
+	base->npriorities = 1;
+
+	/* initialize signal areas */
+	for (i = 0; i < MAX_SIGNAL; i++)
+		list_init(&base->sig_waiters[i]);
+	base->sig_send = base->sig_recv = -1;
+
+	/* pick backend, fall back to next one on failure */
+	for (ops = backend_list; *ops; ops++) {
+		if (backend && strcmp(backend, (*ops)->name) != 0)
+			continue;
+		if ((*ops)->init(base)) {
+			base->ops = *ops;
+			break;
+		}
+		(*ops)->release(base);
+		if (backend)
+			break;
+	}
+	if (!base->ops) {
+		if (!backend || !*ops)
+			errno = ENOSYS;
+		free(base);
+		return NULL;
+	}
+
+	if (!current_base)
+		current_base = base;
+	return base;
+}
+
+const char *event_base_get_method(const struct event_base *base)
+{
+	return base->ops->name;
+}
+
+void event_base_free(struct event_base *base)
+{
+	if (!base) {
+		if (!current_base)
+			return;
+		base = current_base;
+	}
+	if (base == current_base)
+		current_base = NULL;
+	sig_close(base);
+	base->ops->release(base);
+	if (base->once_slab)
+		slab_destroy(base->once_slab);
+	free(base->stats);
+	free(base->timer_wheel);
+	free(base);
+}
+
+int event_base_loopbreak(struct event_base *base)
+{
+	base->loop_break = true;
+	return 0;
+}
+
+/* like libevent, default priority is npriorities / 2 */
+int event_base_priority_init(struct event_base *base, int npriorities)
+{
+	if (npriorities < 1 || npriorities > EVENT_MAX_PRIORITIES) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (base->active_count > 0) {
+		errno = EBUSY;
+		return -1;
+	}
+	base->npriorities = npriorities;
+	return 0;
+}
+
+int event_priority_set(struct event *ev, int priority)
+{
+	if ((ev->flags & EV_ACTIVE) || priority < 0 || priority >= ev->base->npriorities) {
+		errno = EINVAL;
+		return -1;
+	}
+	ev->priority = priority;
+	return 0;
+}
+
+void event_base_set_budget(struct event_base *base, int max_callbacks, int max_timeouts)
+{
+	base->cb_budget = max_callbacks > 0 ? max_callbacks : 0;
+	base->timer_budget = max_timeouts > 0 ? max_timeouts : 0;
+}
+
+/* switch timeout storage, allowed only when no timeouts are pending */
+int event_base_set_timer_wheel(struct event_base *base, bool enable)
+{
+	struct TimerWheel *w;
+
+	if (timeout_count(base) > 0) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (!enable) {
+		free(base->timer_wheel);
+		base->timer_wheel = NULL;
+		return 0;
+	}
+	if (base->timer_wheel)
+		return 0;
+	w = malloc(sizeof(*w));
+	if (!w)
+		return -1;
+	wheel_init(w, base);
+	base->timer_wheel = w;
+	return 0;
+}
+
+static int timeout_count(struct event_base *base)
+{
+	if (base->timer_wheel)
+		return base->timer_wheel->count;
+	return base->timeout_tree.count;
+}
+
+/*
+ * Loop statistics.
+ *
+ * Callback end time is taken from fresh time cache, which then
+ * serves as start of next callback, so each callback costs
+ * one clock read.
+ */
+
+/* bucket 0 is < 1us, bucket n is [2^(n-1), 2^n) usec */
+static inline int hist_bucket(usec_t d)
+{
+	int b;
+
+	if (d == 0)
+		return 0;
+	b = 64 - __builtin_clzll(d);
+	return b < EVENT_STATS_HIST_BUCKETS ? b : EVENT_STATS_HIST_BUCKETS - 1;
+}
+
+static void stats_slowest(struct EventBaseStats *st, uevent_cb_f cb_func, usec_t d)
+{
+	struct EventCallbackStat *s, *min = NULL;
+	int i;
+
+	for (i = 0; i < EVENT_STATS_SLOWEST; i++) {
+		s = &st->slowest[i];
+		if (s->cb_func == cb_func || !s->cb_func) {
+			s->cb_func = cb_func;
+			if (d > s->max_usec)
+				s->max_usec = d;
+			return;
+		}
+		if (!min || s->max_usec < min->max_usec)
+			min = s;
+	}
+	if (d > min->max_usec) {
+		min->cb_func = cb_func;
+		min->max_usec = d;
+	}
+}
+
+static void stats_callback(struct EventBaseStats *st, uevent_cb_f cb_func, usec_t start)
+{
+	usec_t d;
+
+	reset_time_cache();
+	d = get_cached_monotonic() - start;
+	st->callbacks++;
+	st->callback_usec += d;
+	st->cb_hist[hist_bucket(d)]++;
+	if (d > st->slowest_min || !st->slowest[EVENT_STATS_SLOWEST - 1].cb_func) {
+		int i;
+		stats_slowest(st, cb_func, d);
+		st->slowest_min = st->slowest[0].max_usec;
+		for (i = 1; i < EVENT_STATS_SLOWEST; i++) {
+			if (st->slowest[i].max_usec < st->slowest_min)
+				st->slowest_min = st->slowest[i].max_usec;
+		}
+	}
+}
+
+int event_base_enable_stats(struct event_base *base, bool enable)
+{
+	if (!enable) {
+		free(base->stats);
+		base->stats = NULL;
+		return 0;
+	}
+	if (base->stats)
+		return 0;
+	base->stats = zmalloc(sizeof(*base->stats));
+	return base->stats ? 0 : -1;
+}
+
+void event_base_reset_stats(struct event_base *base)
+{
+	if (base->stats)
+		memset(base->stats, 0, sizeof(*base->stats));
+}
+
+int event_base_get_stats(struct event_base *base, struct EventBaseStats *dst)
+{
+	if (!base->stats) {
+		errno = EINVAL;
+		return -1;
+	}
+	*dst = *base->stats;
+	dst->timeouts_pending = timeout_count(base);
+	dst->fd_count = statlist_count(&base->fd_list);
+	dst->active_count = base->active_count;
+	return 0;
+}
+
+/*
+ * Multi-base functions.
+ */
+
+void event_assign(struct event *ev, struct event_base *base, int fd, short flags, uevent_cb_f cb, void *arg)
+{
+	Assert(base);
+	Assert((ev->flags & EV_ACTIVE) == 0);
+
+	ev->fd = fd;
+	ev->base = base;
+	ev->flags = flags;
+	ev->cb_func = cb;
+	ev->cb_arg = arg;
+	ev->ev_idx = -1;
+	ev->priority = base->npriorities / 2;
+	ev->res_flags = 0;
+	list_init(&ev->node);
+	list_init(&ev->wheel_node);
+	list_init(&ev->active_node);
+	ev_dbg(ev, "event_set");
+}
+
+int event_del(struct event *ev)
+{
+	struct event_base *base = ev->base;
+
+	/* allow repeated deletions */
+	if ((ev->flags & EV_ACTIVE) == 0) {
+		ev_dbg(ev, "event_del for inactive event??");
+		return 0;
+	}
+	ev_dbg(ev, "event_del");
+
+	/* readiness not delivered yet */
+	if (ev->flags & EV_QUEUED)
+		unqueue_event(base, ev);
+
+	/* remove from fd/signal list */
+	if (ev->flags & EV_SIGNAL) {
+		list_del(&ev->node);
+	} else if (ev->flags & (EV_READ | EV_WRITE)) {
+		statlist_remove(&base->fd_list, &ev->node);
+		base->ops->del(base, ev);
+	}
+
+	/* remove from timeout tree */
+	if (ev->flags & EV_TIMEOUT) {
+		if (base->timer_wheel)
+			wheel_remove(base->timer_wheel, ev);
+		else
+			aatree_remove(&base->timeout_tree, (long)&ev->timeout_node);
+		ev->flags &= ~EV_TIMEOUT;
+	}
+
+	/* tag inactive */
+	ev->flags &= ~EV_ACTIVE;
+
+	return 0;
+}
+
+
+/* handles only relarive timeouts */
+int event_add(struct event *ev, struct timeval *timeout)
+{
+	struct event_base *base = ev->base;
+
+	Assert((ev->flags & EV_ACTIVE) == 0);
+	Assert(base);
+
+	/* timeout sanity check, but dont use it yet */
+	if (timeout) {
+		if (ev->flags & EV_PERSIST) {
+			errno = EINVAL;
+			return -1;
+		}
+	} else if (ev->flags & EV_TIMEOUT) {
+		ev->flags &= ~EV_TIMEOUT;
+	}
+
+	/* setup signal/fd */
+	if (ev->flags & EV_SIGNAL) {
+		if (ev->flags & (EV_READ|EV_WRITE)) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (!sig_init(base, ev->fd))
+			return -1;
+		list_append(&base->sig_waiters[ev->fd], &ev->node);
+	} else if (ev->flags & (EV_READ|EV_WRITE)) {
+		if (base->ops->add(base, ev) < 0)
+			return -1;
+		statlist_append(&base->fd_list, &ev->node);
+	}
+
+	/* now act on timeout */
+	if (timeout) {
+		fill_timeout(base, &ev->timeout, timeout);
+		ev->flags |= EV_TIMEOUT;
+		if (base->timer_wheel)
+			wheel_insert(base->timer_wheel, ev);
+		else
+			aatree_insert(&base->timeout_tree, (long)&ev->timeout_node, &ev->timeout_node);
+	}
+	ev->flags |= EV_ACTIVE;
+
+	ev_dbg(ev, "event_add");
+
+	return 0;
+}
+
+/*
+ * Event loop functions.
+ */
+
+static inline struct event *get_smallest_timeout(struct event_base *base)
+{
+	struct AANode *first = aatree_min(&base->timeout_tree);
+
+	if (first)
+		return container_of(first, struct event, timeout_node);
+	return NULL;
+}
+
+static int calc_timeout(struct event_base *base)
+{
+	struct event *ev;
+	usec_t now, next;
+
+	if (base->timer_wheel) {
+		struct TimerWheel *w = base->timer_wheel;
+		if (w->count == 0)
+			return MAX_SLEEP * 1000;
+		now = now_tick(base);
+		next = wheel_next_tick(w);
+		if (next <= now)
+			return 0;
+		if (next - now > MAX_SLEEP * 1000)
+			return MAX_SLEEP * 1000;
+		return next - now;
+	}
+
+	ev = get_smallest_timeout(base);
+	if (!ev)
+		return MAX_SLEEP * 1000;
+
+	now = loop_now(base);
+	next = tv_to_usec(&ev->timeout);
+	if (next <= now)
+		return 0;
+	if (next - now > MAX_SLEEP * USEC)
+		return MAX_SLEEP * 1000;
+	return (next - now + 999) / 1000;
+}
+
+/* expired timers beyond budget stay for next iteration */
+static void process_timeouts(struct event_base *base)
+{
+	int budget = base->timer_budget;
+	struct event *ev;
+	usec_t now;
+
+	if (base->timer_wheel) {
+		wheel_process(base, base->timer_wheel, now_tick(base), budget);
+		return;
+	}
+
+	ev = get_smallest_timeout(base);
+	if (!ev)
+		return;
+
+	now = loop_now(base);
+
+	while (ev) {
+		if (now < tv_to_usec(&ev->timeout))
+			break;
+		deliver_event(ev, EV_TIMEOUT);
+		if (base->loop_break)
+			break;
+		if (budget > 0 && --budget == 0)
+			break;
+		ev = get_smallest_timeout(base);
+	}
+}
+
+/* run queued callbacks in priority order, rest waits for next iteration */
+static void process_active(struct event_base *base)
+{
+	int pri, budget = base->cb_budget;
+	struct List *node;
+	struct event *ev;
+	short flags;
+
+	for (pri = 0; pri < base->npriorities; pri++) {
+		while ((node = list_first(&base->active_list[pri])) != NULL) {
+			ev = container_of(node, struct event, active_node);
+			flags = ev->res_flags;
+			unqueue_event(base, ev);
+			deliver_event(ev, flags);
+			if (base->loop_break)
+				return;
+			if (budget > 0 && --budget == 0)
+				return;
+		}
+	}
+}
+
+int event_base_loop(struct event_base *base, int loop_flags)
+{
+	int res, timeout_ms;
+
+	/* don't loop if non-block was requested */
 	if (loop_flags & EVLOOP_NONBLOCK)
+		loop_flags |= EVLOOP_ONCE;
+
+	base->loop_break = false;
+	base->loop_exit = false;
+	base->in_loop = true;
+loop:
+	/* fresh time for sleep calculation */
+	reset_time_cache();
+	if ((loop_flags & EVLOOP_NONBLOCK) || base->active_count > 0)
 		timeout_ms = 0;
 	else
 		timeout_ms = calc_timeout(base);
 
-	res = poll(base->pfd_list, pf_cnt, timeout_ms);
-	base_dbg(base, "poll(%d, timeout=%d) = res=%d errno=%d",
-		 pf_cnt, timeout_ms, res, res < 0 ? errno : 0);
+	/* backend resets time cache after waiting */
+	if (base->stats) {
+		usec_t start = get_cached_monotonic();
+		res = base->ops->dispatch(base, timeout_ms);
+		base->stats->iterations++;
+		base->stats->poll_usec += get_cached_monotonic() - start;
+	} else {
+		res = base->ops->dispatch(base, timeout_ms);
+	}
+	if (res < 0)
+		goto done;
+	res = 0;
 
-	if (res == -1 && errno != EINTR)
-		return -1;
+	if (base->loop_break)
+		goto done;
 
-	if (res > 0) {
-		process_fds(base, pf_cnt);
-		if (base->loop_break)
-			return 0;
-	}
+	process_active(base);
+
+	if (base->loop_break)
+		goto done;
 
 	process_timeouts(base);
 
+	/* report bursts of rate-limited lines that ended */
+	log_ratelimit_flush();
+
 	if (base->loop_break)
-		return 0;
+		goto done;
 
 	if (loop_flags & EVLOOP_ONCE)
-		return 0;
+		goto done;
 
 	if (base->loop_exit)
-		return 0;
+		goto done;
 
 	goto loop;
+done:
+	/* don't leave stale time to code outside loop */
+	base->in_loop = false;
+	reset_time_cache();
+	return res;
 }
 
 /*
  * Signal handling.
  */
 
+/*
+ * Signals are process-wide, so only one base can have signal
+ * events - the first one that adds them.
+ *
+ * On Linux signals are blocked in the thread that adds them and
+ * read from signalfd, so a burst costs single read.  With kqueue
+ * they are registered as EVFILT_SIGNAL.  Otherwise the handler
+ * writes a byte to socketpair and reader checks counters.
+ *
+ * The global handler stays installed in all cases, for threads
+ * where signal is not blocked.
+ */
+
 /* global signal handler registered via sigaction() */
 static void uevent_sig_handler(int sig, siginfo_t *si, void *arg)
 {
-	struct List *node, *tmp;
-	struct event_base *base;
-	uint8_t byte = sig;
-	int res;
+	struct event_base *base = sig_base;
+	int old_errno = errno;
 
 	if (sig < 0 || sig >= MAX_SIGNAL)
 		return;
 	sig_count[sig]++;
 
-	list_for_each_safe(node, &sig_base_list, tmp) {
-		base = container_of(node, struct event_base, sig_node);
-		if (base->sig_send >= 0) {
-		loop:
-			res = send(base->sig_send, &byte, 1, MSG_NOSIGNAL);
-			if (res == -1 && (errno == EINTR))
-				goto loop;
-		}
+#ifdef USE_SIGNALFD
+	/* blocked there, so it gets pending for signalfd */
+	if (base && base->sig_recv >= 0)
+		pthread_kill(base->sig_thread, sig);
+#else
+	if (base && base->sig_send >= 0) {
+		uint8_t byte = sig;
+		int res;
+	loop:
+		res = send(base->sig_send, &byte, 1, MSG_NOSIGNAL);
+		if (res == -1 && (errno == EINTR))
+			goto loop;
 	}
+#endif
+	errno = old_errno;
 }
 
 /* close signal resources on one base */
 static void sig_close(struct event_base *base)
 {
-	list_del(&base->sig_node);
+	pthread_mutex_lock(&sig_lock);
+	if (sig_base == base)
+		sig_base = NULL;
+	pthread_mutex_unlock(&sig_lock);
+
+	if (base->sig_recv >= 0)
+		event_del(&base->sig_ev);
+#ifdef USE_SIGNALFD
+	if (base->sig_recv >= 0 && pthread_equal(base->sig_thread, pthread_self()))
+		pthread_sigmask(SIG_UNBLOCK, &base->sig_mask, NULL);
+#endif
 	if (base->sig_send >= 0)
 		close(base->sig_send);
 	if (base->sig_recv >= 0)
 		close(base->sig_recv);
 	base->sig_recv = base->sig_send = -1;
+	base->sig_kqueue = false;
 }
 
 /* call all handlers waiting for specific signal */
@@ -600,12 +2277,107 @@ static void deliver_signal(struct event_base *base, int sig)
 {
 	struct List *node, *tmp;
 
+	if (sig <= 0 || sig >= MAX_SIGNAL)
+		return;
 	list_for_each_safe(node, &base->sig_waiters[sig], tmp) {
 		struct event *ev = container_of(node, struct event, node);
 		deliver_event(ev, EV_SIGNAL);
 	}
 }
 
+/* global handler setup, must be called under sig_lock */
+static bool sig_setup_handler(int sig)
+{
+	struct sigaction sa;
+
+	if (signal_set_up[sig])
+		return true;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = uevent_sig_handler;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	if (sigaction(sig, &sa, &old_handler[sig]) != 0)
+		return false;
+	signal_set_up[sig] = true;
+	return true;
+}
+
+#ifdef USE_SIGNALFD
+
+/* read all queued signals, deliver each kind once */
+static void sigfd_reader(int fd, short flags, void *arg)
+{
+	struct event_base *base = arg;
+	struct signalfd_siginfo buf[16];
+	uint64_t seen[(MAX_SIGNAL + 63) / 64];
+	int res, i, sig;
+
+	if (base->stats)
+		base->stats->signal_wakeups++;
+
+	memset(seen, 0, sizeof(seen));
+	while (1) {
+		res = read(fd, buf, sizeof(buf));
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			break;
+		for (i = 0; i < res / (int)sizeof(buf[0]); i++) {
+			sig = buf[i].ssi_signo;
+			if (sig > 0 && sig < MAX_SIGNAL)
+				seen[sig / 64] |= (uint64_t)1 << (sig % 64);
+		}
+		if (res < (int)sizeof(buf))
+			break;
+	}
+	if (res < 0 && errno != EAGAIN) {
+		sig_close(base);
+		return;
+	}
+
+	for (sig = 1; sig < MAX_SIGNAL; sig++) {
+		if (seen[sig / 64] & ((uint64_t)1 << (sig % 64)))
+			deliver_signal(base, sig);
+	}
+}
+
+static bool sig_add_source(struct event_base *base, int sig)
+{
+	sigset_t one, new_mask;
+	int fd;
+
+	if (base->sig_recv < 0) {
+		sigemptyset(&base->sig_mask);
+		base->sig_thread = pthread_self();
+	} else if (!pthread_equal(base->sig_thread, pthread_self())) {
+		/* mask is per-thread */
+		errno = EBUSY;
+		return false;
+	}
+
+	new_mask = base->sig_mask;
+	sigaddset(&new_mask, sig);
+	fd = signalfd(base->sig_recv, &new_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0)
+		return false;
+	if (base->sig_recv < 0) {
+		event_assign(&base->sig_ev, base, fd, EV_READ | EV_PERSIST, sigfd_reader, base);
+		base->sig_ev.priority = 0;
+		if (event_add(&base->sig_ev, NULL) != 0) {
+			close(fd);
+			return false;
+		}
+		base->sig_recv = fd;
+	}
+
+	sigemptyset(&one);
+	sigaddset(&one, sig);
+	pthread_sigmask(SIG_BLOCK, &one, NULL);
+	base->sig_mask = new_mask;
+	return true;
+}
+
+#else /* !USE_SIGNALFD */
+
 /* reader from sig socket, calls actual signal handlers */
 static void sig_reader(int fd, short flags, void *arg)
 {
@@ -613,6 +2385,9 @@ static void sig_reader(int fd, short flags, void *arg)
 	uint8_t buf[128];
 	int res, sig;
 
+	if (base->stats)
+		base->stats->signal_wakeups++;
+
 	/* drain the socket */
 loop:
 	res = recv(fd, buf, sizeof(buf), 0);
@@ -643,27 +2418,12 @@ some_error:
 	sig_close(base);
 }
 
-static bool sig_init(struct event_base *base, int sig)
+static bool sig_add_socketpair(struct event_base *base, int sig)
 {
 	int spair[2];
 
-	if (sig < 0 || sig >= MAX_SIGNAL) {
-		errno = EINVAL;
-		return false;
-	}
-
-	/* global handler setup */
-	if (!signal_set_up[sig]) {
-		struct sigaction sa;
-		memset(&sa, 0, sizeof(sa));
-		sa.sa_sigaction = uevent_sig_handler;
-		sa.sa_flags = SA_SIGINFO | SA_RESTART;
-		if (sigaction(sig, &sa, &old_handler[sig]) != 0)
-			return false;
-	}
-
 	/* local handler for base */
-	if (list_empty(&base->sig_node)) {
+	if (base->sig_recv < 0) {
 		if (socketpair(AF_UNIX, SOCK_STREAM, 0, spair) != 0)
 			return false;
 		if (!socket_setup(spair[0], true))
@@ -671,11 +2431,11 @@ static bool sig_init(struct event_base *base, int sig)
 		if (!socket_setup(spair[1], true))
 			goto failed;
 		event_assign(&base->sig_ev, base, spair[1], EV_READ|EV_PERSIST, sig_reader, base);
+		base->sig_ev.priority = 0;
 		if (event_add(&base->sig_ev, NULL) != 0)
 			goto failed;
 		base->sig_send = spair[0];
 		base->sig_recv = spair[1];
-		list_append(&sig_base_list, &base->sig_node);
 	}
 
 	/* if first waiter, then ignore previous signals */
@@ -689,58 +2449,183 @@ failed:
 	return false;
 }
 
+static bool sig_add_source(struct event_base *base, int sig)
+{
+#ifdef USE_KQUEUE
+	/* kqueue sees signals also when they are ignored */
+	if (base->ops == &kqueue_ops) {
+		if (kqueue_change(base, sig, EVFILT_SIGNAL, EV_ADD) < 0)
+			return false;
+		if (!signal_set_up[sig]) {
+			if (signal(sig, SIG_IGN) == SIG_ERR)
+				return false;
+			signal_set_up[sig] = true;
+		}
+		base->sig_kqueue = true;
+		return true;
+	}
+#endif
+	if (!sig_setup_handler(sig))
+		return false;
+	return sig_add_socketpair(base, sig);
+}
+
+#endif /* !USE_SIGNALFD */
+
+static bool sig_init(struct event_base *base, int sig)
+{
+	bool ok = false;
+
+	if (sig <= 0 || sig >= MAX_SIGNAL) {
+		errno = EINVAL;
+		return false;
+	}
+
+	pthread_mutex_lock(&sig_lock);
+
+	/* signals go to single base */
+	if (sig_base && sig_base != base) {
+		errno = EBUSY;
+		goto out;
+	}
+
+#ifdef USE_SIGNALFD
+	/* handler forwards signals from other threads */
+	if (!sig_setup_handler(sig))
+		goto out;
+#endif
+	if (!sig_add_source(base, sig))
+		goto out;
+	sig_base = base;
+	ok = true;
+out:
+	pthread_mutex_unlock(&sig_lock);
+	return ok;
+}
+
+/* in child after fork(), no locking as there are no other threads */
+void event_reset_sigmask(void)
+{
+#ifdef USE_SIGNALFD
+	struct event_base *base = sig_base;
+
+	if (!base || base->sig_recv < 0)
+		return;
+	/* handler must not forward to itself anymore */
+	sig_base = NULL;
+	if (pthread_equal(base->sig_thread, pthread_self()))
+		pthread_sigmask(SIG_UNBLOCK, &base->sig_mask, NULL);
+#endif
+}
+
 /*
  * One-time events.
+ *
+ * Taken from per-base slab, so firing costs no malloc/free.
+ * Optional handle pointer is cleared when event fires or
+ * is cancelled, it must stay valid until then.
  */
 
-struct once_event {
+struct EventOnce {
 	struct event ev;
 	uevent_cb_f cb_func;
 	void *cb_arg;
+	struct EventOnce **handle_p;
 };
 
+static void once_release(struct EventOnce *once)
+{
+	if (once->handle_p)
+		*once->handle_p = NULL;
+	slab_free(once->ev.base->once_slab, once);
+}
+
 static void once_handler(int fd, short flags, void *arg)
 {
-	struct once_event *once = arg;
+	struct EventOnce *once = arg;
 	uevent_cb_f cb_func = once->cb_func;
 	void *cb_arg = once->cb_arg;
 
-	free(once);
+	/* callback may reuse the handle */
+	once_release(once);
 	cb_func(fd, flags, cb_arg);
 }
 
-int event_base_once(struct event_base *base, int fd, short flags,
-		    uevent_cb_f cb_func, void *cb_arg,
-		    struct timeval *timeout)
+int event_base_once_handle(struct event_base *base, int fd, short flags,
+			   uevent_cb_f cb_func, void *cb_arg,
+			   struct timeval *timeout, struct EventOnce **handle_p)
 {
-	struct once_event *once;
+	struct EventOnce *once;
 
 	if (flags & EV_PERSIST) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	once = zmalloc(sizeof(*once));
+	if (!base->once_slab) {
+		base->once_slab = slab_create("event_once", sizeof(struct EventOnce), 0, NULL);
+		if (!base->once_slab)
+			return -1;
+	}
+	once = slab_alloc(base->once_slab);
 	if (!once)
 		return -1;
+	once->cb_func = cb_func;
+	once->cb_arg = cb_arg;
 
 	event_assign(&once->ev, base, fd, flags, once_handler, once);
 	if (event_add(&once->ev, timeout) != 0) {
-		free(once);
+		slab_free(base->once_slab, once);
 		return -1;
 	}
+	once->handle_p = handle_p;
+	if (handle_p)
+		*handle_p = once;
 	return 0;
 }
 
+int event_base_once(struct event_base *base, int fd, short flags,
+		    uevent_cb_f cb_func, void *cb_arg,
+		    struct timeval *timeout)
+{
+	return event_base_once_handle(base, fd, flags, cb_func, cb_arg, timeout, NULL);
+}
+
+void event_once_cancel(struct EventOnce **handle_p)
+{
+	struct EventOnce *once = *handle_p;
+
+	if (!once)
+		return;
+	event_del(&once->ev);
+	once_release(once);
+}
+
 static void loopexit_handler(int fd, short flags, void *arg)
 {
 	struct event_base *base = arg;
 	base->loop_exit = true;
 }
 
+/* uses event embedded in base, earliest timeout wins */
 int event_base_loopexit(struct event_base *base, struct timeval *timeout)
 {
-	return event_base_once(base, -1, 0, loopexit_handler, base, timeout);
+	struct event *ev = &base->exit_ev;
+	struct timeval zero = { 0, 0 };
+	struct timeval abs;
+
+	/* NULL means after current iteration */
+	if (!timeout)
+		timeout = &zero;
+
+	if (ev->flags & EV_ACTIVE) {
+		fill_timeout(base, &abs, timeout);
+		if (cmp_tv(&abs, &ev->timeout) >= 0)
+			return 0;
+		event_del(ev);
+	}
+	event_assign(ev, base, -1, 0, loopexit_handler, base);
+	return event_add(ev, timeout);
 }
 
 int event_base_set(struct event_base *base, struct event *ev)
@@ -753,6 +2638,128 @@ int event_base_set(struct event_base *base, struct event *ev)
 	return 0;
 }
 
+/*
+ * Completion-style operations.
+ *
+ * With io_uring the operation itself is queued to kernel,
+ * other backends wait for readiness and then do the syscall.
+ */
+
+static void op_ready(int fd, short flags, void *arg)
+{
+	struct EventOp *op = arg;
+	int res;
+
+	switch (op->op_type) {
+	case EV_OP_READ:
+		res = read(fd, op->buf, op->len);
+		break;
+	case EV_OP_WRITE:
+		res = write(fd, op->buf, op->len);
+		break;
+	case EV_OP_ACCEPT:
+		res = safe_accept_nb(fd, NULL, NULL);
+		break;
+	default:
+		res = -1;
+		errno = EINVAL;
+	}
+
+	/* spurious wakeup, wait again */
+	if (res < 0 && (errno == EAGAIN || errno == EINTR)) {
+		if (event_add(&op->ev, NULL) == 0)
+			return;
+	}
+	op->pending = false;
+	op->cb_func(op, res < 0 ? -errno : res, op->cb_arg);
+}
+
+static int op_start(struct event_base *base, struct EventOp *op, int op_type, int fd,
+		    void *buf, size_t len, uevent_op_f cb_func, void *cb_arg)
+{
+	short flags = (op_type == EV_OP_WRITE) ? EV_WRITE : EV_READ;
+
+	Assert(!op->pending);
+
+	op->base = base;
+	op->op_type = op_type;
+	op->fd = fd;
+	op->buf = buf;
+	op->len = len;
+	op->cb_func = cb_func;
+	op->cb_arg = cb_arg;
+
+	if (base->ops->op_submit) {
+		if (base->ops->op_submit(base, op) < 0)
+			return -1;
+	} else {
+		event_assign(&op->ev, base, fd, flags, op_ready, op);
+		if (event_add(&op->ev, NULL) < 0)
+			return -1;
+	}
+	op->pending = true;
+	return 0;
+}
+
+int event_op_read(struct event_base *base, struct EventOp *op, int fd, void *buf, size_t len,
+		  uevent_op_f cb_func, void *cb_arg)
+{
+	return op_start(base, op, EV_OP_READ, fd, buf, len, cb_func, cb_arg);
+}
+
+int event_op_write(struct event_base *base, struct EventOp *op, int fd, const void *buf, size_t len,
+		   uevent_op_f cb_func, void *cb_arg)
+{
+	return op_start(base, op, EV_OP_WRITE, fd, (void *)buf, len, cb_func, cb_arg);
+}
+
+int event_op_accept(struct event_base *base, struct EventOp *op, int fd,
+		    uevent_op_f cb_func, void *cb_arg)
+{
+	return op_start(base, op, EV_OP_ACCEPT, fd, NULL, 0, cb_func, cb_arg);
+}
+
+int event_op_cancel(struct EventOp *op)
+{
+	struct event_base *base = op->base;
+
+	if (!op->pending)
+		return 0;
+	if (base->ops->op_cancel)
+		return base->ops->op_cancel(base, op);
+
+	event_del(&op->ev);
+	op->pending = false;
+	op->cb_func(op, -ECANCELED, op->cb_arg);
+	return 0;
+}
+
+int event_base_register_buffers(struct event_base *base, const struct iovec *iov, unsigned count)
+{
+#ifdef USE_URING
+	if (base->ops == &uring_ops)
+		return uring_register_buffers(base, iov, count);
+#endif
+	return 0;
+}
+
+int event_base_register_fd(struct event_base *base, int fd)
+{
+#ifdef USE_URING
+	if (base->ops == &uring_ops)
+		return uring_register_fd(base, fd);
+#endif
+	return 0;
+}
+
+void event_base_unregister_fd(struct event_base *base, int fd)
+{
+#ifdef USE_URING
+	if (base->ops == &uring_ops)
+		uring_unregister_fd(base, fd);
+#endif
+}
+
 /*
  * Is activated.
  */
@@ -762,3 +2769,162 @@ int is_event_initialized(struct event *ev)
 	return (ev->flags & EV_ACTIVE) ? 1 : 0;
 }
 
+
+/*
+ * Cross-thread mailbox.
+ *
+ * Messages are queued under lock and wakeup is sent only
+ * when queue goes from idle to pending, so burst of posts
+ * costs single write() and single loop wakeup.
+ */
+
+/* max messages delivered per lock round-trip */
+#define MAILBOX_BATCH 64
+
+struct EventMailbox {
+	struct event ev;
+	int rfd, wfd;
+
+	pthread_mutex_t lock;
+	void **queue;
+	unsigned qhead, qcount, qsize;
+	bool wakeup_sent;
+
+	uevent_mailbox_f cb_func;
+	void *cb_arg;
+};
+
+static void mailbox_wakeup(struct EventMailbox *mbox)
+{
+#ifdef USE_EVENTFD
+	uint64_t val = 1;
+#else
+	uint8_t val = 1;
+#endif
+	int res;
+loop:
+	res = write(mbox->wfd, &val, sizeof(val));
+	if (res < 0 && errno == EINTR)
+		goto loop;
+}
+
+static void mailbox_reader(int fd, short flags, void *arg)
+{
+	struct EventMailbox *mbox = arg;
+	void *batch[MAILBOX_BATCH];
+	uint8_t buf[64];
+	unsigned i, n;
+	int res;
+
+	/* drain wakeups */
+	do {
+		res = read(fd, buf, sizeof(buf));
+	} while (res > 0 || (res < 0 && errno == EINTR));
+
+	pthread_mutex_lock(&mbox->lock);
+	mbox->wakeup_sent = false;
+	while (mbox->qcount > 0) {
+		for (n = 0; n < MAILBOX_BATCH && mbox->qcount > 0; n++) {
+			batch[n] = mbox->queue[mbox->qhead];
+			mbox->qhead = (mbox->qhead + 1) % mbox->qsize;
+			mbox->qcount--;
+		}
+		pthread_mutex_unlock(&mbox->lock);
+
+		for (i = 0; i < n; i++)
+			mbox->cb_func(batch[i], mbox->cb_arg);
+
+		pthread_mutex_lock(&mbox->lock);
+	}
+	pthread_mutex_unlock(&mbox->lock);
+}
+
+struct EventMailbox *event_mailbox_create(struct event_base *base, uevent_mailbox_f cb_func, void *cb_arg)
+{
+	struct EventMailbox *mbox;
+#ifndef USE_EVENTFD
+	int spair[2];
+#endif
+
+	mbox = zmalloc(sizeof(*mbox));
+	if (!mbox)
+		return NULL;
+	mbox->cb_func = cb_func;
+	mbox->cb_arg = cb_arg;
+
+#ifdef USE_EVENTFD
+	mbox->rfd = mbox->wfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (mbox->rfd < 0)
+		goto failed;
+#else
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, spair) != 0)
+		goto failed;
+	mbox->wfd = spair[0];
+	mbox->rfd = spair[1];
+	if (!socket_setup(spair[0], true) || !socket_setup(spair[1], true))
+		goto failed_fds;
+#endif
+
+	if (pthread_mutex_init(&mbox->lock, NULL) != 0)
+		goto failed_fds;
+
+	event_assign(&mbox->ev, base, mbox->rfd, EV_READ | EV_PERSIST, mailbox_reader, mbox);
+	if (event_add(&mbox->ev, NULL) != 0) {
+		pthread_mutex_destroy(&mbox->lock);
+		goto failed_fds;
+	}
+	return mbox;
+
+failed_fds:
+	close(mbox->rfd);
+	if (mbox->wfd != mbox->rfd)
+		close(mbox->wfd);
+failed:
+	free(mbox);
+	return NULL;
+}
+
+/* can be called from any thread */
+int event_mailbox_post(struct EventMailbox *mbox, void *msg)
+{
+	bool need_wakeup;
+
+	pthread_mutex_lock(&mbox->lock);
+	if (mbox->qcount == mbox->qsize) {
+		unsigned i, newsize = mbox->qsize ? mbox->qsize * 2 : 64;
+		void **tmp = malloc(newsize * sizeof(void *));
+		if (!tmp) {
+			pthread_mutex_unlock(&mbox->lock);
+			return -1;
+		}
+		for (i = 0; i < mbox->qcount; i++)
+			tmp[i] = mbox->queue[(mbox->qhead + i) % mbox->qsize];
+		free(mbox->queue);
+		mbox->queue = tmp;
+		mbox->qhead = 0;
+		mbox->qsize = newsize;
+	}
+	mbox->queue[(mbox->qhead + mbox->qcount) % mbox->qsize] = msg;
+	mbox->qcount++;
+	need_wakeup = !mbox->wakeup_sent;
+	mbox->wakeup_sent = true;
+	pthread_mutex_unlock(&mbox->lock);
+
+	if (need_wakeup)
+		mailbox_wakeup(mbox);
+	return 0;
+}
+
+/* must be called from owner thread, pending messages are dropped */
+void event_mailbox_free(struct EventMailbox *mbox)
+{
+	if (!mbox)
+		return;
+	event_del(&mbox->ev);
+	close(mbox->rfd);
+	if (mbox->wfd != mbox->rfd)
+		close(mbox->wfd);
+	pthread_mutex_destroy(&mbox->lock);
+	free(mbox->queue);
+	free(mbox);
+}
@@ -39,6 +39,9 @@ enum EventLoopType {
 
 struct event_base;
 
+/* 0 is most urgent */
+#define EVENT_MAX_PRIORITIES 8
+
 typedef void (*uevent_cb_f)(int fd, short flags, void *arg);
 
 struct event {
@@ -46,6 +49,7 @@ struct event {
 
 	struct timeval timeout;
 	struct AANode timeout_node;
+	struct List wheel_node;
 
 	int ev_idx;
 	struct event_base *base;
@@ -55,11 +59,75 @@ struct event {
 
 	int fd;
 	short flags;
+
+	/* other events on same fd, for epoll/kqueue/io_uring */
+	struct event *rd_next;
+	struct event *wr_next;
+
+	/* pending delivery */
+	struct List active_node;
+	short res_flags;
+	short priority;
 };
 
 struct event_base *event_init(void) _MUSTCHECK;
 void event_base_free(struct event_base *base);
 
+/* backend: "epoll", "kqueue", "poll", "io_uring" or NULL for best available */
+struct event_base *event_init_backend(const char *backend) _MUSTCHECK;
+const char *event_base_get_method(const struct event_base *base);
+
+/* use hashed timer wheel instead of tree for timeouts */
+int event_base_set_timer_wheel(struct event_base *base, bool enable);
+
+/*
+ * Ready events are run in priority order.  Priority is set
+ * between event_assign() and event_add(), default is
+ * npriorities / 2.  Signals always run at priority 0.
+ */
+int event_base_priority_init(struct event_base *base, int npriorities);
+int event_priority_set(struct event *ev, int priority);
+
+/*
+ * Per-base loop statistics, off by default.  Times are in usec,
+ * callbacks are identified by cb_func.  Counters are cumulative
+ * until reset, pending/fd/active counts are current values.
+ */
+#define EVENT_STATS_HIST_BUCKETS 20
+#define EVENT_STATS_SLOWEST 8
+
+struct EventCallbackStat {
+	uevent_cb_f cb_func;
+	uint64_t max_usec;
+};
+
+struct EventBaseStats {
+	uint64_t iterations;
+	uint64_t poll_usec;		/* blocked in backend */
+	uint64_t callback_usec;		/* running callbacks */
+	uint64_t callbacks;
+	/* bucket 0 is < 1us, bucket n is [2^(n-1), 2^n) usec */
+	uint64_t cb_hist[EVENT_STATS_HIST_BUCKETS];
+	/* unsorted, by max duration */
+	struct EventCallbackStat slowest[EVENT_STATS_SLOWEST];
+	uint64_t slowest_min;
+	uint64_t timeouts_fired;
+	uint64_t signal_wakeups;
+	unsigned timeouts_pending;
+	unsigned fd_count;
+	unsigned active_count;
+};
+
+int event_base_enable_stats(struct event_base *base, bool enable);
+void event_base_reset_stats(struct event_base *base);
+int event_base_get_stats(struct event_base *base, struct EventBaseStats *dst) _MUSTCHECK;
+
+/*
+ * Max callbacks and expired timers per loop iteration,
+ * 0 means no limit.  Rest is carried to next iteration.
+ */
+void event_base_set_budget(struct event_base *base, int max_callbacks, int max_timeouts);
+
 void event_set(struct event *ev, int fd, short flags, uevent_cb_f cb, void *arg);
 int event_loop(int loop_flags) _MUSTCHECK;
 int event_loopbreak(void);
@@ -83,9 +151,105 @@ int event_base_loopbreak(struct event_base *base);
 int event_once(int fd, short flags, uevent_cb_f cb_func, void *cb_arg, struct timeval *timeout);
 int event_base_once(struct event_base *base, int fd, short flags, uevent_cb_f cb_func, void *cb_arg, struct timeval *timeout);
 int event_loopexit(struct timeval *timeout);
+
+/*
+ * Cancellable one-time event.  *handle_p is set on success and
+ * cleared when event fires or is cancelled.  Handle must stay
+ * valid until then, and pending ones are lost with base.
+ */
+struct EventOnce;
+int event_base_once_handle(struct event_base *base, int fd, short flags,
+			   uevent_cb_f cb_func, void *cb_arg,
+			   struct timeval *timeout, struct EventOnce **handle_p) _MUSTCHECK;
+/* no-op if *handle_p is NULL */
+void event_once_cancel(struct EventOnce **handle_p);
+
 int event_base_loopexit(struct event_base *base, struct timeval *timeout);
 int event_base_set(struct event_base *base, struct event *ev);
 
+/*
+ * Threads.
+ *
+ * Each thread can run its own event_base.  The default base used
+ * by event_set()/event_loop() is per-thread: the first base created
+ * in a thread.  Events of one base must be used only from the thread
+ * that runs it, except for event_mailbox_post().
+ *
+ * Signal events can be added only to one base in process, the first
+ * one that adds them.  Other bases get EBUSY.
+ *
+ * On Linux the thread that adds signal events keeps them blocked
+ * and reads them via signalfd.  Children forked from it inherit
+ * the mask, so call event_reset_sigmask() in child before exec().
+ * After it the child's copy of base gets no signals.
+ */
+void event_reset_sigmask(void);
+
+/* cross-thread message delivery, eg. for passing accepted fds */
+struct EventMailbox;
+typedef void (*uevent_mailbox_f)(void *msg, void *arg);
+
+struct EventMailbox *event_mailbox_create(struct event_base *base, uevent_mailbox_f cb_func, void *cb_arg) _MUSTCHECK;
+int event_mailbox_post(struct EventMailbox *mbox, void *msg) _MUSTCHECK;
+void event_mailbox_free(struct EventMailbox *mbox);
+
+/*
+ * Completion-style operations.
+ *
+ * Callback gets result of read()/write()/accept() or -errno.
+ * It is called exactly once per started op, also after
+ * event_op_cancel(), which can call it immediately.  Op and
+ * buffer must stay valid until then.  Accepted fds are
+ * non-blocking and close-on-exec.
+ *
+ * With "io_uring" backend these are queued to kernel and
+ * submitted in batch on next loop iteration, buffers inside
+ * registered areas and registered fds are used as fixed.
+ * Other backends wait for readiness and do the syscall.
+ * Op struct must be zeroed before first use.
+ */
+
+struct EventOp;
+typedef void (*uevent_op_f)(struct EventOp *op, int res, void *arg);
+
+enum EventOpType {
+	EV_OP_READ = 1,
+	EV_OP_WRITE,
+	EV_OP_ACCEPT,
+};
+
+struct EventOp {
+	struct event ev;
+	struct event_base *base;
+
+	uevent_op_f cb_func;
+	void *cb_arg;
+
+	void *buf;
+	size_t len;
+	int fd;
+	short op_type;
+	bool pending;
+};
+
+int event_op_read(struct event_base *base, struct EventOp *op, int fd, void *buf, size_t len,
+		  uevent_op_f cb_func, void *cb_arg) _MUSTCHECK;
+int event_op_write(struct event_base *base, struct EventOp *op, int fd, const void *buf, size_t len,
+		   uevent_op_f cb_func, void *cb_arg) _MUSTCHECK;
+int event_op_accept(struct event_base *base, struct EventOp *op, int fd,
+		    uevent_op_f cb_func, void *cb_arg) _MUSTCHECK;
+int event_op_cancel(struct EventOp *op);
+
+/*
+ * Fixed resources for io_uring, no-op on other backends.
+ * Buffers should be registered before ops use them, fd must
+ * be unregistered before close().
+ */
+struct iovec;
+int event_base_register_buffers(struct event_base *base, const struct iovec *iov, unsigned count);
+int event_base_register_fd(struct event_base *base, int fd);
+void event_base_unregister_fd(struct event_base *base, int fd);
+
 /* pointless compat */
 #define event_initialized(ev) is_event_initialized(ev)
 #define signal_initialized(ev) is_event_initialized(ev)
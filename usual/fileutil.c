@@ -24,8 +24,12 @@
 
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 
@@ -37,55 +41,271 @@ char *load_file(const char *fn)
 {
 	struct stat st;
 	char *buf = NULL;
-	int res;
-	FILE *f;
+	size_t done = 0;
+	ssize_t res;
+	int fd, err;
 
-	res = stat(fn, &st);
-	if (res < 0)
+	fd = open(fn, O_RDONLY);
+	if (fd < 0)
 		return NULL;
+	if (fstat(fd, &st) < 0)
+		goto failed;
 
 	buf = malloc(st.st_size + 1);
 	if (!buf)
-		return NULL;
+		goto failed;
 
-	f = fopen(fn, "r");
-	if (!f)
-		return NULL;
-
-	if ((res = fread(buf, 1, st.st_size, f)) < 0) {
-		fclose(f);
-		return NULL;
+	/* straight into buffer, no stdio copy */
+	while (done < (size_t)st.st_size) {
+		res = read(fd, buf + done, st.st_size - done);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res < 0)
+			goto failed;
+		if (res == 0)
+			break;
+		done += res;
 	}
-
-	fclose(f);
-	buf[st.st_size] = 0;
-
+	close(fd);
+	buf[done] = 0;
 	return buf;
+
+failed:
+	err = errno;
+	free(buf);
+	close(fd);
+	errno = err;
+	return NULL;
 }
 
 /*
  * Read file line-by-line, call user func on each.
+ *
+ * File is read in big chunks and newlines are found with memchr(),
+ * which libc vectorizes.  Lines are given in place, NUL is placed
+ * after line only for the duration of callback.
  */
 
+#define LINE_CHUNK (256 * 1024)
+
+static bool scan_lines(char *buf, size_t *have_p, procline_cb proc_line, void *arg)
+{
+	char *p = buf, *end = buf + *have_p, *nl;
+	size_t len;
+	char save;
+
+	while ((nl = memchr(p, '\n', end - p)) != NULL) {
+		len = nl + 1 - p;
+		save = p[len];
+		p[len] = 0;
+		proc_line(arg, p, len);
+		p[len] = save;
+		p += len;
+	}
+
+	/* move partial line to start */
+	*have_p = end - p;
+	if (p != buf && *have_p > 0)
+		memmove(buf, p, *have_p);
+	return p != buf;
+}
+
 bool foreach_line(const char *fn, procline_cb proc_line, void *arg)
 {
-	char *ln = NULL;
-	size_t len = 0;
+	size_t size = LINE_CHUNK, have = 0;
+	char *buf, *tmp;
 	ssize_t res;
-	FILE *f = fopen(fn, "rb");
-	if (!f)
+	bool ok = false;
+	int fd;
+
+	fd = open(fn, O_RDONLY);
+	if (fd < 0)
 		return false;
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	/* +1 for NUL after last byte */
+	buf = malloc(size + 1);
+	if (!buf)
+		goto out;
+
 	while (1) {
-		res = getline(&ln, &len, f);
+		res = read(fd, buf + have, size - have);
+		if (res < 0 && errno == EINTR)
+			continue;
 		if (res < 0)
+			goto out;
+		if (res == 0)
 			break;
-		proc_line(arg, ln, res);
+		have += res;
+
+		/* no newline in full buffer, line is longer than chunk */
+		if (!scan_lines(buf, &have, proc_line, arg) && have == size) {
+			tmp = realloc(buf, size * 2 + 1);
+			if (!tmp)
+				goto out;
+			buf = tmp;
+			size *= 2;
+		}
+	}
+
+	/* last line without newline */
+	if (have > 0) {
+		buf[have] = 0;
+		proc_line(arg, buf, have);
+	}
+	ok = true;
+out:
+	free(buf);
+	close(fd);
+	return ok;
+}
+
+/* lines without copying, last one may lack newline */
+static void walk_lines(const char *p, const char *end, procline_cb proc_line, void *arg)
+{
+	const char *nl;
+
+	while (p < end) {
+		nl = memchr(p, '\n', end - p);
+		nl = nl ? nl + 1 : end;
+		proc_line(arg, p, nl - p);
+		p = nl;
+	}
+}
+
+/*
+ * Zero-copy version over mmap().  Lines are not NUL-terminated.
+ * Non-regular files go through foreach_line().
+ */
+
+bool foreach_line_mapped(const char *fn, procline_cb proc_line, void *arg)
+{
+	struct stat st;
+	void *ptr;
+	size_t size;
+	int fd;
+
+	fd = open(fn, O_RDONLY);
+	if (fd < 0)
+		return false;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return false;
 	}
-	fclose(f);
-	free(ln);
+	if (!S_ISREG(st.st_mode)) {
+		close(fd);
+		return foreach_line(fn, proc_line, arg);
+	}
+
+	/* mmap() does not like empty files */
+	size = st.st_size;
+	if (size == 0) {
+		close(fd);
+		return true;
+	}
+	ptr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED)
+		return false;
+#ifdef MADV_SEQUENTIAL
+	madvise(ptr, size, MADV_SEQUENTIAL);
+#endif
+
+	walk_lines(ptr, (const char *)ptr + size, proc_line, arg);
+	munmap(ptr, size);
 	return true;
 }
 
+/*
+ * Parallel processing of mapped file.  File is split into
+ * contiguous ranges on line boundaries, one per thread, so
+ * thread order is file order.
+ */
+
+/* ranges smaller than that are not worth a thread */
+#define MIN_RANGE (64 * 1024)
+
+struct LineWorker {
+	const char *start;
+	const char *end;
+	procline_cb proc_line;
+	void *arg;
+	pthread_t tid;
+	bool started;
+};
+
+static void *line_worker(void *p)
+{
+	struct LineWorker *w = p;
+#ifdef MADV_SEQUENTIAL
+	char *astart;
+	uintptr_t pg = sysconf(_SC_PAGESIZE);
+
+	/* madvise() wants page-aligned start */
+	astart = (char *)((uintptr_t)w->start & ~(pg - 1));
+	madvise(astart, w->end - astart, MADV_SEQUENTIAL);
+#endif
+	walk_lines(w->start, w->end, w->proc_line, w->arg);
+	return NULL;
+}
+
+bool foreach_line_parallel(const struct MappedFile *m, unsigned nthreads,
+			   procline_cb proc_line, void **thread_args,
+			   procline_merge_cb merge_cb, void *merge_arg)
+{
+	const char *data = m->ptr, *end = data + m->len, *pos, *nl;
+	struct LineWorker *wlist;
+	unsigned i, nused;
+	bool ok = true;
+
+	if (nthreads == 0) {
+		errno = EINVAL;
+		return false;
+	}
+	wlist = calloc(nthreads, sizeof(*wlist));
+	if (!wlist)
+		return false;
+
+	nused = nthreads;
+	if (m->len / MIN_RANGE < nused)
+		nused = m->len / MIN_RANGE + 1;
+
+	/* split at first newline after even offset */
+	pos = data;
+	for (i = 0; i < nused; i++) {
+		wlist[i].start = pos;
+		if (i == nused - 1) {
+			pos = end;
+		} else if (pos < data + m->len / nused * (i + 1)) {
+			pos = data + m->len / nused * (i + 1);
+			nl = memchr(pos, '\n', end - pos);
+			pos = nl ? nl + 1 : end;
+		}
+		wlist[i].end = pos;
+		wlist[i].proc_line = proc_line;
+		wlist[i].arg = thread_args[i];
+	}
+
+	/* first range runs in caller, like others if thread cannot be created */
+	for (i = 1; i < nused; i++)
+		wlist[i].started = pthread_create(&wlist[i].tid, NULL, line_worker, &wlist[i]) == 0;
+	line_worker(&wlist[0]);
+	for (i = 1; i < nused; i++) {
+		if (wlist[i].started)
+			pthread_join(wlist[i].tid, NULL);
+		else
+			line_worker(&wlist[i]);
+	}
+	free(wlist);
+
+	/* all thread args, in file order */
+	for (i = 0; i < nthreads && merge_cb && ok; i++)
+		ok = merge_cb(merge_arg, thread_args[i]);
+	return ok;
+}
+
 /*
  * Find file size.
  */
@@ -112,6 +332,12 @@ int map_file(struct MappedFile *m, const char *fname, int rw)
 		close(m->fd);
 		return -1;
 	}
+	/* 32-bit address space */
+	if ((uint64_t)st.st_size > SIZE_MAX) {
+		close(m->fd);
+		errno = EFBIG;
+		return -1;
+	}
 	m->len = st.st_size;
 	m->ptr = mmap(NULL, m->len, PROT_READ | (rw ? PROT_WRITE : 0),
 		      MAP_SHARED, m->fd, 0);
@@ -23,7 +23,7 @@
 
 struct MappedFile {
 	int fd;
-	unsigned len;
+	size_t len;
 	void *ptr;
 };
 
@@ -31,10 +31,31 @@ typedef void (*procline_cb)(void *arg, const char *line, ssize_t len);
 
 char *load_file(const char *fn);
 
+/* line includes newline and is NUL-terminated */
 bool foreach_line(const char *fn, procline_cb proc_line, void *arg);
 
+/*
+ * Lines are slices of read-only mapping, not NUL-terminated,
+ * valid only during callback.
+ */
+bool foreach_line_mapped(const char *fn, procline_cb proc_line, void *arg);
+
+/*
+ * Run proc_line on nthreads threads over mapped file.  Thread i gets
+ * thread_args[i] and i-th newline-aligned range of file.  Lines are
+ * not NUL-terminated.  Small files use fewer threads.  Afterwards
+ * merge_cb, if given, gets each of thread_args in order from caller
+ * thread, returning false stops merge and is returned.
+ */
+typedef bool (*procline_merge_cb)(void *merge_arg, void *thread_arg);
+
+bool foreach_line_parallel(const struct MappedFile *m, unsigned nthreads,
+			   procline_cb proc_line, void **thread_args,
+			   procline_merge_cb merge_cb, void *merge_arg);
+
 ssize_t file_size(const char *fn);
 
+/* EFBIG if file does not fit into len */
 int map_file(struct MappedFile *m, const char *fname, int rw) _MUSTCHECK;
 void unmap_file(struct MappedFile *m);
 
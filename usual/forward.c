@@ -0,0 +1,215 @@
+/*
+ * Zero-copy data forwarding between fds.
+ *
+ * Copyright (c) 2009 Marko Kreen
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <usual/forward.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <usual/alloc.h>
+#include <usual/logging.h>
+#include <usual/safeio.h>
+#include <usual/socket.h>
+
+#ifdef __linux__
+#define USE_SPLICE
+#include <sys/sendfile.h>
+#endif
+
+/* userspace buffer size for fallback */
+#define FWD_BUF_SIZE (16 * 1024)
+
+#ifdef USE_SPLICE
+
+#define SPLICE_FLAGS (SPLICE_F_MOVE | SPLICE_F_NONBLOCK)
+
+bool fwd_buf_init(struct FwdBuf *fb)
+{
+	memset(fb, 0, sizeof(*fb));
+	fb->pipe_fds[0] = fb->pipe_fds[1] = -1;
+	if (pipe(fb->pipe_fds) < 0)
+		return false;
+	if (!socket_set_nonblocking(fb->pipe_fds[0], true)
+	    || !socket_set_nonblocking(fb->pipe_fds[1], true)) {
+		fwd_buf_close(fb);
+		return false;
+	}
+	return true;
+}
+
+void fwd_buf_close(struct FwdBuf *fb)
+{
+	if (fb->pipe_fds[0] >= 0)
+		safe_close(fb->pipe_fds[0]);
+	if (fb->pipe_fds[1] >= 0)
+		safe_close(fb->pipe_fds[1]);
+	fb->pipe_fds[0] = fb->pipe_fds[1] = -1;
+	fb->pending = 0;
+}
+
+/* src -> pipe */
+static ssize_t fwd_fill(int src, struct FwdBuf *fb, size_t len)
+{
+	ssize_t res;
+loop:
+	res = splice(src, NULL, fb->pipe_fds[1], NULL, len, SPLICE_FLAGS);
+	if (res < 0 && errno == EINTR)
+		goto loop;
+	if (res > 0)
+		fb->pending += res;
+	return res;
+}
+
+/* pipe -> dst */
+static ssize_t fwd_flush(int dst, struct FwdBuf *fb)
+{
+	ssize_t res;
+loop:
+	res = splice(fb->pipe_fds[0], NULL, dst, NULL, fb->pending, SPLICE_FLAGS);
+	if (res < 0 && errno == EINTR)
+		goto loop;
+	if (res > 0)
+		fb->pending -= res;
+	return res;
+}
+
+#else /* !USE_SPLICE */
+
+bool fwd_buf_init(struct FwdBuf *fb)
+{
+	memset(fb, 0, sizeof(*fb));
+	fb->pipe_fds[0] = fb->pipe_fds[1] = -1;
+	fb->buf = malloc(FWD_BUF_SIZE);
+	return fb->buf != NULL;
+}
+
+void fwd_buf_close(struct FwdBuf *fb)
+{
+	free(fb->buf);
+	fb->buf = NULL;
+	fb->pending = 0;
+}
+
+static ssize_t fwd_fill(int src, struct FwdBuf *fb, size_t len)
+{
+	ssize_t res;
+
+	if (len > FWD_BUF_SIZE)
+		len = FWD_BUF_SIZE;
+	res = safe_read(src, fb->buf, len);
+	if (res > 0) {
+		fb->buf_pos = 0;
+		fb->pending = res;
+	}
+	return res;
+}
+
+static ssize_t fwd_flush(int dst, struct FwdBuf *fb)
+{
+	ssize_t res;
+
+	res = safe_write(dst, fb->buf + fb->buf_pos, fb->pending);
+	if (res > 0) {
+		fb->buf_pos += res;
+		fb->pending -= res;
+	}
+	return res;
+}
+
+#endif /* !USE_SPLICE */
+
+ssize_t safe_forward(int src, int dst, struct FwdBuf *fb, size_t maxlen)
+{
+	size_t total = 0;
+	ssize_t res;
+
+	/* leftovers from last time */
+	if (fb->pending > 0) {
+		res = fwd_flush(dst, fb);
+		if (res < 0)
+			goto failed;
+		total += res;
+		if (fb->pending > 0)
+			return total;
+	}
+
+	while (total < maxlen) {
+		res = fwd_fill(src, fb, maxlen - total);
+		if (res == 0)
+			break;
+		if (res < 0)
+			goto failed;
+
+		res = fwd_flush(dst, fb);
+		if (res < 0)
+			goto failed;
+		total += res;
+		if (fb->pending > 0)
+			break;
+	}
+	if (cf_verbose > 2)
+		log_noise("safe_forward(%d, %d) = %d", src, dst, (int)total);
+	return total;
+
+failed:
+	if (total > 0)
+		return total;
+	if (errno != EAGAIN)
+		log_noise("safe_forward(%d, %d) = %s", src, dst, strerror(errno));
+	return -1;
+}
+
+ssize_t safe_sendfile(int dst_sock, int src_fd, off_t *offset, size_t count)
+{
+	ssize_t res;
+#ifdef USE_SPLICE
+loop:
+	res = sendfile(dst_sock, src_fd, offset, count);
+	if (res < 0 && errno == EINTR)
+		goto loop;
+#else
+	char buf[FWD_BUF_SIZE];
+	ssize_t got;
+
+	if (count > sizeof(buf))
+		count = sizeof(buf);
+	if (offset)
+		got = pread(src_fd, buf, count, *offset);
+	else
+		got = safe_read(src_fd, buf, count);
+	if (got <= 0)
+		return got;
+	res = safe_write(dst_sock, buf, got);
+	if (res > 0 && offset)
+		*offset += res;
+	else if (res > 0 && res < got)
+		lseek(src_fd, res - got, SEEK_CUR);
+#endif
+	if (res < 0 && errno != EAGAIN)
+		log_noise("safe_sendfile(%d, %d) = %s", dst_sock, src_fd, strerror(errno));
+	else if (cf_verbose > 2)
+		log_noise("safe_sendfile(%d, %d) = %d", dst_sock, src_fd, (int)res);
+	return res;
+}
+
@@ -0,0 +1,67 @@
+/*
+ * Zero-copy data forwarding between fds.
+ *
+ * Copyright (c) 2009 Marko Kreen
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _USUAL_FORWARD_H_
+#define _USUAL_FORWARD_H_
+
+#include <usual/base.h>
+
+#include <sys/types.h>
+
+/*
+ * On Linux data moves src -> pipe -> dst with splice(),
+ * elsewhere through userspace buffer.  Data that dst did not
+ * accept stays pending in FwdBuf, so one FwdBuf per direction.
+ *
+ * Forwarding does not block on the pipe or the buffer; whether
+ * src and dst block depends on their O_NONBLOCK flag, as set
+ * by socket_set_nonblocking().
+ */
+struct FwdBuf {
+	int pipe_fds[2];
+	char *buf;
+	size_t buf_pos;
+	size_t pending;
+};
+
+bool fwd_buf_init(struct FwdBuf *fb) _MUSTCHECK;
+void fwd_buf_close(struct FwdBuf *fb);
+
+/* bytes read from src but not yet written to dst */
+static inline size_t fwd_buf_pending(const struct FwdBuf *fb)
+{
+	return fb->pending;
+}
+
+/*
+ * Move up to maxlen bytes from src to dst.
+ *
+ * Returns bytes written to dst, 0 on src EOF with nothing pending,
+ * -1 on error.  With EAGAIN, non-empty fwd_buf_pending() means
+ * wait for dst writability, empty means wait for src.
+ */
+ssize_t safe_forward(int src, int dst, struct FwdBuf *fb, size_t maxlen) _MUSTCHECK;
+
+/*
+ * Send file contents to socket, sendfile() if available.
+ * Offset is updated.  Returns bytes sent or -1.
+ */
+ssize_t safe_sendfile(int dst_sock, int src_fd, off_t *offset, size_t count) _MUSTCHECK;
+
+#endif
+
@@ -0,0 +1,319 @@
+/*
+ * Open-addressing hash map.
+ *
+ * Copyright (c) 2009 Marko Kreen
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Robin Hood hashing on hash_lookup3().  Slots keep hash value
+ * and probe distance, so key callback is called only on real
+ * candidates.
+ *
+ * Resize is incremental: bigger table is allocated and each
+ * insert/delete moves few slots from old table.  Meanwhile
+ * lookups check both tables.  Old table is not reorganized,
+ * moved and deleted entries leave tombstones (obj == NULL)
+ * that keep probe chains intact.
+ */
+
+#include <usual/hashmap.h>
+
+#include <errno.h>
+#include <string.h>
+
+#include <usual/alloc.h>
+#include <usual/lookup3.h>
+
+#define MIN_SIZE 16
+
+/* old slots moved per modification */
+#define MIGRATE_STEP 32
+
+struct HashSlot {
+	void *obj;
+	uint32_t hash;
+	uint32_t dist;		/* probe distance + 1, 0 means empty */
+};
+
+struct HashTab {
+	struct HashSlot *slots;
+	unsigned mask;
+};
+
+struct HashMap {
+	struct HashTab cur;
+	struct HashTab old;
+	unsigned migrate_pos;
+	unsigned old_count;
+	unsigned count;
+	hashmap_getkey_func get_key;
+};
+
+static inline uint32_t calc_hash(const void *key, size_t klen)
+{
+	return hash_lookup3(key, klen);
+}
+
+static bool tab_alloc(struct HashTab *tab, unsigned size)
+{
+	tab->slots = zmalloc(size * sizeof(struct HashSlot));
+	if (!tab->slots)
+		return false;
+	tab->mask = size - 1;
+	return true;
+}
+
+static void tab_free(struct HashTab *tab)
+{
+	free(tab->slots);
+	tab->slots = NULL;
+	tab->mask = 0;
+}
+
+/* resize when over 3/4 full */
+static inline bool tab_overfull(const struct HashTab *tab, unsigned count)
+{
+	unsigned size = tab->mask + 1;
+	return count > size - size / 4;
+}
+
+/*
+ * Low-level table operations.
+ */
+
+static bool slot_match(struct HashMap *map, const struct HashSlot *s,
+		       uint32_t hash, const void *key, size_t klen)
+{
+	const void *skey;
+	size_t slen;
+
+	if (!s->obj || s->hash != hash)
+		return false;
+	skey = map->get_key(s->obj, &slen);
+	return slen == klen && memcmp(skey, key, klen) == 0;
+}
+
+static struct HashSlot *tab_find(struct HashMap *map, struct HashTab *tab,
+				 uint32_t hash, const void *key, size_t klen)
+{
+	unsigned idx = hash & tab->mask;
+	uint32_t dist = 1;
+	struct HashSlot *s;
+
+	while (1) {
+		s = &tab->slots[idx];
+		if (s->dist < dist)
+			return NULL;
+		if (slot_match(map, s, hash, key, klen))
+			return s;
+		idx = (idx + 1) & tab->mask;
+		dist++;
+	}
+}
+
+/* new table has no tombstones, no need to check for them */
+static void tab_insert(struct HashTab *tab, void *obj, uint32_t hash)
+{
+	struct HashSlot ins, tmp, *s;
+	unsigned idx = hash & tab->mask;
+
+	ins.obj = obj;
+	ins.hash = hash;
+	ins.dist = 1;
+	while (1) {
+		s = &tab->slots[idx];
+		if (s->dist == 0) {
+			*s = ins;
+			return;
+		}
+		/* take from rich */
+		if (s->dist < ins.dist) {
+			tmp = *s;
+			*s = ins;
+			ins = tmp;
+		}
+		idx = (idx + 1) & tab->mask;
+		ins.dist++;
+	}
+}
+
+/* backward-shift deletion */
+static void tab_remove(struct HashTab *tab, struct HashSlot *s)
+{
+	unsigned idx = s - tab->slots;
+	unsigned next = (idx + 1) & tab->mask;
+
+	while (tab->slots[next].dist > 1) {
+		tab->slots[idx] = tab->slots[next];
+		tab->slots[idx].dist--;
+		idx = next;
+		next = (next + 1) & tab->mask;
+	}
+	memset(&tab->slots[idx], 0, sizeof(struct HashSlot));
+}
+
+/*
+ * Incremental resize.
+ */
+
+static void migrate(struct HashMap *map, unsigned nslots)
+{
+	struct HashSlot *s;
+
+	while (map->old.slots && nslots-- > 0) {
+		if (map->old_count == 0 || map->migrate_pos > map->old.mask) {
+			tab_free(&map->old);
+			return;
+		}
+		s = &map->old.slots[map->migrate_pos++];
+		if (s->obj) {
+			tab_insert(&map->cur, s->obj, s->hash);
+			s->obj = NULL;
+			map->old_count--;
+		}
+	}
+}
+
+static bool start_resize(struct HashMap *map)
+{
+	struct HashTab tab;
+
+	/* previous resize must be finished */
+	if (map->old.slots)
+		migrate(map, map->old.mask + 2);
+
+	if (!tab_alloc(&tab, (map->cur.mask + 1) * 2))
+		return false;
+	map->old = map->cur;
+	map->old_count = map->count;
+	map->migrate_pos = 0;
+	map->cur = tab;
+	return true;
+}
+
+/*
+ * Public API.
+ */
+
+struct HashMap *hashmap_create(hashmap_getkey_func get_key_fn, unsigned size_hint)
+{
+	struct HashMap *map;
+	unsigned size = MIN_SIZE;
+
+	while (size - size / 4 < size_hint)
+		size *= 2;
+
+	map = zmalloc(sizeof(*map));
+	if (!map)
+		return NULL;
+	map->get_key = get_key_fn;
+	if (!tab_alloc(&map->cur, size)) {
+		free(map);
+		return NULL;
+	}
+	return map;
+}
+
+void hashmap_destroy(struct HashMap *map)
+{
+	if (!map)
+		return;
+	tab_free(&map->cur);
+	tab_free(&map->old);
+	free(map);
+}
+
+void *hashmap_lookup(struct HashMap *map, const void *key, size_t klen)
+{
+	uint32_t hash = calc_hash(key, klen);
+	struct HashSlot *s;
+
+	s = tab_find(map, &map->cur, hash, key, klen);
+	if (!s && map->old.slots)
+		s = tab_find(map, &map->old, hash, key, klen);
+	return s ? s->obj : NULL;
+}
+
+bool hashmap_insert(struct HashMap *map, void *obj)
+{
+	const void *key;
+	size_t klen;
+
+	key = map->get_key(obj, &klen);
+	if (hashmap_lookup(map, key, klen)) {
+		errno = EEXIST;
+		return false;
+	}
+
+	if (tab_overfull(&map->cur, map->count + 1)) {
+		if (!start_resize(map)) {
+			errno = ENOMEM;
+			return false;
+		}
+	}
+	tab_insert(&map->cur, obj, calc_hash(key, klen));
+	map->count++;
+	migrate(map, MIGRATE_STEP);
+	return true;
+}
+
+bool hashmap_delete(struct HashMap *map, const void *key, size_t klen)
+{
+	uint32_t hash = calc_hash(key, klen);
+	struct HashSlot *s;
+
+	s = tab_find(map, &map->cur, hash, key, klen);
+	if (s) {
+		tab_remove(&map->cur, s);
+	} else if (map->old.slots) {
+		s = tab_find(map, &map->old, hash, key, klen);
+		if (!s)
+			return false;
+		/* tombstone */
+		s->obj = NULL;
+		map->old_count--;
+	} else {
+		return false;
+	}
+	map->count--;
+	migrate(map, MIGRATE_STEP);
+	return true;
+}
+
+unsigned hashmap_count(const struct HashMap *map)
+{
+	return map->count;
+}
+
+static bool tab_walk(struct HashTab *tab, hashmap_walker_f cb_func, void *cb_arg)
+{
+	unsigned i;
+
+	if (!tab->slots)
+		return true;
+	for (i = 0; i <= tab->mask; i++) {
+		if (tab->slots[i].obj && !cb_func(cb_arg, tab->slots[i].obj))
+			return false;
+	}
+	return true;
+}
+
+bool hashmap_walk(struct HashMap *map, hashmap_walker_f cb_func, void *cb_arg)
+{
+	if (!tab_walk(&map->cur, cb_func, cb_arg))
+		return false;
+	return tab_walk(&map->old, cb_func, cb_arg);
+}
+
@@ -0,0 +1,47 @@
+/*
+ * Open-addressing hash map.
+ *
+ * Copyright (c) 2009 Marko Kreen
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _USUAL_HASHMAP_H_
+#define _USUAL_HASHMAP_H_
+
+#include <usual/base.h>
+
+/* return key for object, and its length */
+typedef const void *(*hashmap_getkey_func)(void *obj, size_t *len_p);
+
+/* return false to stop walk */
+typedef bool (*hashmap_walker_f)(void *arg, void *obj);
+
+struct HashMap;
+
+struct HashMap *hashmap_create(hashmap_getkey_func get_key_fn, unsigned size_hint) _MUSTCHECK;
+void hashmap_destroy(struct HashMap *map);
+
+/* false with errno EEXIST if key exists, ENOMEM on alloc failure */
+bool hashmap_insert(struct HashMap *map, void *obj) _MUSTCHECK;
+bool hashmap_delete(struct HashMap *map, const void *key, size_t klen);
+
+void *hashmap_lookup(struct HashMap *map, const void *key, size_t klen);
+
+unsigned hashmap_count(const struct HashMap *map);
+
+/* map must not be modified during walk */
+bool hashmap_walk(struct HashMap *map, hashmap_walker_f cb_func, void *cb_arg);
+
+#endif
+
@@ -26,6 +26,9 @@
 #include <string.h>
 #include <syslog.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
 
 #include <usual/time.h>
 
@@ -37,6 +40,9 @@ const char *cf_syslog_ident = NULL;
 static FILE *log_file = NULL;
 static bool syslog_started = false;
 
+/* getpid() result, reset after fork */
+static unsigned log_pid;
+
 struct LevelInfo {
 	const char *tag;
 	int syslog_prio;
@@ -51,7 +57,10 @@ static const struct LevelInfo log_level_list[] = {
 	{ "NOISE", LOG_DEBUG },
 };
 
-void reset_logging(void)
+static void async_request_reopen(void);
+static bool async_active;
+
+static void close_outputs(void)
 {
 	if (log_file) {
 		fclose(log_file);
@@ -63,6 +72,33 @@ void reset_logging(void)
 	}
 }
 
+/* with async mode, writer thread owns log outputs */
+void reset_logging(void)
+{
+	if (async_active)
+		async_request_reopen();
+	else
+		close_outputs();
+}
+
+
+/* forget cached pid, must be called in child after fork() */
+void log_reset_pid(void)
+{
+	__atomic_store_n(&log_pid, 0, __ATOMIC_RELAXED);
+}
+
+/* async writer reads it too, all threads store same value */
+static inline unsigned get_log_pid(void)
+{
+	unsigned pid = __atomic_load_n(&log_pid, __ATOMIC_RELAXED);
+
+	if (!pid) {
+		pid = getpid();
+		__atomic_store_n(&log_pid, pid, __ATOMIC_RELAXED);
+	}
+	return pid;
+}
 
 static void start_syslog(void)
 {
@@ -71,34 +107,60 @@ static void start_syslog(void)
 }
 
 
+static void open_logfile(const char *timebuf, unsigned pid)
+{
+	static int error_reported = 0;
+
+	if ((log_file = fopen(cf_logfile, "a")) != NULL) {
+		/* Got the file, disable buffering */
+		setvbuf(log_file, NULL, _IONBF, 0);
+	} else if (!cf_quiet && !error_reported) {
+		/* Unable to open, complain once */
+		fprintf(stderr, "%s %u %s %s: %s\n", timebuf, pid,
+			log_level_list[2].tag, cf_logfile, strerror(errno));
+		error_reported = 1;
+	}
+}
+
+static bool async_enqueue(enum LogLevel level, const char *line, unsigned len, unsigned msg_ofs);
+static void log_async_flush(unsigned long target);
+static unsigned long async_enq_pos;
+
 void log_generic(enum LogLevel level, const char *fmt, ...)
 {
 	char buf[2048];
 	char timebuf[64];
+	char line[2048 + 128];
 	const struct LevelInfo *lev = &log_level_list[level];
-	unsigned pid = getpid();
+	unsigned pid = get_log_pid();
+	int ofs, len;
 
 	va_list ap;
+
+	/* pending suppression reports go before new line */
+	log_ratelimit_flush();
+
 	va_start(ap, fmt);
 	vsnprintf(buf, sizeof(buf), fmt, ap);
 	va_end(ap);
 
 	format_time_ms(NULL, timebuf, sizeof(timebuf));
 
-	if (!log_file && cf_logfile) {
-		static int error_reported = 0;
-
-		if ((log_file = fopen(cf_logfile, "a")) != NULL) {
-			/* Got the file, disable buffering */
-			setvbuf(log_file, NULL, _IONBF, 0);
-		} else if (!cf_quiet && !error_reported) {
-			/* Unable to open, complain once */
-			fprintf(stderr, "%s %u %s %s: %s\n", timebuf, pid,
-				log_level_list[2].tag, cf_logfile, strerror(errno));
-			error_reported = 1;
+	if (async_active) {
+		ofs = snprintf(line, sizeof(line), "%s %u %s ", timebuf, pid, lev->tag);
+		len = snprintf(line + ofs, sizeof(line) - ofs, "%s\n", buf);
+		len = (ofs + len < (int)sizeof(line)) ? ofs + len : (int)sizeof(line) - 1;
+		if (async_enqueue(level, line, len, ofs)) {
+			/* fatal is followed by exit(), wait until writer has it out */
+			if (level == LG_FATAL)
+				log_async_flush(__atomic_load_n(&async_enq_pos, __ATOMIC_RELAXED));
+			return;
 		}
 	}
 
+	if (!log_file && cf_logfile)
+		open_logfile(timebuf, pid);
+
 	if (!cf_quiet)
 		fprintf(stderr, "%s %u %s %s\n", timebuf, pid, lev->tag, buf);
 
@@ -113,6 +175,105 @@ void log_generic(enum LogLevel level, const char *fmt, ...)
 }
 
 
+/*
+ * Token bucket, time from cached clock.  Real clock is read
+ * only when bucket is empty, in case cache is not reset
+ * by event loop.
+ */
+
+int cf_log_ratelimit = 10;
+
+/* only called with cf_log_ratelimit > 0 */
+static void refill_bucket(struct LogRateLimit *rl, usec_t now)
+{
+	usec_t step = USEC / cf_log_ratelimit;
+	uint64_t add;
+
+	if (!rl->stamp) {
+		rl->stamp = now;
+		rl->tokens = cf_log_ratelimit;
+		return;
+	}
+	if (now < rl->stamp + step)
+		return;
+	add = (now - rl->stamp) / step;
+	if (add >= (uint64_t)cf_log_ratelimit - rl->tokens) {
+		rl->tokens = cf_log_ratelimit;
+		rl->stamp = now;
+	} else {
+		rl->tokens += add;
+		rl->stamp += add * step;
+	}
+}
+
+static _TLS struct LogRateLimit *rl_pending;
+static _TLS bool rl_flushing;
+
+static void report_suppressed(struct LogRateLimit *rl)
+{
+	struct LogRateLimit **pp;
+	unsigned n = rl->suppressed;
+
+	for (pp = &rl_pending; *pp; pp = &(*pp)->pending_next) {
+		if (*pp == rl) {
+			*pp = rl->pending_next;
+			break;
+		}
+	}
+	rl->pending = false;
+	rl->suppressed = 0;
+	if (n > 0)
+		log_generic(rl->level, "suppressed %u similar messages", n);
+}
+
+/* report sites that have been quiet long enough to get a token back */
+void log_ratelimit_flush(void)
+{
+	struct LogRateLimit *rl, *next;
+	usec_t now;
+
+	/* reports are logged via log_generic(), which calls here */
+	if (!rl_pending || rl_flushing)
+		return;
+	rl_flushing = true;
+	now = get_monotonic_usec();
+	for (rl = rl_pending; rl; rl = next) {
+		next = rl->pending_next;
+		if (cf_log_ratelimit > 0)
+			refill_bucket(rl, now);
+		if (cf_log_ratelimit <= 0 || rl->tokens > 0)
+			report_suppressed(rl);
+	}
+	rl_flushing = false;
+}
+
+bool log_ratelimit_check(struct LogRateLimit *rl, enum LogLevel level)
+{
+	if (cf_log_ratelimit <= 0) {
+		if (rl->pending)
+			report_suppressed(rl);
+		return true;
+	}
+
+	refill_bucket(rl, get_cached_monotonic());
+	if (rl->tokens == 0)
+		refill_bucket(rl, get_monotonic_usec());
+	if (rl->tokens == 0) {
+		rl->suppressed++;
+		if (!rl->pending) {
+			rl->level = level;
+			rl->pending = true;
+			rl->pending_next = rl_pending;
+			rl_pending = rl;
+		}
+		return false;
+	}
+	rl->tokens--;
+	if (rl->pending)
+		report_suppressed(rl);
+	return true;
+}
+
 void log_fatal(const char *file, int line, const char *func, bool show_perror, const char *fmt, ...)
 {
 	char buf[2048];
@@ -138,3 +299,269 @@ void log_fatal(const char *file, int line, const char *func, bool show_perror, c
 	}
 }
 
+/*
+ * Async mode.
+ *
+ * Producers put formatted lines into bounded MPSC ring (Vyukov),
+ * with CAS on enqueue position only.  Writer thread collects lines
+ * into big buffer and writes them with one call per target.
+ */
+
+/* space for line in ring slot */
+#define ASYNC_LINE_SIZE (2048 + 128)
+
+/* writer batch buffer */
+#define ASYNC_BATCH_SIZE (64 * 1024)
+
+/* writer wakes up at least this often, in ms */
+#define ASYNC_IDLE_MS 100
+
+struct AsyncSlot {
+	unsigned long seq;
+	unsigned short len;
+	unsigned short msg_ofs;
+	unsigned char level;
+	char line[ASYNC_LINE_SIZE];
+};
+
+static struct AsyncSlot *async_ring;
+static unsigned long async_mask;
+static unsigned long async_deq_pos;
+/* lines up to that position are written out */
+static unsigned long async_done_pos;
+static enum LogAsyncPolicy async_policy;
+static uint64_t async_dropped;
+static uint64_t async_written;
+
+static pthread_t async_thread;
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_cond = PTHREAD_COND_INITIALIZER;
+static int async_sleeping;
+static bool async_stopping;
+static int async_reopen;
+
+static void async_wakeup(void)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&async_sleeping, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&async_lock);
+		pthread_cond_signal(&async_cond);
+		pthread_mutex_unlock(&async_lock);
+	}
+}
+
+/* false if ring is not running */
+static bool async_enqueue(enum LogLevel level, const char *line, unsigned len, unsigned msg_ofs)
+{
+	struct AsyncSlot *slot;
+	unsigned long pos, seq;
+	long diff;
+
+	pos = __atomic_load_n(&async_enq_pos, __ATOMIC_RELAXED);
+	while (1) {
+		slot = &async_ring[pos & async_mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		diff = (long)(seq - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&async_enq_pos, &pos, pos + 1, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* full, fatal line waits anyway */
+			if (async_policy == LOG_ASYNC_DROP && level != LG_FATAL) {
+				__atomic_add_fetch(&async_dropped, 1, __ATOMIC_RELAXED);
+				return true;
+			}
+			async_wakeup();
+			sched_yield();
+			pos = __atomic_load_n(&async_enq_pos, __ATOMIC_RELAXED);
+		} else {
+			pos = __atomic_load_n(&async_enq_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	memcpy(slot->line, line, len);
+	slot->len = len;
+	slot->msg_ofs = msg_ofs;
+	slot->level = level;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	async_wakeup();
+	return true;
+}
+
+static bool async_pending(void)
+{
+	struct AsyncSlot *slot = &async_ring[async_deq_pos & async_mask];
+	return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == async_deq_pos + 1;
+}
+
+/* write out lines before deq position 'upto' */
+static void async_write_batch(const char *batch, unsigned len, unsigned long upto)
+{
+	if (len > 0) {
+		if (!cf_quiet)
+			fwrite(batch, 1, len, stderr);
+		if (log_file)
+			fwrite(batch, 1, len, log_file);
+	}
+	__atomic_store_n(&async_done_pos, upto, __ATOMIC_RELEASE);
+}
+
+/* move all queued lines out, returns number of lines */
+static unsigned async_drain(char *batch)
+{
+	struct AsyncSlot *slot;
+	unsigned blen = 0, count = 0;
+	char timebuf[64];
+
+	if (__atomic_exchange_n(&async_reopen, 0, __ATOMIC_ACQUIRE))
+		close_outputs();
+	if (!log_file && cf_logfile) {
+		format_time_ms(NULL, timebuf, sizeof(timebuf));
+		open_logfile(timebuf, get_log_pid());
+	}
+
+	while (async_pending()) {
+		slot = &async_ring[async_deq_pos & async_mask];
+		if (blen + slot->len > ASYNC_BATCH_SIZE) {
+			async_write_batch(batch, blen, async_deq_pos);
+			blen = 0;
+		}
+		memcpy(batch + blen, slot->line, slot->len);
+		blen += slot->len;
+
+		if (cf_syslog_ident) {
+			if (!syslog_started)
+				start_syslog();
+			syslog(log_level_list[slot->level].syslog_prio, "%.*s",
+			       slot->len - slot->msg_ofs - 1, slot->line + slot->msg_ofs);
+		}
+
+		/* free slot for producers */
+		__atomic_store_n(&slot->seq, async_deq_pos + async_mask + 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&async_deq_pos, async_deq_pos + 1, __ATOMIC_RELAXED);
+		count++;
+	}
+	async_write_batch(batch, blen, async_deq_pos);
+	__atomic_add_fetch(&async_written, count, __ATOMIC_RELAXED);
+	return count;
+}
+
+static void *async_writer(void *arg)
+{
+	char *batch = arg;
+	struct timespec ts;
+	struct timeval tv;
+
+	while (1) {
+		async_drain(batch);
+
+		pthread_mutex_lock(&async_lock);
+		if (async_stopping) {
+			pthread_mutex_unlock(&async_lock);
+			break;
+		}
+		__atomic_store_n(&async_sleeping, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (!async_pending()) {
+			gettimeofday(&tv, NULL);
+			ts.tv_sec = tv.tv_sec;
+			ts.tv_nsec = tv.tv_usec * 1000 + ASYNC_IDLE_MS * 1000000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&async_cond, &async_lock, &ts);
+		}
+		__atomic_store_n(&async_sleeping, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&async_lock);
+	}
+
+	/* last lines */
+	async_drain(batch);
+	free(batch);
+	return NULL;
+}
+
+/* writer closes outputs before next batch, they are opened again on demand */
+static void async_request_reopen(void)
+{
+	__atomic_store_n(&async_reopen, 1, __ATOMIC_RELEASE);
+	async_wakeup();
+}
+
+/* wait until writer has written lines before 'target', max 1 sec */
+static void log_async_flush(unsigned long target)
+{
+	int i;
+
+	for (i = 0; i < 1000; i++) {
+		if ((long)(__atomic_load_n(&async_done_pos, __ATOMIC_ACQUIRE) - target) >= 0)
+			return;
+		async_wakeup();
+		usleep(1000);
+	}
+}
+
+bool log_async_start(unsigned ring_size, enum LogAsyncPolicy policy)
+{
+	unsigned long i, size = 16;
+	char *batch;
+
+	if (async_active)
+		return true;
+	while (size < ring_size)
+		size *= 2;
+
+	async_ring = malloc(size * sizeof(struct AsyncSlot));
+	batch = malloc(ASYNC_BATCH_SIZE);
+	if (!async_ring || !batch)
+		goto failed;
+	for (i = 0; i < size; i++)
+		async_ring[i].seq = i;
+	async_mask = size - 1;
+	async_enq_pos = async_deq_pos = async_done_pos = 0;
+	async_policy = policy;
+	async_stopping = false;
+
+	if (pthread_create(&async_thread, NULL, async_writer, batch) != 0)
+		goto failed;
+	async_active = true;
+	return true;
+
+failed:
+	free(async_ring);
+	free(batch);
+	async_ring = NULL;
+	return false;
+}
+
+void log_async_stop(void)
+{
+	if (!async_active)
+		return;
+
+	pthread_mutex_lock(&async_lock);
+	async_stopping = true;
+	pthread_cond_signal(&async_cond);
+	pthread_mutex_unlock(&async_lock);
+	pthread_join(async_thread, NULL);
+
+	async_active = false;
+	free(async_ring);
+	async_ring = NULL;
+}
+
+bool log_async_running(void)
+{
+	return async_active;
+}
+
+void log_async_stats(struct LogAsyncStats *st)
+{
+	st->written = __atomic_load_n(&async_written, __ATOMIC_RELAXED);
+	st->dropped = __atomic_load_n(&async_dropped, __ATOMIC_RELAXED);
+	st->queued = async_active ? __atomic_load_n(&async_enq_pos, __ATOMIC_RELAXED)
+		- __atomic_load_n(&async_deq_pos, __ATOMIC_RELAXED) : 0;
+}
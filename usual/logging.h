@@ -83,6 +83,60 @@ void log_generic(enum LogLevel level, const char *s, ...) _PRINTF(2, 3);
 			log_generic(LG_NOISE, ## args); \
 	} while (0)
 
+/*
+ * Rate-limited logging.  Each call site has own token bucket
+ * (per thread), allowing cf_log_ratelimit lines per second with
+ * same burst.  Zero or negative rate turns limiting off.
+ *
+ * Suppressed count is reported as "suppressed N similar messages"
+ * before next line that goes through, or once bucket has refilled
+ * by log_ratelimit_flush(), which runs on each event loop iteration
+ * and before each log line of the thread.
+ */
+extern int cf_log_ratelimit;
+
+struct LogRateLimit {
+	uint64_t stamp;
+	unsigned tokens;
+	unsigned suppressed;
+	/* per-thread list of sites with unreported count */
+	struct LogRateLimit *pending_next;
+	enum LogLevel level;
+	bool pending;
+};
+
+bool log_ratelimit_check(struct LogRateLimit *rl, enum LogLevel level);
+void log_ratelimit_flush(void);
+
+#define log_ratelimited(level, args...) do { \
+		static _TLS struct LogRateLimit _log_rl; \
+		if (log_ratelimit_check(&_log_rl, level)) \
+			log_generic(level, ## args); \
+	} while (0)
+#define log_error_ratelimited(args...) log_ratelimited(LG_ERROR, ## args)
+#define log_warning_ratelimited(args...) log_ratelimited(LG_WARNING, ## args)
+#define log_info_ratelimited(args...) log_ratelimited(LG_INFO, ## args)
+#define log_debug_ratelimited(args...) do { \
+		if (unlikely(cf_verbose > 0)) \
+			log_ratelimited(LG_DEBUG, ## args); \
+	} while (0)
+
+/*
+ * Sampled logging: first and then every n-th line from call site.
+ */
+#define log_sampled(level, n, args...) do { \
+		static _TLS unsigned _log_cnt; \
+		if (_log_cnt++ % (n) == 0) \
+			log_generic(level, ## args); \
+	} while (0)
+#define log_error_sampled(n, args...) log_sampled(LG_ERROR, n, ## args)
+#define log_warning_sampled(n, args...) log_sampled(LG_WARNING, n, ## args)
+#define log_info_sampled(n, args...) log_sampled(LG_INFO, n, ## args)
+#define log_debug_sampled(n, args...) do { \
+		if (unlikely(cf_verbose > 0)) \
+			log_sampled(LG_DEBUG, n, ## args); \
+	} while (0)
+
 /* this is also defined in base.h for Assert() */
 void log_fatal(const char *file, int line, const char *func, bool show_perror, const char *s, ...) _PRINTF(5, 6);
 
@@ -101,5 +155,36 @@ void log_fatal(const char *file, int line, const char *func, bool show_perror, c
 
 void reset_logging(void);
 
+/* pid in log lines is cached, call in child after fork() */
+void log_reset_pid(void);
+
+/*
+ * Async mode: log_generic() only formats the line and puts it
+ * into ring buffer, background thread writes lines out in batches.
+ * LG_FATAL lines go through queue too, log_generic() waits
+ * until writer has written them, at most 1 sec.
+ *
+ * Threads do not survive fork(), so start it after daemonize(),
+ * and in prefork workers, not in supervisor.  reset_logging()
+ * is passed to writer thread, it reopens outputs before next batch.
+ * Stop it, and change other logging setup, only when no other
+ * threads are logging.
+ */
+enum LogAsyncPolicy {
+	LOG_ASYNC_DROP,		/* drop and count lines when ring is full */
+	LOG_ASYNC_BLOCK,	/* wait for writer */
+};
+
+struct LogAsyncStats {
+	uint64_t written;
+	uint64_t dropped;
+	uint64_t queued;
+};
+
+bool log_async_start(unsigned ring_size, enum LogAsyncPolicy policy) _MUSTCHECK;
+void log_async_stop(void);
+bool log_async_running(void);
+void log_async_stats(struct LogAsyncStats *st);
+
 #endif
 
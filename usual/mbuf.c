@@ -0,0 +1,423 @@
+/*
+ * Buffered socket stream.
+ *
+ * Copyright (c) 2009 Marko Kreen
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <usual/mbuf.h>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include <usual/alloc.h>
+#include <usual/logging.h>
+#include <usual/safeio.h>
+#include <usual/slab.h>
+#include <usual/socket.h>
+
+/* chunks per writev() */
+#define MAX_IOV 32
+
+/* compact input when less than 1/4 of chunk is free at the end */
+#define COMPACT_FRAC 4
+
+struct MBufChunk {
+	struct List node;
+	unsigned pos;
+	unsigned end;
+	char data[];
+};
+
+struct MBufPool {
+	struct Slab *slab;
+	unsigned size;
+};
+
+/*
+ * Chunk pool.
+ */
+
+/* only header needs init, data is never read before written */
+static void chunk_init(void *obj)
+{
+	struct MBufChunk *c = obj;
+	list_init(&c->node);
+	c->pos = c->end = 0;
+}
+
+struct MBufPool *mbuf_pool_create(const char *name, unsigned chunk_size, bool thread_safe)
+{
+	struct MBufPool *pool;
+	unsigned flags = 0;
+
+	if (chunk_size < 64) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (thread_safe)
+		flags |= SLAB_THREAD_SAFE;
+
+	pool = zmalloc(sizeof(*pool));
+	if (!pool)
+		return NULL;
+	pool->size = chunk_size;
+	pool->slab = slab_create_flags(name, sizeof(struct MBufChunk) + chunk_size, 0, chunk_init, flags);
+	if (!pool->slab) {
+		free(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+void mbuf_pool_destroy(struct MBufPool *pool)
+{
+	if (!pool)
+		return;
+	slab_destroy(pool->slab);
+	free(pool);
+}
+
+unsigned mbuf_pool_chunk_size(const struct MBufPool *pool)
+{
+	return pool->size;
+}
+
+static inline struct MBufChunk *chunk_get(struct MBufPool *pool)
+{
+	return slab_alloc(pool->slab);
+}
+
+static inline void chunk_put(struct MBufPool *pool, struct MBufChunk *c)
+{
+	slab_free(pool->slab, c);
+}
+
+/*
+ * Event registration.
+ */
+
+static void stream_cb(int fd, short flags, void *arg);
+
+/* register for events current state needs */
+static bool update_events(struct MBufStream *s)
+{
+	short want = 0;
+
+	if (s->fd < 0 || s->error)
+		return true;
+
+	/* backpressure with hysteresis */
+	if (s->wqueue_len > s->wmax)
+		s->wblocked = true;
+	else if (s->wqueue_len <= s->wmax / 2)
+		s->wblocked = false;
+
+	if (!s->paused && !s->eof && !s->wblocked)
+		want |= EV_READ;
+	if (s->wqueue_len > 0)
+		want |= EV_WRITE;
+	if (want == s->ev_flags)
+		return true;
+
+	if (s->ev_flags)
+		event_del(&s->ev);
+	s->ev_flags = 0;
+	if (!want)
+		return true;
+	event_assign(&s->ev, s->base, s->fd, want | EV_PERSIST, stream_cb, s);
+	if (event_add(&s->ev, NULL) < 0)
+		return false;
+	s->ev_flags = want;
+	return true;
+}
+
+/* drop events and let user know, returns callback result */
+static bool report_error(struct MBufStream *s, int err)
+{
+	s->error = err;
+	if (s->ev_flags)
+		event_del(&s->ev);
+	s->ev_flags = 0;
+	log_noise("mbuf_stream(%d): %s", s->fd, strerror(err));
+	return s->cb_func(s, MBUF_EV_ERROR, s->cb_arg);
+}
+
+/*
+ * Output.
+ */
+
+static void release_wqueue(struct MBufStream *s)
+{
+	struct MBufChunk *c;
+
+	while ((c = list_pop_type(&s->wqueue, struct MBufChunk, node)) != NULL)
+		chunk_put(s->pool, c);
+	s->wqueue_len = 0;
+}
+
+/* one writev() per MAX_IOV chunks, until socket is full */
+static bool flush_queue(struct MBufStream *s)
+{
+	struct iovec iov[MAX_IOV];
+	struct MBufChunk *c;
+	struct List *item;
+	int cnt, res, sent;
+	size_t want;
+
+	while (s->wqueue_len > 0) {
+		cnt = 0;
+		want = 0;
+		list_for_each(item, &s->wqueue) {
+			c = container_of(item, struct MBufChunk, node);
+			iov[cnt].iov_base = c->data + c->pos;
+			iov[cnt].iov_len = c->end - c->pos;
+			want += iov[cnt].iov_len;
+			if (++cnt >= MAX_IOV)
+				break;
+		}
+		res = safe_writev(s->fd, iov, cnt);
+		if (res < 0)
+			return errno == EAGAIN;
+
+		sent = res;
+		s->wqueue_len -= res;
+		while (res > 0) {
+			c = container_of(list_first(&s->wqueue), struct MBufChunk, node);
+			if ((unsigned)res < c->end - c->pos) {
+				c->pos += res;
+				break;
+			}
+			res -= c->end - c->pos;
+			list_del(&c->node);
+			chunk_put(s->pool, c);
+		}
+		/* short write means socket is full */
+		if ((size_t)sent < want)
+			break;
+	}
+	return true;
+}
+
+bool mbuf_stream_write(struct MBufStream *s, const void *data, unsigned len)
+{
+	const char *src = data;
+	struct MBufChunk *c = NULL;
+	struct List *last;
+	unsigned n;
+
+	if (!list_empty(&s->wqueue)) {
+		last = s->wqueue.prev;
+		c = container_of(last, struct MBufChunk, node);
+	}
+
+	/* small writes are appended to last chunk */
+	while (len > 0) {
+		if (!c || c->end == s->pool->size) {
+			c = chunk_get(s->pool);
+			if (!c) {
+				errno = ENOMEM;
+				return false;
+			}
+			list_append(&s->wqueue, &c->node);
+		}
+		n = s->pool->size - c->end;
+		if (n > len)
+			n = len;
+		memcpy(c->data + c->end, src, n);
+		c->end += n;
+		s->wqueue_len += n;
+		src += n;
+		len -= n;
+	}
+
+	/* callback end flushes anyway */
+	return s->in_cb || update_events(s);
+}
+
+bool mbuf_stream_flush(struct MBufStream *s)
+{
+	if (s->fd < 0 || s->error) {
+		errno = s->error ? s->error : EBADF;
+		return false;
+	}
+	if (!flush_queue(s))
+		return false;
+	return s->in_cb || update_events(s);
+}
+
+/*
+ * Input.
+ */
+
+const void *mbuf_stream_data(const struct MBufStream *s, unsigned *len_p)
+{
+	struct MBufChunk *c = s->rchunk;
+
+	if (!c) {
+		*len_p = 0;
+		return NULL;
+	}
+	*len_p = c->end - c->pos;
+	return c->data + c->pos;
+}
+
+void mbuf_stream_consume(struct MBufStream *s, unsigned len)
+{
+	struct MBufChunk *c = s->rchunk;
+
+	if (!c)
+		return;
+	if (len > c->end - c->pos)
+		len = c->end - c->pos;
+	c->pos += len;
+}
+
+/* give back empty input chunk, so idle stream holds no memory */
+static void release_rchunk(struct MBufStream *s, bool force)
+{
+	struct MBufChunk *c = s->rchunk;
+
+	if (c && (force || c->pos == c->end)) {
+		chunk_put(s->pool, c);
+		s->rchunk = NULL;
+	}
+}
+
+/* returns false if stream is gone */
+static bool handle_read(struct MBufStream *s)
+{
+	struct MBufChunk *c = s->rchunk;
+	unsigned avail;
+	bool ok;
+	int res;
+
+	if (!c) {
+		c = s->rchunk = chunk_get(s->pool);
+		if (!c)
+			return report_error(s, ENOMEM);
+	}
+
+	/* move partial message to start */
+	if (c->pos > 0 && s->pool->size - c->end < s->pool->size / COMPACT_FRAC) {
+		memmove(c->data, c->data + c->pos, c->end - c->pos);
+		c->end -= c->pos;
+		c->pos = 0;
+	}
+	avail = s->pool->size - c->end;
+	if (avail == 0)
+		return report_error(s, EMSGSIZE);
+
+	res = safe_recv(s->fd, c->data + c->end, avail, 0);
+	if (res < 0) {
+		if (errno == EAGAIN)
+			return true;
+		return report_error(s, errno);
+	}
+	if (res == 0) {
+		s->eof = true;
+		return s->cb_func(s, MBUF_EV_EOF, s->cb_arg);
+	}
+	c->end += res;
+
+	s->in_cb = true;
+	ok = s->cb_func(s, MBUF_EV_DATA, s->cb_arg);
+	if (!ok)
+		return false;
+	s->in_cb = false;
+
+	/* replies written in callback go out in one writev() */
+	if (s->wqueue_len > 0 && !flush_queue(s))
+		return report_error(s, errno);
+	release_rchunk(s, false);
+	return true;
+}
+
+static void stream_cb(int fd, short flags, void *arg)
+{
+	struct MBufStream *s = arg;
+
+	if (flags & EV_WRITE) {
+		if (!flush_queue(s)) {
+			report_error(s, errno);
+			return;
+		}
+		if (s->wqueue_len == 0 && !s->cb_func(s, MBUF_EV_DRAINED, s->cb_arg))
+			return;
+	}
+	if ((flags & EV_READ) && s->ev_flags & EV_READ) {
+		if (!handle_read(s))
+			return;
+	}
+	if (s->error)
+		return;
+	if (!update_events(s))
+		report_error(s, errno ? errno : ENOMEM);
+}
+
+/*
+ * Public API.
+ */
+
+void mbuf_stream_init(struct MBufStream *s, struct event_base *base, struct MBufPool *pool,
+		      mbuf_stream_cb_f cb_func, void *cb_arg)
+{
+	memset(s, 0, sizeof(*s));
+	s->base = base;
+	s->pool = pool;
+	s->cb_func = cb_func;
+	s->cb_arg = cb_arg;
+	s->fd = -1;
+	s->wmax = 4 * (size_t)pool->size;
+	list_init(&s->wqueue);
+}
+
+bool mbuf_stream_attach(struct MBufStream *s, int fd)
+{
+	if (!socket_set_nonblocking(fd, true))
+		return false;
+	s->fd = fd;
+	s->error = 0;
+	s->eof = false;
+	return update_events(s);
+}
+
+void mbuf_stream_close(struct MBufStream *s)
+{
+	if (s->ev_flags)
+		event_del(&s->ev);
+	s->ev_flags = 0;
+	release_rchunk(s, true);
+	release_wqueue(s);
+	if (s->fd >= 0)
+		safe_close(s->fd);
+	s->fd = -1;
+	s->in_cb = false;
+}
+
+void mbuf_stream_set_wmax(struct MBufStream *s, size_t wmax)
+{
+	s->wmax = wmax;
+	if (!s->in_cb)
+		update_events(s);
+}
+
+void mbuf_stream_pause(struct MBufStream *s, bool pause)
+{
+	s->paused = pause;
+	if (!s->in_cb)
+		update_events(s);
+}
+
@@ -0,0 +1,112 @@
+/*
+ * Buffered socket stream.
+ *
+ * Copyright (c) 2009 Marko Kreen
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _USUAL_MBUF_H_
+#define _USUAL_MBUF_H_
+
+#include <usual/event.h>
+#include <usual/list.h>
+
+/*
+ * Shared pool of fixed-size chunks.  Stream holds chunks only
+ * while it has unconsumed input or unsent output, so idle
+ * connection costs only its struct MBufStream.
+ */
+struct MBufPool;
+
+struct MBufPool *mbuf_pool_create(const char *name, unsigned chunk_size, bool thread_safe) _MUSTCHECK;
+void mbuf_pool_destroy(struct MBufPool *pool);
+
+/* usable bytes in chunk, also max size of unconsumed input */
+unsigned mbuf_pool_chunk_size(const struct MBufPool *pool);
+
+enum MBufEvent {
+	MBUF_EV_DATA,		/* new input available */
+	MBUF_EV_EOF,		/* peer closed, unconsumed input may remain */
+	MBUF_EV_ERROR,		/* errno is in stream->error */
+	MBUF_EV_DRAINED,	/* output queue that waited for socket is empty */
+};
+
+struct MBufStream;
+struct MBufChunk;
+
+/* return false if stream was closed, then it is not touched anymore */
+typedef bool (*mbuf_stream_cb_f)(struct MBufStream *s, enum MBufEvent ev, void *arg);
+
+/*
+ * Input is read ahead into one chunk and parsed in place,
+ * output is copied into queue of chunks and sent with writev().
+ * Writes done in DATA callback are flushed together after it returns.
+ *
+ * Read events are dropped while paused or while output
+ * queue is over high-water mark, until it drains to half of it.
+ */
+struct MBufStream {
+	struct event ev;
+	struct event_base *base;
+	struct MBufPool *pool;
+
+	mbuf_stream_cb_f cb_func;
+	void *cb_arg;
+
+	int fd;
+	int error;
+	short ev_flags;
+	bool paused;
+	bool eof;
+	bool wblocked;
+	bool in_cb;
+
+	struct MBufChunk *rchunk;
+	struct List wqueue;
+	size_t wqueue_len;
+	size_t wmax;
+};
+
+void mbuf_stream_init(struct MBufStream *s, struct event_base *base, struct MBufPool *pool,
+		      mbuf_stream_cb_f cb_func, void *cb_arg);
+
+/* makes fd non-blocking and starts reading */
+bool mbuf_stream_attach(struct MBufStream *s, int fd) _MUSTCHECK;
+
+/* releases buffers and closes fd, safe to call from callback */
+void mbuf_stream_close(struct MBufStream *s);
+
+/* unconsumed input */
+const void *mbuf_stream_data(const struct MBufStream *s, unsigned *len_p);
+void mbuf_stream_consume(struct MBufStream *s, unsigned len);
+
+/* queue output, false with errno set */
+bool mbuf_stream_write(struct MBufStream *s, const void *data, unsigned len) _MUSTCHECK;
+
+/* send what socket takes now, false on error */
+bool mbuf_stream_flush(struct MBufStream *s) _MUSTCHECK;
+
+static inline size_t mbuf_stream_pending(const struct MBufStream *s)
+{
+	return s->wqueue_len;
+}
+
+/* output queue high-water mark, default 4 chunks */
+void mbuf_stream_set_wmax(struct MBufStream *s, size_t wmax);
+
+/* stop or resume reading */
+void mbuf_stream_pause(struct MBufStream *s, bool pause);
+
+#endif
+
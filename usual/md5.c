@@ -78,6 +78,77 @@ static inline void put_word(uint8_t *dst, uint32_t val)
 #define OP(fn, a, b, c, d, k, s, T_i) \
 	a = b + rol(a + fn(b, c, d) + X[k] + T_i, s)
 
+/* all 64 steps, OP decides the operand types */
+#define MD5_STEPS(OP) \
+	/* Round 1. */ \
+	OP(F, a, b, c, d, 0, 7, 0xd76aa478); \
+	OP(F, d, a, b, c, 1, 12, 0xe8c7b756); \
+	OP(F, c, d, a, b, 2, 17, 0x242070db); \
+	OP(F, b, c, d, a, 3, 22, 0xc1bdceee); \
+	OP(F, a, b, c, d, 4, 7, 0xf57c0faf); \
+	OP(F, d, a, b, c, 5, 12, 0x4787c62a); \
+	OP(F, c, d, a, b, 6, 17, 0xa8304613); \
+	OP(F, b, c, d, a, 7, 22, 0xfd469501); \
+	OP(F, a, b, c, d, 8, 7, 0x698098d8); \
+	OP(F, d, a, b, c, 9, 12, 0x8b44f7af); \
+	OP(F, c, d, a, b, 10, 17, 0xffff5bb1); \
+	OP(F, b, c, d, a, 11, 22, 0x895cd7be); \
+	OP(F, a, b, c, d, 12, 7, 0x6b901122); \
+	OP(F, d, a, b, c, 13, 12, 0xfd987193); \
+	OP(F, c, d, a, b, 14, 17, 0xa679438e); \
+	OP(F, b, c, d, a, 15, 22, 0x49b40821); \
+	/* Round 2. */ \
+	OP(G, a, b, c, d, 1, 5, 0xf61e2562); \
+	OP(G, d, a, b, c, 6, 9, 0xc040b340); \
+	OP(G, c, d, a, b, 11, 14, 0x265e5a51); \
+	OP(G, b, c, d, a, 0, 20, 0xe9b6c7aa); \
+	OP(G, a, b, c, d, 5, 5, 0xd62f105d); \
+	OP(G, d, a, b, c, 10, 9, 0x02441453); \
+	OP(G, c, d, a, b, 15, 14, 0xd8a1e681); \
+	OP(G, b, c, d, a, 4, 20, 0xe7d3fbc8); \
+	OP(G, a, b, c, d, 9, 5, 0x21e1cde6); \
+	OP(G, d, a, b, c, 14, 9, 0xc33707d6); \
+	OP(G, c, d, a, b, 3, 14, 0xf4d50d87); \
+	OP(G, b, c, d, a, 8, 20, 0x455a14ed); \
+	OP(G, a, b, c, d, 13, 5, 0xa9e3e905); \
+	OP(G, d, a, b, c, 2, 9, 0xfcefa3f8); \
+	OP(G, c, d, a, b, 7, 14, 0x676f02d9); \
+	OP(G, b, c, d, a, 12, 20, 0x8d2a4c8a); \
+	/* Round 3. */ \
+	OP(H, a, b, c, d, 5, 4, 0xfffa3942); \
+	OP(H, d, a, b, c, 8, 11, 0x8771f681); \
+	OP(H, c, d, a, b, 11, 16, 0x6d9d6122); \
+	OP(H, b, c, d, a, 14, 23, 0xfde5380c); \
+	OP(H, a, b, c, d, 1, 4, 0xa4beea44); \
+	OP(H, d, a, b, c, 4, 11, 0x4bdecfa9); \
+	OP(H, c, d, a, b, 7, 16, 0xf6bb4b60); \
+	OP(H, b, c, d, a, 10, 23, 0xbebfbc70); \
+	OP(H, a, b, c, d, 13, 4, 0x289b7ec6); \
+	OP(H, d, a, b, c, 0, 11, 0xeaa127fa); \
+	OP(H, c, d, a, b, 3, 16, 0xd4ef3085); \
+	OP(H, b, c, d, a, 6, 23, 0x04881d05); \
+	OP(H, a, b, c, d, 9, 4, 0xd9d4d039); \
+	OP(H, d, a, b, c, 12, 11, 0xe6db99e5); \
+	OP(H, c, d, a, b, 15, 16, 0x1fa27cf8); \
+	OP(H, b, c, d, a, 2, 23, 0xc4ac5665); \
+	/* Round 4. */ \
+	OP(I, a, b, c, d, 0, 6, 0xf4292244); \
+	OP(I, d, a, b, c, 7, 10, 0x432aff97); \
+	OP(I, c, d, a, b, 14, 15, 0xab9423a7); \
+	OP(I, b, c, d, a, 5, 21, 0xfc93a039); \
+	OP(I, a, b, c, d, 12, 6, 0x655b59c3); \
+	OP(I, d, a, b, c, 3, 10, 0x8f0ccc92); \
+	OP(I, c, d, a, b, 10, 15, 0xffeff47d); \
+	OP(I, b, c, d, a, 1, 21, 0x85845dd1); \
+	OP(I, a, b, c, d, 8, 6, 0x6fa87e4f); \
+	OP(I, d, a, b, c, 15, 10, 0xfe2ce6e0); \
+	OP(I, c, d, a, b, 6, 15, 0xa3014314); \
+	OP(I, b, c, d, a, 13, 21, 0x4e0811a1); \
+	OP(I, a, b, c, d, 4, 6, 0xf7537e82); \
+	OP(I, d, a, b, c, 11, 10, 0xbd3af235); \
+	OP(I, c, d, a, b, 2, 15, 0x2ad7d2bb); \
+	OP(I, b, c, d, a, 9, 21, 0xeb86d391);
+
 static void md5_mix(struct md5_ctx *ctx, const uint32_t *X)
 {
 	uint32_t a, b, c, d;
@@ -87,77 +158,7 @@ static void md5_mix(struct md5_ctx *ctx, const uint32_t *X)
 	c = ctx->c;
 	d = ctx->d;
 
-	/* Round 1. */
-	OP(F, a, b, c, d, 0, 7, 0xd76aa478);
-	OP(F, d, a, b, c, 1, 12, 0xe8c7b756);
-	OP(F, c, d, a, b, 2, 17, 0x242070db);
-	OP(F, b, c, d, a, 3, 22, 0xc1bdceee);
-	OP(F, a, b, c, d, 4, 7, 0xf57c0faf);
-	OP(F, d, a, b, c, 5, 12, 0x4787c62a);
-	OP(F, c, d, a, b, 6, 17, 0xa8304613);
-	OP(F, b, c, d, a, 7, 22, 0xfd469501);
-	OP(F, a, b, c, d, 8, 7, 0x698098d8);
-	OP(F, d, a, b, c, 9, 12, 0x8b44f7af);
-	OP(F, c, d, a, b, 10, 17, 0xffff5bb1);
-	OP(F, b, c, d, a, 11, 22, 0x895cd7be);
-	OP(F, a, b, c, d, 12, 7, 0x6b901122);
-	OP(F, d, a, b, c, 13, 12, 0xfd987193);
-	OP(F, c, d, a, b, 14, 17, 0xa679438e);
-	OP(F, b, c, d, a, 15, 22, 0x49b40821);
-
-	/* Round 2. */
-	OP(G, a, b, c, d, 1, 5, 0xf61e2562);
-	OP(G, d, a, b, c, 6, 9, 0xc040b340);
-	OP(G, c, d, a, b, 11, 14, 0x265e5a51);
-	OP(G, b, c, d, a, 0, 20, 0xe9b6c7aa);
-	OP(G, a, b, c, d, 5, 5, 0xd62f105d);
-	OP(G, d, a, b, c, 10, 9, 0x02441453);
-	OP(G, c, d, a, b, 15, 14, 0xd8a1e681);
-	OP(G, b, c, d, a, 4, 20, 0xe7d3fbc8);
-	OP(G, a, b, c, d, 9, 5, 0x21e1cde6);
-	OP(G, d, a, b, c, 14, 9, 0xc33707d6);
-	OP(G, c, d, a, b, 3, 14, 0xf4d50d87);
-	OP(G, b, c, d, a, 8, 20, 0x455a14ed);
-	OP(G, a, b, c, d, 13, 5, 0xa9e3e905);
-	OP(G, d, a, b, c, 2, 9, 0xfcefa3f8);
-	OP(G, c, d, a, b, 7, 14, 0x676f02d9);
-	OP(G, b, c, d, a, 12, 20, 0x8d2a4c8a);
-
-	/* Round 3. */
-	OP(H, a, b, c, d, 5, 4, 0xfffa3942);
-	OP(H, d, a, b, c, 8, 11, 0x8771f681);
-	OP(H, c, d, a, b, 11, 16, 0x6d9d6122);
-	OP(H, b, c, d, a, 14, 23, 0xfde5380c);
-	OP(H, a, b, c, d, 1, 4, 0xa4beea44);
-	OP(H, d, a, b, c, 4, 11, 0x4bdecfa9);
-	OP(H, c, d, a, b, 7, 16, 0xf6bb4b60);
-	OP(H, b, c, d, a, 10, 23, 0xbebfbc70);
-	OP(H, a, b, c, d, 13, 4, 0x289b7ec6);
-	OP(H, d, a, b, c, 0, 11, 0xeaa127fa);
-	OP(H, c, d, a, b, 3, 16, 0xd4ef3085);
-	OP(H, b, c, d, a, 6, 23, 0x04881d05);
-	OP(H, a, b, c, d, 9, 4, 0xd9d4d039);
-	OP(H, d, a, b, c, 12, 11, 0xe6db99e5);
-	OP(H, c, d, a, b, 15, 16, 0x1fa27cf8);
-	OP(H, b, c, d, a, 2, 23, 0xc4ac5665);
-
-	/* Round 4. */
-	OP(I, a, b, c, d, 0, 6, 0xf4292244);
-	OP(I, d, a, b, c, 7, 10, 0x432aff97);
-	OP(I, c, d, a, b, 14, 15, 0xab9423a7);
-	OP(I, b, c, d, a, 5, 21, 0xfc93a039);
-	OP(I, a, b, c, d, 12, 6, 0x655b59c3);
-	OP(I, d, a, b, c, 3, 10, 0x8f0ccc92);
-	OP(I, c, d, a, b, 10, 15, 0xffeff47d);
-	OP(I, b, c, d, a, 1, 21, 0x85845dd1);
-	OP(I, a, b, c, d, 8, 6, 0x6fa87e4f);
-	OP(I, d, a, b, c, 15, 10, 0xfe2ce6e0);
-	OP(I, c, d, a, b, 6, 15, 0xa3014314);
-	OP(I, b, c, d, a, 13, 21, 0x4e0811a1);
-	OP(I, a, b, c, d, 4, 6, 0xf7537e82);
-	OP(I, d, a, b, c, 11, 10, 0xbd3af235);
-	OP(I, c, d, a, b, 2, 15, 0x2ad7d2bb);
-	OP(I, b, c, d, a, 9, 21, 0xeb86d391);
+	MD5_STEPS(OP);
 
 	ctx->a += a;
 	ctx->b += b;
@@ -224,3 +225,288 @@ void md5_final(uint8_t *dst, struct md5_ctx *ctx)
 	put_word(dst + 12, ctx->d);
 }
 
+/*
+ * Multi-buffer API.
+ *
+ * Independent messages are hashed in parallel lanes, one block
+ * per lane per step.  Lanes are kept full by taking next message
+ * with blocks left when one runs out.  Vector kernels use GCC
+ * vector extensions, so they become SSE2/AVX2/AVX-512 on x86
+ * (picked at runtime) and NEON on ARM.
+ */
+
+#define MD5_MAX_LANES 16
+
+#ifdef __GNUC__
+
+#define VROL(v, s) (((v) << (s)) | ((v) >> (32 - (s))))
+#define VOP(fn, a, b, c, d, k, s, T_i) \
+	a = b + VROL(a + fn(b, c, d) + X[k] + T_i, s)
+
+/* state[0..3][lane], words[k][lane] */
+#define MD5_KERNEL(name, vtype, nlanes, attr) \
+typedef uint32_t vtype __attribute__((vector_size(nlanes * 4))); \
+static attr void name(uint32_t state[4][MD5_MAX_LANES], \
+		      uint32_t words[16][MD5_MAX_LANES]) \
+{ \
+	vtype a, b, c, d, a0, b0, c0, d0, X[16]; \
+	int k; \
+	memcpy(&a, state[0], sizeof(a)); \
+	memcpy(&b, state[1], sizeof(b)); \
+	memcpy(&c, state[2], sizeof(c)); \
+	memcpy(&d, state[3], sizeof(d)); \
+	for (k = 0; k < 16; k++) \
+		memcpy(&X[k], words[k], sizeof(vtype)); \
+	a0 = a; b0 = b; c0 = c; d0 = d; \
+	MD5_STEPS(VOP); \
+	a += a0; b += b0; c += c0; d += d0; \
+	memcpy(state[0], &a, sizeof(a)); \
+	memcpy(state[1], &b, sizeof(b)); \
+	memcpy(state[2], &c, sizeof(c)); \
+	memcpy(state[3], &d, sizeof(d)); \
+}
+
+MD5_KERNEL(md5_mix_x4, md5_v4, 4, )
+
+#if defined(__x86_64__) || defined(__i386__)
+#define USE_WIDE_KERNELS
+MD5_KERNEL(md5_mix_x8, md5_v8, 8, __attribute__((target("avx2"))))
+MD5_KERNEL(md5_mix_x16, md5_v16, 16, __attribute__((target("avx512f"))))
+#endif
+
+typedef void (*md5_kernel_f)(uint32_t state[4][MD5_MAX_LANES], uint32_t words[16][MD5_MAX_LANES]);
+
+struct MD5Kernel {
+	md5_kernel_f mix;
+	unsigned lanes;
+};
+
+static const struct MD5Kernel kernel_x4 = { md5_mix_x4, 4 };
+#ifdef USE_WIDE_KERNELS
+static const struct MD5Kernel kernel_x8 = { md5_mix_x8, 8 };
+static const struct MD5Kernel kernel_x16 = { md5_mix_x16, 16 };
+#endif
+
+/* published as single pointer, so function and lane count always match */
+static const struct MD5Kernel *cur_kernel;
+
+static const struct MD5Kernel *get_kernel(void)
+{
+	const struct MD5Kernel *k = __atomic_load_n(&cur_kernel, __ATOMIC_ACQUIRE);
+
+	if (k)
+		return k;
+	k = &kernel_x4;
+#ifdef USE_WIDE_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		k = &kernel_x16;
+	else if (__builtin_cpu_supports("avx2"))
+		k = &kernel_x8;
+#endif
+	/* racing threads pick same kernel */
+	__atomic_store_n(&cur_kernel, k, __ATOMIC_RELEASE);
+	return k;
+}
+
+/* load little-endian block words of one lane */
+static void load_lane(uint32_t words[16][MD5_MAX_LANES], int lane, const uint8_t *blk)
+{
+	uint32_t w[16];
+	int k;
+
+	memcpy(w, blk, MD5_BLOCK_LENGTH);
+	swap_words(w, 16);
+	for (k = 0; k < 16; k++)
+		words[k][lane] = w[k];
+}
+
+/*
+ * Mix 'nblocks[i]' consecutive blocks from 'data[i]' into ctx[i].
+ * Does not touch nbytes or buffer.
+ */
+static void mix_blocks(struct md5_ctx **ctx, const uint8_t **data,
+		       unsigned *nblocks, unsigned count)
+{
+	uint32_t state[4][MD5_MAX_LANES];
+	uint32_t words[16][MD5_MAX_LANES];
+	int lane_msg[MD5_MAX_LANES];
+	unsigned i, next = 0, active, nlanes;
+	int lane;
+	uint32_t X[16];
+	const struct MD5Kernel *kern = get_kernel();
+
+	nlanes = kern->lanes;
+	memset(state, 0, sizeof(state));
+	memset(words, 0, sizeof(words));
+	for (lane = 0; lane < (int)nlanes; lane++)
+		lane_msg[lane] = -1;
+
+	while (1) {
+		/* fill idle lanes */
+		active = 0;
+		for (lane = 0; lane < (int)nlanes; lane++) {
+			if (lane_msg[lane] < 0) {
+				while (next < count && nblocks[next] == 0)
+					next++;
+				if (next < count) {
+					i = next++;
+					lane_msg[lane] = i;
+					state[0][lane] = ctx[i]->a;
+					state[1][lane] = ctx[i]->b;
+					state[2][lane] = ctx[i]->c;
+					state[3][lane] = ctx[i]->d;
+				}
+			}
+			if (lane_msg[lane] >= 0)
+				active++;
+		}
+		if (active == 0)
+			break;
+
+		/* single message left, no point in vectors */
+		if (active == 1 && next >= count) {
+			for (lane = 0; lane_msg[lane] < 0; lane++);
+			i = lane_msg[lane];
+			ctx[i]->a = state[0][lane];
+			ctx[i]->b = state[1][lane];
+			ctx[i]->c = state[2][lane];
+			ctx[i]->d = state[3][lane];
+			while (nblocks[i] > 0) {
+				memcpy(X, data[i], MD5_BLOCK_LENGTH);
+				swap_words(X, 16);
+				md5_mix(ctx[i], X);
+				data[i] += MD5_BLOCK_LENGTH;
+				nblocks[i]--;
+			}
+			break;
+		}
+
+		for (lane = 0; lane < (int)nlanes; lane++) {
+			if (lane_msg[lane] >= 0)
+				load_lane(words, lane, data[lane_msg[lane]]);
+		}
+		kern->mix(state, words);
+
+		/* advance, write back finished messages */
+		for (lane = 0; lane < (int)nlanes; lane++) {
+			if (lane_msg[lane] < 0)
+				continue;
+			i = lane_msg[lane];
+			data[i] += MD5_BLOCK_LENGTH;
+			if (--nblocks[i] > 0)
+				continue;
+			ctx[i]->a = state[0][lane];
+			ctx[i]->b = state[1][lane];
+			ctx[i]->c = state[2][lane];
+			ctx[i]->d = state[3][lane];
+			lane_msg[lane] = -1;
+		}
+	}
+}
+
+#else /* !__GNUC__ */
+
+static void mix_blocks(struct md5_ctx **ctx, const uint8_t **data,
+		       unsigned *nblocks, unsigned count)
+{
+	uint32_t X[16];
+	unsigned i;
+
+	for (i = 0; i < count; i++) {
+		for (; nblocks[i] > 0; nblocks[i]--) {
+			memcpy(X, data[i], MD5_BLOCK_LENGTH);
+			swap_words(X, 16);
+			md5_mix(ctx[i], X);
+			data[i] += MD5_BLOCK_LENGTH;
+		}
+	}
+}
+
+#endif /* !__GNUC__ */
+
+/* number of messages processed per mix_blocks() call */
+#define MANY_BATCH 64
+
+/* md5_update() on several contexts */
+void md5_update_many(struct md5_ctx **ctx, const void **data, const unsigned int *len, unsigned int count)
+{
+	const uint8_t *ptr[MANY_BATCH];
+	unsigned nblocks[MANY_BATCH];
+	unsigned left[MANY_BATCH];
+	unsigned i, j, n, pos;
+
+	for (j = 0; j < count; j += MANY_BATCH) {
+		n = count - j;
+		if (n > MANY_BATCH)
+			n = MANY_BATCH;
+		for (i = 0; i < n; i++) {
+			ptr[i] = data[j + i];
+			left[i] = len[j + i];
+
+			/* complete buffered block with scalar code */
+			pos = bufpos(ctx[j + i]);
+			if (pos > 0) {
+				unsigned fill = MD5_BLOCK_LENGTH - pos;
+				if (fill > left[i])
+					fill = left[i];
+				md5_update(ctx[j + i], ptr[i], fill);
+				ptr[i] += fill;
+				left[i] -= fill;
+			}
+			nblocks[i] = left[i] / MD5_BLOCK_LENGTH;
+			ctx[j + i]->nbytes += nblocks[i] * MD5_BLOCK_LENGTH;
+			left[i] -= nblocks[i] * MD5_BLOCK_LENGTH;
+		}
+
+		mix_blocks(ctx + j, ptr, nblocks, n);
+
+		/* tails go to buffer */
+		for (i = 0; i < n; i++) {
+			if (left[i] > 0)
+				md5_update(ctx[j + i], ptr[i], left[i]);
+		}
+	}
+}
+
+/* md5_final() on several contexts */
+void md5_final_many(uint8_t **dst, struct md5_ctx **ctx, unsigned int count)
+{
+	static const uint8_t padding[MD5_BLOCK_LENGTH] = { 0x80 };
+	const uint8_t *ptr[MANY_BATCH];
+	unsigned nblocks[MANY_BATCH];
+	uint64_t final_len;
+	unsigned i, j, n;
+	int pad_len;
+	struct md5_ctx *c;
+
+	for (j = 0; j < count; j += MANY_BATCH) {
+		n = count - j;
+		if (n > MANY_BATCH)
+			n = MANY_BATCH;
+
+		/* pad, last block is left in buffer in input byte order */
+		for (i = 0; i < n; i++) {
+			c = ctx[j + i];
+			final_len = c->nbytes * 8;
+			pad_len = MD5_BLOCK_LENGTH - 8 - bufpos(c);
+			if (pad_len <= 0)
+				pad_len += MD5_BLOCK_LENGTH;
+			md5_update(c, padding, pad_len);
+			put_word((uint8_t *)&c->buf[14], final_len);
+			put_word((uint8_t *)&c->buf[15], final_len >> 32);
+			ptr[i] = (const uint8_t *)c->buf;
+			nblocks[i] = 1;
+		}
+
+		mix_blocks(ctx + j, ptr, nblocks, n);
+
+		for (i = 0; i < n; i++) {
+			c = ctx[j + i];
+			put_word(dst[j + i], c->a);
+			put_word(dst[j + i] + 4, c->b);
+			put_word(dst[j + i] + 8, c->c);
+			put_word(dst[j + i] + 12, c->d);
+		}
+	}
+}
@@ -34,6 +34,13 @@ void md5_reset(struct md5_ctx *ctx);
 void md5_update(struct md5_ctx *ctx, const void *data, unsigned int len);
 void md5_final(uint8_t *dst, struct md5_ctx *ctx);
 
+/*
+ * Hash several independent messages in parallel SIMD lanes.
+ * Same results as calling md5_update()/md5_final() on each.
+ */
+void md5_update_many(struct md5_ctx **ctx, const void **data, const unsigned int *len, unsigned int count);
+void md5_final_many(uint8_t **dst, struct md5_ctx **ctx, unsigned int count);
+
 #ifdef MD5_COMPAT
 typedef struct md5_ctx MD5_CTX;
 #define MD5_Init(c) md5_reset(c)
@@ -0,0 +1,157 @@
+/*
+ * Region allocator for short-lived data.
+ *
+ * Copyright (c) 2009 Marko Kreen
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Chunks form a stack, newest on top.  Allocation that does not
+ * fit into top chunk pushes new one, big ones get chunk of own size.
+ */
+
+#include <usual/mempool.h>
+
+#include <string.h>
+
+#include <usual/alloc.h>
+
+#define DEFAULT_CHUNK_SIZE (8 * 1024)
+
+struct MemChunk {
+	struct MemChunk *prev;
+	size_t size;		/* usable bytes */
+	size_t used;
+};
+
+struct MemPool {
+	struct MemChunk *top;
+	size_t chunk_size;
+	size_t total_size;
+};
+
+#define CHUNK_HDR ALIGN(sizeof(struct MemChunk))
+#define CHUNK_DATA(c) ((char *)(c) + CHUNK_HDR)
+
+struct MemPool *mempool_create(size_t chunk_size)
+{
+	struct MemPool *pool = zmalloc(sizeof(*pool));
+	if (!pool)
+		return NULL;
+	pool->chunk_size = chunk_size ? chunk_size : DEFAULT_CHUNK_SIZE;
+	return pool;
+}
+
+static void free_chunk(struct MemPool *pool)
+{
+	struct MemChunk *c = pool->top;
+	pool->top = c->prev;
+	pool->total_size -= c->size;
+	free(c);
+}
+
+void mempool_destroy(struct MemPool *pool)
+{
+	if (!pool)
+		return;
+	while (pool->top)
+		free_chunk(pool);
+	free(pool);
+}
+
+static struct MemChunk *new_chunk(struct MemPool *pool, size_t len)
+{
+	struct MemChunk *c;
+	size_t size = pool->chunk_size;
+
+	if (len > size)
+		size = len;
+	c = malloc(CHUNK_HDR + size);
+	if (!c)
+		return NULL;
+	c->size = size;
+	c->used = 0;
+	c->prev = pool->top;
+	pool->top = c;
+	pool->total_size += size;
+	return c;
+}
+
+void *mempool_alloc(struct MemPool *pool, size_t len)
+{
+	struct MemChunk *c = pool->top;
+	void *p;
+
+	len = ALIGN(len);
+	if (!c || c->size - c->used < len) {
+		c = new_chunk(pool, len);
+		if (!c)
+			return NULL;
+	}
+	p = CHUNK_DATA(c) + c->used;
+	c->used += len;
+	return p;
+}
+
+void *mempool_zalloc(struct MemPool *pool, size_t len)
+{
+	void *p = mempool_alloc(pool, len);
+	if (p)
+		memset(p, 0, len);
+	return p;
+}
+
+char *mempool_strndup(struct MemPool *pool, const char *str, size_t len)
+{
+	char *p = mempool_alloc(pool, len + 1);
+	if (p) {
+		memcpy(p, str, len);
+		p[len] = 0;
+	}
+	return p;
+}
+
+char *mempool_strdup(struct MemPool *pool, const char *str)
+{
+	return mempool_strndup(pool, str, strlen(str));
+}
+
+void mempool_mark(struct MemPool *pool, struct MemPoolMark *mark)
+{
+	mark->chunk = pool->top;
+	mark->used = pool->top ? pool->top->used : 0;
+}
+
+void mempool_reset_to(struct MemPool *pool, const struct MemPoolMark *mark)
+{
+	while (pool->top && pool->top != mark->chunk)
+		free_chunk(pool);
+	if (pool->top)
+		pool->top->used = mark->used;
+}
+
+void mempool_reset(struct MemPool *pool)
+{
+	if (!pool->top)
+		return;
+	while (pool->top->prev)
+		free_chunk(pool);
+	pool->top->used = 0;
+}
+
+size_t mempool_size(const struct MemPool *pool)
+{
+	return pool->total_size;
+}
+
@@ -0,0 +1,59 @@
+/*
+ * Region allocator for short-lived data.
+ *
+ * Copyright (c) 2009 Marko Kreen
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _USUAL_MEMPOOL_H_
+#define _USUAL_MEMPOOL_H_
+
+#include <usual/base.h>
+
+/*
+ * Memory is taken from big chunks with bump pointer,
+ * individual allocations are not freed, only whole
+ * pool or everything after a mark.
+ *
+ * Not thread-safe.
+ */
+
+struct MemPool;
+
+/* position in pool, for mempool_reset_to() */
+struct MemPoolMark {
+	void *chunk;
+	size_t used;
+};
+
+/* chunk_size 0 means default (8KB) */
+struct MemPool *mempool_create(size_t chunk_size) _MUSTCHECK;
+void mempool_destroy(struct MemPool *pool);
+
+void *mempool_alloc(struct MemPool *pool, size_t len) _MALLOC _MUSTCHECK;
+void *mempool_zalloc(struct MemPool *pool, size_t len) _MALLOC _MUSTCHECK;
+char *mempool_strdup(struct MemPool *pool, const char *str) _MALLOC _MUSTCHECK;
+char *mempool_strndup(struct MemPool *pool, const char *str, size_t len) _MALLOC _MUSTCHECK;
+
+void mempool_mark(struct MemPool *pool, struct MemPoolMark *mark);
+void mempool_reset_to(struct MemPool *pool, const struct MemPoolMark *mark);
+
+/* drop all allocations, first chunk is kept for reuse */
+void mempool_reset(struct MemPool *pool);
+
+/* bytes in chunks currently held */
+size_t mempool_size(const struct MemPool *pool);
+
+#endif
+
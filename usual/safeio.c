@@ -21,6 +21,10 @@
  * that survive EINTR and also can log problems.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <usual/safeio.h>
 
 #include <fcntl.h>
@@ -31,8 +35,10 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/un.h>
+#include <limits.h>
 
 #include <usual/logging.h>
+#include <usual/socket.h>
 
 int safe_read(int fd, void *buf, int len)
 {
@@ -187,3 +193,168 @@ loop:
 	return res;
 }
 
+/* accept4() saves two fcntl() calls per connection */
+int safe_accept_nb(int fd, struct sockaddr *sa, socklen_t *sa_len_p)
+{
+	int res;
+#ifdef __linux__
+loop:
+	res = accept4(fd, sa, sa_len_p, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (res < 0 && errno == EINTR)
+		goto loop;
+#else
+	int err;
+loop:
+	res = accept(fd, sa, sa_len_p);
+	if (res < 0 && errno == EINTR)
+		goto loop;
+	if (res >= 0 && !socket_setup(res, true)) {
+		err = errno;
+		close(res);
+		errno = err;
+		res = -1;
+	}
+#endif
+	if (res < 0 && errno != EAGAIN)
+		log_noise("safe_accept_nb(%d) = %s", fd, strerror(errno));
+	else if (res >= 0 && cf_verbose > 2)
+		log_noise("safe_accept_nb(%d) = %d (%s)", fd, res, sa && sa_len_p ? sa2str(sa) : "");
+	return res;
+}
+
+/*
+ * Vectored and batched I/O.
+ */
+
+#ifndef IOV_MAX
+#define IOV_MAX 16
+#endif
+
+int safe_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	int res;
+	if (iovcnt > IOV_MAX)
+		iovcnt = IOV_MAX;
+loop:
+	res = readv(fd, iov, iovcnt);
+	if (res < 0 && errno == EINTR)
+		goto loop;
+	if (res < 0)
+		log_noise("safe_readv(%d, %d) = %s", fd, iovcnt, strerror(errno));
+	else if (cf_verbose > 2)
+		log_noise("safe_readv(%d, %d) = %d", fd, iovcnt, res);
+	return res;
+}
+
+/*
+ * Writes until all is done or fd would block.  The iovec array
+ * is updated in place: written parts have iov_len 0 and partially
+ * written entry points to remaining data, so caller can resubmit
+ * same array.  Returns bytes written, -1 only if nothing was.
+ */
+int safe_writev(int fd, struct iovec *iov, int iovcnt)
+{
+	int res, total = 0;
+	size_t n;
+
+	while (iovcnt > 0) {
+		/* skip finished entries */
+		if (iov->iov_len == 0) {
+			iov++;
+			iovcnt--;
+			continue;
+		}
+
+		res = writev(fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res < 0) {
+			if (errno != EAGAIN || cf_verbose > 2)
+				log_noise("safe_writev(%d, %d) = %s", fd, iovcnt, strerror(errno));
+			return total > 0 ? total : res;
+		}
+		total += res;
+
+		/* consume written bytes */
+		n = res;
+		while (n > 0) {
+			if (n >= iov->iov_len) {
+				n -= iov->iov_len;
+				iov->iov_len = 0;
+				iov++;
+				iovcnt--;
+			} else {
+				iov->iov_base = (char *)iov->iov_base + n;
+				iov->iov_len -= n;
+				n = 0;
+			}
+		}
+	}
+	if (cf_verbose > 2)
+		log_noise("safe_writev(%d) = %d", fd, total);
+	return total;
+}
+
+#ifdef __linux__
+
+int safe_recvmmsg(int fd, struct mmsghdr *msgs, unsigned int vlen, int flags)
+{
+	int res;
+loop:
+	res = recvmmsg(fd, msgs, vlen, flags, NULL);
+	if (res < 0 && errno == EINTR)
+		goto loop;
+	if (res < 0)
+		log_noise("safe_recvmmsg(%d, %u, %d) = %s", fd, vlen, flags, strerror(errno));
+	else if (cf_verbose > 2)
+		log_noise("safe_recvmmsg(%d, %u, %d) = %d", fd, vlen, flags, res);
+	return res;
+}
+
+int safe_sendmmsg(int fd, struct mmsghdr *msgs, unsigned int vlen, int flags)
+{
+	int res;
+loop:
+	res = sendmmsg(fd, msgs, vlen, flags);
+	if (res < 0 && errno == EINTR)
+		goto loop;
+	if (res < 0)
+		log_noise("safe_sendmmsg(%d, %u, %d) = %s", fd, vlen, flags, strerror(errno));
+	else if (cf_verbose > 2)
+		log_noise("safe_sendmmsg(%d, %u, %d) = %d", fd, vlen, flags, res);
+	return res;
+}
+
+#else /* !__linux__ */
+
+/* emulate with one syscall per message, stop on first error */
+
+int safe_recvmmsg(int fd, struct mmsghdr *msgs, unsigned int vlen, int flags)
+{
+	unsigned int i;
+	int res;
+
+	for (i = 0; i < vlen; i++) {
+		res = safe_recvmsg(fd, &msgs[i].msg_hdr, flags);
+		if (res < 0)
+			return i > 0 ? (int)i : res;
+		msgs[i].msg_len = res;
+	}
+	return i;
+}
+
+int safe_sendmmsg(int fd, struct mmsghdr *msgs, unsigned int vlen, int flags)
+{
+	unsigned int i;
+	int res;
+
+	for (i = 0; i < vlen; i++) {
+		res = safe_sendmsg(fd, &msgs[i].msg_hdr, flags);
+		if (res < 0)
+			return i > 0 ? (int)i : res;
+		msgs[i].msg_len = res;
+	}
+	return i;
+}
+
+#endif
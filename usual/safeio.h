@@ -23,6 +23,19 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+
+/*
+ * Linux has recvmmsg/sendmmsg, struct mmsghdr is visible
+ * with _GNU_SOURCE.  Elsewhere they are emulated.
+ */
+#ifndef __linux__
+struct mmsghdr {
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+};
+#endif
+struct mmsghdr;
 
 int safe_read(int fd, void *buf, int len)                       _MUSTCHECK;
 int safe_write(int fd, const void *buf, int len)                _MUSTCHECK;
@@ -34,4 +47,12 @@ int safe_sendmsg(int fd, const struct msghdr *msg, int flags)   _MUSTCHECK;
 int safe_connect(int fd, const struct sockaddr *sa, socklen_t sa_len)   _MUSTCHECK;
 int safe_accept(int fd, struct sockaddr *sa, socklen_t *sa_len) _MUSTCHECK;
 
+/* new socket is non-blocking and close-on-exec, EAGAIN is not logged */
+int safe_accept_nb(int fd, struct sockaddr *sa, socklen_t *sa_len) _MUSTCHECK;
+
+int safe_readv(int fd, const struct iovec *iov, int iovcnt)     _MUSTCHECK;
+int safe_writev(int fd, struct iovec *iov, int iovcnt)          _MUSTCHECK;
+int safe_recvmmsg(int fd, struct mmsghdr *msgs, unsigned int vlen, int flags)   _MUSTCHECK;
+int safe_sendmmsg(int fd, struct mmsghdr *msgs, unsigned int vlen, int flags)   _MUSTCHECK;
+
 #endif
@@ -18,38 +18,112 @@
 
 /*
  * Basic behaviour:
- * - On each alloc initializer is called.
- * - if init func is not given, memset() is done
+ * - if init func is given, it is called on each alloc, otherwise
+ *   reused objects are zeroed.
+ * - new objects come zeroed from mmap(), before init func.
+ * - objects are carved lazily from fragment tail, so untouched
+ *   part of fragment stays unmapped and needs no zeroing.
+ * - single slab is not thread-safe, but slabs can be created
+ *   and destroyed from several threads.
+ * - with SLAB_THREAD_SAFE, each thread has magazines (small LIFO
+ *   object caches) in front of shared depot, so most alloc/free
+ *   calls do not touch the lock.  (Bonwick, "Magazines and Vmem")
  *
- * ATM custom 'align' larger than malloc() alignment does not work.
+ * - objects are carved from fragments that are aligned to their size,
+ *   so fragment header is found from object pointer by masking.
+ *   Each fragment has its own freelist and free count, fully free
+ *   fragments are returned to OS with munmap(), except one spare.
+ * - allocation prefers partially used fragments, most recently
+ *   refilled first, to keep live objects packed together.
+ *
+ * Custom 'align' can be up to page size.
  */
 
 #include <usual/slab.h>
 
 #include <sys/param.h>
+#include <sys/mman.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <usual/statlist.h>
 
+/* objects per magazine */
+#define MAG_SIZE 32
+
+/* fully free fragments kept around to avoid mmap/munmap thrashing */
+#define SLAB_KEEP_EMPTY 1
+
+/* minimal fragment size and object count */
+#define MIN_FRAG_SIZE (16 * 1024)
+#define MIN_FRAG_OBJS 50
+
+/* fragment size with SLAB_HUGEPAGE */
+#define HUGE_FRAG_SIZE (2 * 1024 * 1024)
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
 /*
  * Store for pre-initialized objects of one type.
  */
 struct Slab {
 	struct List head;
-	struct StatList freelist;
-	struct StatList fraglist;
+	struct StatList partial_frags;
+	struct StatList full_frags;
+	struct StatList empty_frags;
 	char name[32];
 	unsigned final_size;
 	unsigned total_count;
+	unsigned free_count;
 	slab_init_fn  init_func;
+	unsigned flags;
+
+	/* fragment layout */
+	unsigned frag_size;
+	unsigned frag_hdr;
+	unsigned frag_objs;
+	uint64_t released_bytes;
+
+	/* depot for SLAB_THREAD_SAFE */
+	pthread_mutex_t lock;
+	pthread_key_t cache_key;
+	struct StatList full_mags;
+	struct List empty_mags;
+	struct List cache_list;
 };
 
 /*
- * Header for each slab.
+ * Header for each fragment, at the start of aligned area.
  */
 struct SlabFrag {
 	struct List head;
+	struct List freelist;
+	unsigned free_count;	/* freelist + uncarved tail */
+	unsigned carved;	/* objects taken from tail */
+};
+
+/*
+ * Bounded LIFO of free objects.
+ */
+struct Magazine {
+	struct List head;
+	unsigned count;
+	void *objs[MAG_SIZE];
+};
+
+/*
+ * Per-thread magazine pair.
+ */
+struct SlabCache {
+	struct List head;
+	struct Slab *slab;
+	struct Magazine *loaded;
+	struct Magazine *prev;
 };
 
 /* keep track of all active slabs */
@@ -58,18 +132,56 @@ static STATLIST(slab_list);
 /* cache for slab headers */
 static struct Slab *slab_headers = NULL;
 
+/* protects slab_list and slab_headers */
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void release_cache(void *arg);
+
+/* pick power-of-2 fragment size, it is also fragment alignment */
+static void calc_frag_size(struct Slab *slab, unsigned align)
+{
+	unsigned page = sysconf(_SC_PAGESIZE);
+	unsigned need, size;
+
+	slab->frag_hdr = CUSTOM_ALIGN(sizeof(struct SlabFrag), align ? align : sizeof(long));
+	need = slab->frag_hdr + MIN_FRAG_OBJS * slab->final_size;
+	if (need < MIN_FRAG_SIZE)
+		need = MIN_FRAG_SIZE;
+	if (slab->flags & SLAB_HUGEPAGE && need < HUGE_FRAG_SIZE)
+		need = HUGE_FRAG_SIZE;
+	for (size = page; size < need; size *= 2);
+
+	slab->frag_size = size;
+	slab->frag_objs = (size - slab->frag_hdr) / slab->final_size;
+}
+
 /* fill struct contents */
-static void init_slab(struct Slab *slab, const char *name, unsigned obj_size,
-		      unsigned align, slab_init_fn init_func)
+static bool init_slab(struct Slab *slab, const char *name, unsigned obj_size,
+		      unsigned align, slab_init_fn init_func, unsigned flags)
 {
 	unsigned slen = strlen(name);
 
 	list_init(&slab->head);
-	statlist_init(&slab->freelist, name);
-	statlist_init(&slab->fraglist, name);
+	statlist_init(&slab->partial_frags, name);
+	statlist_init(&slab->full_frags, name);
+	statlist_init(&slab->empty_frags, name);
 	slab->total_count = 0;
+	slab->free_count = 0;
+	slab->released_bytes = 0;
 	slab->init_func = init_func;
-	statlist_append(&slab_list, &slab->head);
+	slab->flags = flags;
+
+	if (flags & SLAB_THREAD_SAFE) {
+		statlist_init(&slab->full_mags, name);
+		list_init(&slab->empty_mags);
+		list_init(&slab->cache_list);
+		if (pthread_mutex_init(&slab->lock, NULL) != 0)
+			return false;
+		if (pthread_key_create(&slab->cache_key, release_cache) != 0) {
+			pthread_mutex_destroy(&slab->lock);
+			return false;
+		}
+	}
 
 	if (slen >= sizeof(slab->name))
 		slen = sizeof(slab->name) - 1;
@@ -80,104 +192,421 @@ static void init_slab(struct Slab *slab, const char *name, unsigned obj_size,
 		slab->final_size = ALIGN(obj_size);
 	else
 		slab->final_size = CUSTOM_ALIGN(obj_size, align);
+	if (slab->final_size < sizeof(struct List))
+		slab->final_size = ALIGN(sizeof(struct List));
+	calc_frag_size(slab, align);
+
+	statlist_append(&slab_list, &slab->head);
+	return true;
 }
 
 /* make new slab */
 struct Slab *slab_create(const char *name, unsigned obj_size, unsigned align,
 			 slab_init_fn init_func)
 {
-	struct Slab *slab;
+	return slab_create_flags(name, obj_size, align, init_func, 0);
+}
+
+/* make new slab with SLAB_* flags */
+struct Slab *slab_create_flags(const char *name, unsigned obj_size, unsigned align,
+			       slab_init_fn init_func, unsigned flags)
+{
+	struct Slab *slab = NULL;
+
+	pthread_mutex_lock(&slab_lock);
 
 	/* header cache */
 	if (!slab_headers) {
 		slab_headers = malloc(sizeof(struct Slab));
 		if (!slab_headers)
-			return NULL;
+			goto out;
 		init_slab(slab_headers, "slab_header",
-			  sizeof(struct Slab), 0, NULL);
+			  sizeof(struct Slab), 0, NULL, 0);
 	}
 
 	/* new slab object */
 	slab = slab_alloc(slab_headers);
-	if (slab)
-		init_slab(slab, name, obj_size, align, init_func);
+	if (slab && !init_slab(slab, name, obj_size, align, init_func, flags)) {
+		slab_free(slab_headers, slab);
+		slab = NULL;
+	}
+out:
+	pthread_mutex_unlock(&slab_lock);
 	return slab;
 }
 
+/* free magazines and per-thread caches */
+static void destroy_depot(struct Slab *slab)
+{
+	struct List *item, *tmp;
+	struct SlabCache *cc;
+
+	pthread_key_delete(slab->cache_key);
+	list_for_each_safe(item, &slab->cache_list, tmp) {
+		cc = container_of(item, struct SlabCache, head);
+		free(cc->loaded);
+		free(cc->prev);
+		free(cc);
+	}
+	statlist_for_each_safe(item, &slab->full_mags, tmp)
+		free(container_of(item, struct Magazine, head));
+	list_for_each_safe(item, &slab->empty_mags, tmp)
+		free(container_of(item, struct Magazine, head));
+	pthread_mutex_destroy(&slab->lock);
+}
+
 /* free all storage associated by slab */
 void slab_destroy(struct Slab *slab)
 {
+	struct StatList *lists[3] = { &slab->partial_frags, &slab->full_frags, &slab->empty_frags };
 	struct List *item, *tmp;
-	struct SlabFrag *frag;
+	int i;
 
-	statlist_for_each_safe(item, &slab->fraglist, tmp) {
-		frag = container_of(item, struct SlabFrag, head);
-		free(frag);
+	if (slab->flags & SLAB_THREAD_SAFE)
+		destroy_depot(slab);
+
+	for (i = 0; i < 3; i++) {
+		statlist_for_each_safe(item, lists[i], tmp)
+			munmap(item, slab->frag_size);
 	}
+	pthread_mutex_lock(&slab_lock);
 	statlist_remove(&slab_list, &slab->head);
 	memset(slab, 0, sizeof(*slab));
 	slab_free(slab_headers, slab);
+	pthread_mutex_unlock(&slab_lock);
 }
 
-/* add new block of objects to slab */
-static void grow(struct Slab *slab)
+/* mmap area aligned to its size */
+static void *map_aligned(unsigned size, bool huge)
 {
-	unsigned count, i, size;
-	char *area;
-	struct SlabFrag *frag;
+	char *area, *start;
+	unsigned page = sysconf(_SC_PAGESIZE);
+	size_t total = size, lead;
+
+	if (size > page)
+		total = (size_t)size * 2;
+	area = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (area == MAP_FAILED)
+		return NULL;
 
-	/* calc new slab size */
-	count = slab->total_count;
-	if (count < 50)
-		count = 16 * 1024 / slab->final_size;
-	if (count < 50)
-		count = 50;
-	size = count * slab->final_size;
+	/* trim unaligned edges */
+	start = (char *)CUSTOM_ALIGN(area, (uintptr_t)size);
+	lead = start - area;
+	if (lead > 0)
+		munmap(area, lead);
+	if (total - lead > size)
+		munmap(start + size, total - lead - size);
 
-	/* allocate & init */
-	frag = malloc(size + sizeof(struct SlabFrag));
+#ifdef MADV_HUGEPAGE
+	if (huge)
+		madvise(start, size, MADV_HUGEPAGE);
+#endif
+	return start;
+}
+
+/* find fragment for object */
+static inline struct SlabFrag *obj_frag(const struct Slab *slab, void *obj)
+{
+	return (struct SlabFrag *)((uintptr_t)obj & ~(uintptr_t)(slab->frag_size - 1));
+}
+
+/* add new block of objects to slab, objects are carved on demand */
+static struct SlabFrag *grow(struct Slab *slab)
+{
+	struct SlabFrag *frag;
+
+	frag = map_aligned(slab->frag_size, slab->flags & SLAB_HUGEPAGE);
 	if (!frag)
-		return;
+		return NULL;
 	list_init(&frag->head);
-	area = (char *)frag + sizeof(struct SlabFrag);
-	memset(area, 0, size);
-
-	/* init objects */
-	for (i = 0; i < count; i++) {
-		void *obj = area + i * slab->final_size;
-		struct List *head = (struct List *)obj;
-		list_init(head);
-		statlist_append(&slab->freelist, head);
-	}
+	list_init(&frag->freelist);
+	frag->free_count = slab->frag_objs;
+	frag->carved = 0;
 
 	/* register to slab */
-	slab->total_count += count;
-	statlist_append(&slab->fraglist, &frag->head);
+	slab->total_count += slab->frag_objs;
+	slab->free_count += slab->frag_objs;
+	statlist_append(&slab->empty_frags, &frag->head);
+	return frag;
 }
 
-/* get free object from slab */
-void *slab_alloc(struct Slab *slab)
+/* give fully free fragment back to OS */
+static void release_frag(struct Slab *slab, struct SlabFrag *frag)
 {
-	struct List *item = statlist_pop(&slab->freelist);
-	if (!item) {
-		grow(slab);
-		item = statlist_pop(&slab->freelist);
-	}
+	statlist_remove(&slab->empty_frags, &frag->head);
+	slab->total_count -= slab->frag_objs;
+	slab->free_count -= slab->frag_objs;
+	slab->released_bytes += slab->frag_size;
+	munmap(frag, slab->frag_size);
+}
+
+/* get object from freelist or fragment tail, without init */
+static void *raw_alloc(struct Slab *slab, bool *fresh)
+{
+	struct SlabFrag *frag;
+	struct List *item;
+
+	/* prefer partially used fragments */
+	item = statlist_first(&slab->partial_frags);
 	if (item) {
-		if (slab->init_func)
-			slab->init_func(item);
+		frag = container_of(item, struct SlabFrag, head);
+	} else {
+		item = statlist_first(&slab->empty_frags);
+		if (item)
+			frag = container_of(item, struct SlabFrag, head);
 		else
-			memset(item, 0, slab->final_size);
+			frag = grow(slab);
+		if (!frag)
+			return NULL;
+		statlist_remove(&slab->empty_frags, &frag->head);
+		statlist_prepend(&slab->partial_frags, &frag->head);
+	}
+
+	item = list_pop(&frag->freelist);
+	if (item) {
+		*fresh = false;
+	} else {
+		/* untouched mmap memory, already zero */
+		item = (struct List *)((char *)frag + slab->frag_hdr
+				       + frag->carved * slab->final_size);
+		frag->carved++;
+		*fresh = true;
+	}
+	frag->free_count--;
+	slab->free_count--;
+	if (frag->free_count == 0) {
+		statlist_remove(&slab->partial_frags, &frag->head);
+		statlist_append(&slab->full_frags, &frag->head);
 	}
 	return item;
 }
 
+/* put object back to freelist */
+static void raw_free(struct Slab *slab, void *obj)
+{
+	struct SlabFrag *frag = obj_frag(slab, obj);
+	struct List *item = obj;
+
+	list_prepend(&frag->freelist, item);
+	frag->free_count++;
+	slab->free_count++;
+
+	if (frag->free_count == 1) {
+		/* was full, nearly full fragments go first */
+		statlist_remove(&slab->full_frags, &frag->head);
+		statlist_prepend(&slab->partial_frags, &frag->head);
+	}
+	if (frag->free_count == slab->frag_objs) {
+		statlist_remove(&slab->partial_frags, &frag->head);
+		statlist_prepend(&slab->empty_frags, &frag->head);
+		if (statlist_count(&slab->empty_frags) > SLAB_KEEP_EMPTY)
+			release_frag(slab, frag);
+	}
+}
+
+static void *init_object(struct Slab *slab, void *obj, bool fresh)
+{
+	if (!obj)
+		return NULL;
+	/* fresh tail objects are zero from mmap() */
+	if (slab->init_func)
+		slab->init_func(obj);
+	else if (!fresh)
+		memset(obj, 0, slab->final_size);
+	return obj;
+}
+
+/*
+ * Thread-safe mode.
+ */
+
+static struct Magazine *new_magazine(void)
+{
+	struct Magazine *mag = malloc(sizeof(*mag));
+	if (mag) {
+		list_init(&mag->head);
+		mag->count = 0;
+	}
+	return mag;
+}
+
+/* return magazines to depot on thread exit */
+static void release_cache(void *arg)
+{
+	struct SlabCache *cc = arg;
+	struct Slab *slab = cc->slab;
+	struct Magazine *mags[2] = { cc->loaded, cc->prev };
+	int i;
+
+	pthread_mutex_lock(&slab->lock);
+	for (i = 0; i < 2; i++) {
+		if (mags[i]->count > 0)
+			statlist_append(&slab->full_mags, &mags[i]->head);
+		else
+			list_append(&slab->empty_mags, &mags[i]->head);
+	}
+	list_del(&cc->head);
+	pthread_mutex_unlock(&slab->lock);
+	free(cc);
+}
+
+/* get magazines for current thread */
+static struct SlabCache *get_cache(struct Slab *slab)
+{
+	struct SlabCache *cc = pthread_getspecific(slab->cache_key);
+	if (cc)
+		return cc;
+
+	cc = malloc(sizeof(*cc));
+	if (!cc)
+		return NULL;
+	list_init(&cc->head);
+	cc->slab = slab;
+	cc->loaded = new_magazine();
+	cc->prev = new_magazine();
+	if (!cc->loaded || !cc->prev)
+		goto failed;
+	if (pthread_setspecific(slab->cache_key, cc) != 0)
+		goto failed;
+
+	pthread_mutex_lock(&slab->lock);
+	list_append(&slab->cache_list, &cc->head);
+	pthread_mutex_unlock(&slab->lock);
+	return cc;
+failed:
+	free(cc->loaded);
+	free(cc->prev);
+	free(cc);
+	return NULL;
+}
+
+static void swap_mags(struct SlabCache *cc)
+{
+	struct Magazine *tmp = cc->loaded;
+	cc->loaded = cc->prev;
+	cc->prev = tmp;
+}
+
+static void *mt_alloc(struct Slab *slab)
+{
+	struct SlabCache *cc = get_cache(slab);
+	struct Magazine *mag;
+	struct List *item;
+	void *obj;
+	bool fresh;
+
+	if (!cc) {
+		pthread_mutex_lock(&slab->lock);
+		obj = raw_alloc(slab, &fresh);
+		pthread_mutex_unlock(&slab->lock);
+		return obj;
+	}
+
+	if (cc->loaded->count == 0) {
+		if (cc->prev->count > 0) {
+			swap_mags(cc);
+		} else {
+			pthread_mutex_lock(&slab->lock);
+			item = statlist_pop(&slab->full_mags);
+			if (item) {
+				/* exchange empty magazine for full one */
+				mag = container_of(item, struct Magazine, head);
+				list_append(&slab->empty_mags, &cc->prev->head);
+				cc->prev = cc->loaded;
+				cc->loaded = mag;
+			} else {
+				/* refill from freelist */
+				mag = cc->loaded;
+				while (mag->count < MAG_SIZE) {
+					obj = raw_alloc(slab, &fresh);
+					if (!obj)
+						break;
+					mag->objs[mag->count++] = obj;
+				}
+			}
+			pthread_mutex_unlock(&slab->lock);
+			if (cc->loaded->count == 0)
+				return NULL;
+		}
+	}
+	return cc->loaded->objs[--cc->loaded->count];
+}
+
+static void mt_free(struct Slab *slab, void *obj)
+{
+	struct SlabCache *cc = get_cache(slab);
+	struct Magazine *mag;
+	struct List *item;
+
+	if (!cc)
+		goto direct;
+
+	if (cc->loaded->count == MAG_SIZE) {
+		if (cc->prev->count == 0) {
+			swap_mags(cc);
+		} else {
+			/* exchange full magazine for empty one */
+			pthread_mutex_lock(&slab->lock);
+			item = list_pop(&slab->empty_mags);
+			mag = item ? container_of(item, struct Magazine, head) : new_magazine();
+			if (!mag) {
+				raw_free(slab, obj);
+				pthread_mutex_unlock(&slab->lock);
+				return;
+			}
+			statlist_append(&slab->full_mags, &cc->prev->head);
+			cc->prev = cc->loaded;
+			cc->loaded = mag;
+			pthread_mutex_unlock(&slab->lock);
+		}
+	}
+	cc->loaded->objs[cc->loaded->count++] = obj;
+	return;
+
+direct:
+	pthread_mutex_lock(&slab->lock);
+	raw_free(slab, obj);
+	pthread_mutex_unlock(&slab->lock);
+}
+
+/* objects held in magazines, must have slab->lock */
+static unsigned mag_free_count(const struct Slab *slab)
+{
+	const struct List *item;
+	const struct SlabCache *cc;
+	unsigned count = 0;
+
+	list_for_each(item, &slab->full_mags.head)
+		count += container_of(item, struct Magazine, head)->count;
+	list_for_each(item, &slab->cache_list) {
+		cc = container_of(item, struct SlabCache, head);
+		count += cc->loaded->count + cc->prev->count;
+	}
+	return count;
+}
+
+/*
+ * Public alloc/free.
+ */
+
+/* get free object from slab */
+void *slab_alloc(struct Slab *slab)
+{
+	bool fresh = false;
+
+	/* magazines do not track freshness */
+	if (slab->flags & SLAB_THREAD_SAFE)
+		return init_object(slab, mt_alloc(slab), false);
+	return init_object(slab, raw_alloc(slab, &fresh), fresh);
+}
+
 /* put object back to slab */
 void slab_free(struct Slab *slab, void *obj)
 {
-	struct List *item = obj;
-	list_init(item);
-	statlist_prepend(&slab->freelist, item);
+	if (slab->flags & SLAB_THREAD_SAFE)
+		mt_free(slab, obj);
+	else
+		raw_free(slab, obj);
 }
 
 /* total number of objects allocated from slab */
@@ -189,7 +618,16 @@ int slab_total_count(const struct Slab *slab)
 /* free objects in slab */
 int slab_free_count(const struct Slab *slab)
 {
-	return statlist_count(&slab->freelist);
+	struct Slab *xslab = (struct Slab *)slab;
+	int count;
+
+	if (!(slab->flags & SLAB_THREAD_SAFE))
+		return slab->free_count;
+
+	pthread_mutex_lock(&xslab->lock);
+	count = slab->free_count + mag_free_count(slab);
+	pthread_mutex_unlock(&xslab->lock);
+	return count;
 }
 
 /* number of objects in use */
@@ -198,21 +636,56 @@ int slab_active_count(const struct Slab *slab)
 	return slab_total_count(slab) - slab_free_count(slab);
 }
 
-static void run_slab_stats(struct Slab *slab, slab_stat_fn cb_func, void *cb_arg)
+static void run_slab_stats(struct Slab *slab, slab_stat_ext_fn cb_func, void *cb_arg)
 {
-	unsigned free = statlist_count(&slab->freelist);
-	cb_func(cb_arg, slab->name, slab->final_size, free, slab->total_count);
+	struct SlabStats st;
+
+	if (slab->flags & SLAB_THREAD_SAFE)
+		pthread_mutex_lock(&slab->lock);
+	st.name = slab->name;
+	st.size = slab->final_size;
+	st.free = slab->free_count;
+	st.total = slab->total_count;
+	st.frag_count = statlist_count(&slab->partial_frags)
+		+ statlist_count(&slab->full_frags)
+		+ statlist_count(&slab->empty_frags);
+	st.frag_size = slab->frag_size;
+	st.released_bytes = slab->released_bytes;
+	if (slab->flags & SLAB_THREAD_SAFE) {
+		st.free += mag_free_count(slab);
+		pthread_mutex_unlock(&slab->lock);
+	}
+	cb_func(cb_arg, &st);
 }
 
-/* call a function for all active slabs */
-void slab_stats(slab_stat_fn cb_func, void *cb_arg)
+/* call a function for all active slabs, with full info */
+void slab_stats_ext(slab_stat_ext_fn cb_func, void *cb_arg)
 {
 	struct Slab *slab;
 	struct List *item;
 
+	pthread_mutex_lock(&slab_lock);
 	statlist_for_each(item, &slab_list) {
 		slab = container_of(item, struct Slab, head);
 		run_slab_stats(slab, cb_func, cb_arg);
 	}
+	pthread_mutex_unlock(&slab_lock);
 }
 
+struct StatCompat {
+	slab_stat_fn cb_func;
+	void *cb_arg;
+};
+
+static void compat_stat(void *arg, const struct SlabStats *st)
+{
+	struct StatCompat *c = arg;
+	c->cb_func(c->cb_arg, st->name, st->size, st->free, st->total);
+}
+
+/* call a function for all active slabs */
+void slab_stats(slab_stat_fn cb_func, void *cb_arg)
+{
+	struct StatCompat c = { cb_func, cb_arg };
+	slab_stats_ext(compat_stat, &c);
+}
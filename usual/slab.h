@@ -25,8 +25,17 @@ struct Slab;
 
 typedef void (*slab_init_fn)(void *obj);
 
+enum SlabFlags {
+	/* per-thread magazines in front of locked depot */
+	SLAB_THREAD_SAFE = 1,
+	/* use 2MB fragments, backed by transparent hugepages if possible */
+	SLAB_HUGEPAGE = 2,
+};
+
 struct Slab *slab_create(const char *name, unsigned obj_size, unsigned align,
 			     slab_init_fn init_func);
+struct Slab *slab_create_flags(const char *name, unsigned obj_size, unsigned align,
+			       slab_init_fn init_func, unsigned flags);
 void slab_destroy(struct Slab *slab);
 
 void * slab_alloc(struct Slab *slab) _MALLOC _MUSTCHECK;
@@ -41,5 +50,17 @@ typedef void (*slab_stat_fn)(void *arg, const char *slab_name,
 			     unsigned total);
 void slab_stats(slab_stat_fn cb_func, void *cb_arg);
 
+struct SlabStats {
+	const char *name;
+	unsigned size;		/* object size */
+	unsigned free;		/* free objects, including magazines */
+	unsigned total;		/* objects in fragments currently held */
+	unsigned frag_count;
+	unsigned frag_size;
+	uint64_t released_bytes;	/* fragment memory returned to OS */
+};
+typedef void (*slab_stat_ext_fn)(void *arg, const struct SlabStats *st);
+void slab_stats_ext(slab_stat_ext_fn cb_func, void *cb_arg);
+
 #endif
 
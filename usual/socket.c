@@ -33,6 +33,7 @@
 #include <arpa/inet.h>
 
 #include <usual/logging.h>
+#include <usual/safeio.h>
 
 /* toggle non-blocking flag */
 bool socket_set_nonblocking(int fd, bool non_block)
@@ -60,6 +61,9 @@ bool socket_set_nonblocking(int fd, bool non_block)
 bool socket_setup(int sock, bool non_block)
 {
 	int res;
+#ifdef SO_NOSIGPIPE
+	int val;
+#endif
 
 	/* close fd on exec */
 	res = fcntl(sock, F_SETFD, FD_CLOEXEC);
@@ -81,3 +85,290 @@ bool socket_setup(int sock, bool non_block)
 	return true;
 }
 
+/*
+ * Tuning profiles.
+ */
+
+/* where option applies */
+#define R_LISTEN	1
+#define R_CONN		2	/* accepted and outgoing */
+#define R_INHERIT	4	/* accepted socket gets it from listener */
+
+struct SockOpt {
+	const char *name;
+	int level;
+	int opt;
+	unsigned ofs;
+	unsigned flags;
+};
+
+#define SOPT(lvl, opt, field, flags) \
+	{ #opt, lvl, opt, offsetof(struct SocketProfile, field), flags }
+
+/* keepalive on before its timings */
+static const struct SockOpt sockopt_list[] = {
+	SOPT(IPPROTO_TCP, TCP_NODELAY, tcp_nodelay, R_LISTEN | R_CONN | R_INHERIT),
+#ifdef TCP_QUICKACK
+	SOPT(IPPROTO_TCP, TCP_QUICKACK, tcp_quickack, R_CONN),
+#endif
+#ifdef TCP_DEFER_ACCEPT
+	SOPT(IPPROTO_TCP, TCP_DEFER_ACCEPT, tcp_defer_accept, R_LISTEN),
+#endif
+#ifdef SO_BUSY_POLL
+	SOPT(SOL_SOCKET, SO_BUSY_POLL, so_busy_poll, R_LISTEN | R_CONN | R_INHERIT),
+#endif
+	SOPT(SOL_SOCKET, SO_SNDBUF, so_sndbuf, R_LISTEN | R_CONN | R_INHERIT),
+	SOPT(SOL_SOCKET, SO_RCVBUF, so_rcvbuf, R_LISTEN | R_CONN | R_INHERIT),
+	SOPT(SOL_SOCKET, SO_KEEPALIVE, tcp_keepalive, R_LISTEN | R_CONN | R_INHERIT),
+#ifdef TCP_KEEPIDLE
+	SOPT(IPPROTO_TCP, TCP_KEEPIDLE, tcp_keepidle, R_LISTEN | R_CONN | R_INHERIT),
+#elif defined(TCP_KEEPALIVE)
+	/* OSX */
+	SOPT(IPPROTO_TCP, TCP_KEEPALIVE, tcp_keepidle, R_LISTEN | R_CONN | R_INHERIT),
+#endif
+#ifdef TCP_KEEPINTVL
+	SOPT(IPPROTO_TCP, TCP_KEEPINTVL, tcp_keepintvl, R_LISTEN | R_CONN | R_INHERIT),
+#endif
+#ifdef TCP_KEEPCNT
+	SOPT(IPPROTO_TCP, TCP_KEEPCNT, tcp_keepcnt, R_LISTEN | R_CONN | R_INHERIT),
+#endif
+#ifdef TCP_USER_TIMEOUT
+	SOPT(IPPROTO_TCP, TCP_USER_TIMEOUT, tcp_user_timeout, R_LISTEN | R_CONN | R_INHERIT),
+#endif
+	{ NULL },
+};
+
+#define PKEY(field) { #field, cf_set_int, offsetof(struct SocketProfile, field), "-1" }
+
+const struct CfKey socket_profile_keys[] = {
+	PKEY(tcp_nodelay),
+	PKEY(tcp_quickack),
+	PKEY(tcp_defer_accept),
+	PKEY(so_busy_poll),
+	PKEY(so_sndbuf),
+	PKEY(so_rcvbuf),
+	PKEY(tcp_keepalive),
+	PKEY(tcp_keepidle),
+	PKEY(tcp_keepintvl),
+	PKEY(tcp_keepcnt),
+	PKEY(tcp_user_timeout),
+	{ NULL },
+};
+
+void socket_profile_init(struct SocketProfile *p)
+{
+	memset(p, 0xff, sizeof(*p));
+}
+
+static inline int profile_value(const struct SocketProfile *p, const struct SockOpt *o)
+{
+	return *(const int *)((const char *)p + o->ofs);
+}
+
+static bool is_tcp_socket(int sock)
+{
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss);
+	int type;
+	socklen_t tlen = sizeof(type);
+
+	if (getsockname(sock, (struct sockaddr *)&ss, &len) < 0)
+		return false;
+	if (ss.ss_family != AF_INET && ss.ss_family != AF_INET6)
+		return false;
+	if (getsockopt(sock, SOL_SOCKET, SO_TYPE, &type, &tlen) < 0)
+		return false;
+	return type == SOCK_STREAM;
+}
+
+/* need is R_* mask option must have, skip is mask it must not have */
+static bool apply_opts(int sock, const struct SocketProfile *p, unsigned need, unsigned skip)
+{
+	const struct SockOpt *o;
+	int val, tcp = -1;
+
+	for (o = sockopt_list; o->name; o++) {
+		val = profile_value(p, o);
+		if (val < 0 || !(o->flags & need) || (o->flags & skip))
+			continue;
+		if (o->level == IPPROTO_TCP) {
+			if (tcp < 0)
+				tcp = is_tcp_socket(sock);
+			if (!tcp)
+				continue;
+		}
+		if (setsockopt(sock, o->level, o->opt, &val, sizeof(val)) < 0) {
+			log_warning("socket_apply_profile(%d): %s=%d: %s", sock, o->name, val, strerror(errno));
+			return false;
+		}
+	}
+	return true;
+}
+
+bool socket_apply_profile(int sock, const struct SocketProfile *p, enum SocketRole role)
+{
+	if (!p)
+		return true;
+	if (role == SOCKET_LISTEN)
+		return apply_opts(sock, p, R_LISTEN, 0);
+	return apply_opts(sock, p, R_CONN, 0);
+}
+
+/*
+ * Listening sockets.
+ */
+
+/* default batch size for listener */
+#define ACCEPT_BATCH 32
+
+/* retry delay after EMFILE and friends */
+#define ACCEPT_PAUSE_SEC 1
+
+int socket_listen(const struct sockaddr *sa, socklen_t sa_len, int backlog, unsigned flags,
+		  const struct SocketProfile *profile)
+{
+	int fd, val, err;
+
+	fd = socket(sa->sa_family, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	if (!socket_setup(fd, true))
+		goto failed;
+
+	if (sa->sa_family != AF_UNIX) {
+		val = 1;
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val)) < 0)
+			goto failed;
+	}
+	if (flags & SOCKET_REUSEPORT) {
+		val = 1;
+#if defined(SO_REUSEPORT_LB)
+		/* FreeBSD: plain SO_REUSEPORT does not balance */
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT_LB, &val, sizeof(val)) < 0)
+			goto failed;
+#elif defined(SO_REUSEPORT)
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)) < 0)
+			goto failed;
+#else
+		errno = ENOPROTOOPT;
+		goto failed;
+#endif
+	}
+
+	/* buffer sizes must be known before handshake for window scaling */
+	if (!socket_apply_profile(fd, profile, SOCKET_LISTEN))
+		goto failed;
+
+	if (bind(fd, sa, sa_len) < 0)
+		goto failed;
+	if (listen(fd, backlog > 0 ? backlog : SOMAXCONN) < 0)
+		goto failed;
+	return fd;
+
+failed:
+	err = errno;
+	log_noise("socket_listen(family=%d): %s", sa->sa_family, strerror(err));
+	close(fd);
+	errno = err;
+	return -1;
+}
+
+static bool listener_enable(struct SocketListener *l);
+
+/* Linux copies socket and TCP options of listener to new socket */
+static void accepted_profile(int fd, const struct SocketProfile *p)
+{
+#ifdef __linux__
+	apply_opts(fd, p, R_CONN, R_INHERIT);
+#else
+	apply_opts(fd, p, R_CONN, 0);
+#endif
+}
+
+static void listener_resume(int fd, short flags, void *arg)
+{
+	struct SocketListener *l = arg;
+
+	if (l->active && !listener_enable(l))
+		log_warning("socket_listener(%d): cannot resume: %s", l->fd, strerror(errno));
+}
+
+static void listener_accept(int sock, short flags, void *arg)
+{
+	struct SocketListener *l = arg;
+	struct sockaddr_storage ss;
+	struct timeval tv;
+	socklen_t len;
+	unsigned i;
+	int fd;
+
+	for (i = 0; i < l->batch && l->active; i++) {
+		len = sizeof(ss);
+		fd = safe_accept_nb(sock, (struct sockaddr *)&ss, &len);
+		if (fd >= 0) {
+			/* tuning failure is logged, connection still works */
+			if (l->profile)
+				accepted_profile(fd, l->profile);
+			l->cb_func(fd, (struct sockaddr *)&ss, len, l->cb_arg);
+			continue;
+		}
+
+		switch (errno) {
+		case EAGAIN:
+			return;
+		case EMFILE:
+		case ENFILE:
+		case ENOBUFS:
+		case ENOMEM:
+			/* level-triggered listen socket would spin, back off */
+			log_warning("socket_listener(%d): %s, pausing", sock, strerror(errno));
+			event_del(&l->ev);
+			tv.tv_sec = ACCEPT_PAUSE_SEC;
+			tv.tv_usec = 0;
+			event_assign(&l->pause_ev, l->base, -1, 0, listener_resume, l);
+			if (event_add(&l->pause_ev, &tv) < 0)
+				log_error("socket_listener(%d): cannot schedule resume", sock);
+			return;
+		default:
+			/* aborted connection etc, try next */
+			break;
+		}
+	}
+}
+
+static bool listener_enable(struct SocketListener *l)
+{
+	event_assign(&l->ev, l->base, l->fd, EV_READ | EV_PERSIST, listener_accept, l);
+	return event_add(&l->ev, NULL) == 0;
+}
+
+bool socket_listener_start(struct SocketListener *l, struct event_base *base, int fd,
+			   unsigned batch, socket_accept_f cb_func, void *cb_arg)
+{
+	memset(l, 0, sizeof(*l));
+	l->base = base;
+	l->fd = fd;
+	l->batch = batch ? batch : ACCEPT_BATCH;
+	l->cb_func = cb_func;
+	l->cb_arg = cb_arg;
+	if (!socket_set_nonblocking(fd, true))
+		return false;
+	if (!listener_enable(l))
+		return false;
+	l->active = true;
+	return true;
+}
+
+void socket_listener_stop(struct SocketListener *l)
+{
+	if (!l->active)
+		return;
+	l->active = false;
+	event_del(&l->ev);
+	event_del(&l->pause_ev);
+}
+
+void socket_listener_set_profile(struct SocketListener *l, const struct SocketProfile *p)
+{
+	l->profile = p;
+}
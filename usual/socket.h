@@ -20,10 +20,88 @@
 #define _USUAL_SOCKET_H_
 
 #include <usual/base.h>
+#include <usual/cfparser.h>
+#include <usual/event.h>
 #include <sys/socket.h>
 
 bool socket_setup(int sock, bool non_block);
 bool socket_set_nonblocking(int sock, bool non_block);
 
+/*
+ * Socket tuning profile.  Value -1 leaves system default,
+ * options unknown to platform are ignored.  TCP options
+ * are skipped for non-TCP sockets.
+ */
+struct SocketProfile {
+	int tcp_nodelay;	/* 0/1 */
+	int tcp_quickack;	/* 0/1, not sticky, set on each socket */
+	int tcp_defer_accept;	/* seconds, listen socket only */
+	int so_busy_poll;	/* usec */
+	int so_sndbuf;		/* bytes */
+	int so_rcvbuf;		/* bytes */
+	int tcp_keepalive;	/* 0/1 */
+	int tcp_keepidle;	/* seconds */
+	int tcp_keepintvl;	/* seconds */
+	int tcp_keepcnt;
+	int tcp_user_timeout;	/* msec */
+};
+
+enum SocketRole {
+	SOCKET_LISTEN,		/* before bind(), accepted sockets may inherit */
+	SOCKET_ACCEPTED,	/* full profile on accepted socket */
+	SOCKET_CONNECT,		/* outgoing socket, before connect() */
+};
+
+/* all fields -1 */
+void socket_profile_init(struct SocketProfile *p);
+
+/* setsockopt() for each set field, logs and returns false on first failure */
+bool socket_apply_profile(int sock, const struct SocketProfile *p, enum SocketRole role) _MUSTCHECK;
+
+/* CfKey list for struct SocketProfile, keys are field names, defaults -1 */
+extern const struct CfKey socket_profile_keys[];
+
+enum SocketListenFlags {
+	/* each worker binds own socket to same address, kernel spreads connections */
+	SOCKET_REUSEPORT = 1,
+};
+
+/*
+ * Bound and listening non-blocking socket, -1 with errno on failure.
+ * Profile can be NULL, it is applied as SOCKET_LISTEN.
+ */
+int socket_listen(const struct sockaddr *sa, socklen_t sa_len, int backlog, unsigned flags,
+		  const struct SocketProfile *profile) _MUSTCHECK;
+
+/*
+ * Drains up to batch connections per wakeup.  New sockets are
+ * non-blocking and close-on-exec.  On fd exhaustion accepting
+ * pauses for a second instead of spinning on the listen socket.
+ */
+typedef void (*socket_accept_f)(int fd, const struct sockaddr *sa, socklen_t sa_len, void *arg);
+
+struct SocketListener {
+	struct event ev;
+	struct event pause_ev;
+	struct event_base *base;
+	socket_accept_f cb_func;
+	void *cb_arg;
+	const struct SocketProfile *profile;
+	int fd;
+	unsigned batch;
+	bool active;
+};
+
+/* listen socket stays owned by caller */
+bool socket_listener_start(struct SocketListener *l, struct event_base *base, int fd,
+			   unsigned batch, socket_accept_f cb_func, void *cb_arg) _MUSTCHECK;
+void socket_listener_stop(struct SocketListener *l);
+
+/*
+ * Profile for accepted sockets, must be same that listen socket got.
+ * Options that kernel copies from listen socket are not set again.
+ */
+void socket_listener_set_profile(struct SocketListener *l, const struct SocketProfile *p);
+
 #endif
 
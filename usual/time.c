@@ -21,24 +21,58 @@
 #include <sys/time.h>
 #include <time.h>
 #include <stdio.h>
+#include <string.h>
 
+/* per-thread, so each event loop thread has its own */
+static _TLS usec_t _time_cache;
+static _TLS usec_t _mono_cache;
+
+/* difference between wall-clock and monotonic clock */
+static _TLS int64_t _wall_offset;
+static _TLS usec_t _wall_offset_stamp;
+
+/* formatted seconds part, so localtime_r() is called once per second */
+static _TLS time_t _fmt_sec = -1;
+static _TLS char _fmt_buf[32];
+static _TLS unsigned _fmt_len;
+
+/* if tv is NULL, use current time */
 char *format_time_ms(const struct timeval *tv, char *dst, unsigned dstlen)
 {
 	struct tm *tm, tmbuf;
 	struct timeval tvbuf;
 	time_t sec;
+	unsigned ms, len;
+	char *p;
 
 	if (tv == NULL) {
-		gettimeofday(&tvbuf, NULL);
+		usec_t now = get_time_usec();
+		tvbuf.tv_sec = now / USEC;
+		tvbuf.tv_usec = now % USEC;
 		tv = &tvbuf;
 	}
 
 	sec = tv->tv_sec;
-	tm = localtime_r(&sec, &tmbuf);
-	snprintf(dst, dstlen, "%04d-%02d-%02d %02d:%02d:%02d.%03d",
-		 tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday,
-		 tm->tm_hour, tm->tm_min, tm->tm_sec,
-		 (int)(tv->tv_usec / 1000));
+	if (sec != _fmt_sec) {
+		tm = localtime_r(&sec, &tmbuf);
+		_fmt_len = snprintf(_fmt_buf, sizeof(_fmt_buf), "%04d-%02d-%02d %02d:%02d:%02d.000",
+				    tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday,
+				    tm->tm_hour, tm->tm_min, tm->tm_sec);
+		_fmt_sec = sec;
+	}
+
+	/* patch in milliseconds */
+	ms = tv->tv_usec / 1000;
+	p = _fmt_buf + _fmt_len - 3;
+	p[0] = '0' + ms / 100;
+	p[1] = '0' + (ms / 10) % 10;
+	p[2] = '0' + ms % 10;
+
+	if (dstlen == 0)
+		return dst;
+	len = (_fmt_len < dstlen) ? _fmt_len : dstlen - 1;
+	memcpy(dst, _fmt_buf, len);
+	dst[len] = 0;
 	return dst;
 }
 
@@ -50,19 +84,50 @@ usec_t get_time_usec(void)
 	return (usec_t)tv.tv_sec * USEC + tv.tv_usec;
 }
 
-static usec_t _time_cache;
+/* read monotonic time */
+usec_t get_monotonic_usec(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return (usec_t)ts.tv_sec * USEC + ts.tv_nsec / 1000;
+#endif
+	return get_time_usec();
+}
+
+static void fill_time_cache(void)
+{
+	usec_t mono = get_monotonic_usec();
+
+	/* re-sync wall-clock offset once per second */
+	if (!_wall_offset_stamp || mono - _wall_offset_stamp > USEC) {
+		_wall_offset = (int64_t)get_time_usec() - (int64_t)mono;
+		_wall_offset_stamp = mono;
+	}
+	_mono_cache = mono;
+	_time_cache = (int64_t)mono + _wall_offset;
+}
 
 /* read cached time */
 usec_t get_cached_time(void)
 {
 	if (!_time_cache)
-		_time_cache = get_time_usec();
+		fill_time_cache();
 	return _time_cache;
 }
 
+/* read cached monotonic time */
+usec_t get_cached_monotonic(void)
+{
+	if (!_mono_cache)
+		fill_time_cache();
+	return _mono_cache;
+}
+
 /* forget cached time, let next read fill it */
 void reset_time_cache(void)
 {
 	_time_cache = 0;
+	_mono_cache = 0;
 }
 
@@ -26,9 +26,21 @@ typedef uint64_t usec_t;
 
 char *format_time_ms(const struct timeval *tv, char *dst, unsigned dstlen);
 
+/* wall-clock time */
 usec_t get_time_usec(void);
 
+/* time from CLOCK_MONOTONIC, unaffected by wall-clock changes */
+usec_t get_monotonic_usec(void);
+
+/*
+ * Cached time, filled on first read after reset.
+ *
+ * Event loop resets it on each iteration, so inside callbacks
+ * it gives loop time without extra syscalls.  Cached wall-clock
+ * is derived from monotonic clock, re-synced once per second.
+ */
 usec_t get_cached_time(void);
+usec_t get_cached_monotonic(void);
 void reset_time_cache(void);
 
 #endif
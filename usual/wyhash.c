@@ -0,0 +1,214 @@
+/*
+ * The contents of this file are public domain.
+ *
+ * Based on: wyhash, by Wang Yi, Unlicense / Public Domain.
+ */
+
+/*
+ * Compact version of wyhash: 64x64->128 multiply-mix,
+ * 48 bytes per round in 3 lanes, short keys take 2 reads.
+ */
+
+#include <usual/wyhash.h>
+
+#include <string.h>
+
+static const uint64_t wysecret[4] = {
+	0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL,
+	0x8ebc6af09c88c6e3ULL, 0x589965cc75374cc3ULL,
+};
+
+/* 128-bit product, low half to A, high to B */
+static inline void wymum(uint64_t *A, uint64_t *B)
+{
+#ifdef __SIZEOF_INT128__
+	__uint128_t r = *A;
+	r *= *B;
+	*A = (uint64_t)r;
+	*B = (uint64_t)(r >> 64);
+#else
+	uint64_t ha = *A >> 32, hb = *B >> 32, la = (uint32_t)*A, lb = (uint32_t)*B;
+	uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+	uint64_t t = rl + (rm0 << 32), c = t < rl, lo, hi;
+	lo = t + (rm1 << 32);
+	c += lo < t;
+	hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+	*A = lo;
+	*B = hi;
+#endif
+}
+
+static inline uint64_t wymix(uint64_t A, uint64_t B)
+{
+	wymum(&A, &B);
+	return A ^ B;
+}
+
+/* little-endian reads */
+static inline uint64_t wyr8(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, 8);
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
+static inline uint64_t wyr4(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+	v = __builtin_bswap32(v);
+#endif
+	return v;
+}
+
+/* 1..3 bytes */
+static inline uint64_t wyr3(const uint8_t *p, size_t k)
+{
+	return (((uint64_t)p[0]) << 16) | (((uint64_t)p[k >> 1]) << 8) | p[k - 1];
+}
+
+static inline uint64_t wy_start(uint64_t seed)
+{
+	return seed ^ wymix(seed ^ wysecret[0], wysecret[1]);
+}
+
+/* one 48-byte round */
+static inline void wy_round(const uint8_t *p, uint64_t *seed, uint64_t *see1, uint64_t *see2)
+{
+	*seed = wymix(wyr8(p) ^ wysecret[1], wyr8(p + 8) ^ *seed);
+	*see1 = wymix(wyr8(p + 16) ^ wysecret[2], wyr8(p + 24) ^ *see1);
+	*see2 = wymix(wyr8(p + 32) ^ wysecret[3], wyr8(p + 40) ^ *see2);
+}
+
+/* keys up to 16 bytes */
+static inline uint64_t wy_short(const uint8_t *p, size_t len, uint64_t *b_p)
+{
+	uint64_t a;
+
+	if (len >= 4) {
+		a = (wyr4(p) << 32) | wyr4(p + ((len >> 3) << 2));
+		*b_p = (wyr4(p + len - 4) << 32) | wyr4(p + len - 4 - ((len >> 3) << 2));
+	} else if (len > 0) {
+		a = wyr3(p, len);
+		*b_p = 0;
+	} else {
+		a = *b_p = 0;
+	}
+	return a;
+}
+
+/*
+ * Last 1..48 bytes of long key, p[-16..-1] must be readable
+ * if i < 16 (previous data).
+ */
+static inline uint64_t wy_tail(const uint8_t *p, size_t i, uint64_t seed, uint64_t *b_p)
+{
+	while (i > 16) {
+		seed = wymix(wyr8(p) ^ wysecret[1], wyr8(p + 8) ^ seed);
+		i -= 16;
+		p += 16;
+	}
+	*b_p = wyr8(p + i - 8) ^ seed;
+	return wyr8(p + i - 16);
+}
+
+static inline uint64_t wy_finish(uint64_t a, uint64_t b, uint64_t len)
+{
+	a ^= wysecret[1];
+	wymum(&a, &b);
+	return wymix(a ^ wysecret[0] ^ len, b ^ wysecret[1]);
+}
+
+uint64_t hash_wy(const void *data, size_t len, uint64_t seed)
+{
+	const uint8_t *p = data;
+	uint64_t a, b, see1, see2;
+	size_t i = len;
+
+	seed = wy_start(seed);
+	if (len <= 16) {
+		a = wy_short(p, len, &b);
+		return wy_finish(a, b ^ seed, len);
+	}
+
+	if (i > 48) {
+		see1 = see2 = seed;
+		do {
+			wy_round(p, &seed, &see1, &see2);
+			p += 48;
+			i -= 48;
+		} while (i > 48);
+		seed ^= see1 ^ see2;
+	}
+	a = wy_tail(p, i, seed, &b);
+	return wy_finish(a, b, len);
+}
+
+/*
+ * Streaming.  Round is done only when more data follows,
+ * so final buffer has the same 1..48 byte tail as hash_wy().
+ */
+
+void wyhash_init(struct WyHash *st, uint64_t seed)
+{
+	st->seed = st->see1 = st->see2 = wy_start(seed);
+	st->total = 0;
+	st->buflen = 0;
+}
+
+void wyhash_update(struct WyHash *st, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	uint8_t *chunk = st->buf + 16;
+	unsigned n;
+
+	st->total += len;
+
+	/* fill buffered chunk */
+	if (st->buflen > 0 || len <= 48) {
+		n = 48 - st->buflen;
+		if (n > len)
+			n = len;
+		memcpy(chunk + st->buflen, p, n);
+		st->buflen += n;
+		p += n;
+		len -= n;
+		if (len == 0)
+			return;
+		wy_round(chunk, &st->seed, &st->see1, &st->see2);
+		memcpy(st->buf, chunk + 32, 16);
+		st->buflen = 0;
+	}
+
+	/* full chunks directly from input */
+	if (len > 48) {
+		while (len > 48) {
+			wy_round(p, &st->seed, &st->see1, &st->see2);
+			p += 48;
+			len -= 48;
+		}
+		memcpy(st->buf, p - 16, 16);
+	}
+	memcpy(chunk, p, len);
+	st->buflen = len;
+}
+
+uint64_t wyhash_final(struct WyHash *st)
+{
+	const uint8_t *p = st->buf + 16;
+	uint64_t a, b, seed = st->seed;
+
+	if (st->total <= 16) {
+		a = wy_short(p, st->total, &b);
+		return wy_finish(a, b ^ seed, st->total);
+	}
+	if (st->total > 48)
+		seed ^= st->see1 ^ st->see2;
+	a = wy_tail(p, st->buflen, seed, &b);
+	return wy_finish(a, b, st->total);
+}
+
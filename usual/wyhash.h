@@ -0,0 +1,36 @@
+/*
+ * The contents of this file are public domain.
+ *
+ * Based on: wyhash, by Wang Yi, Unlicense / Public Domain.
+ */
+
+#ifndef _USUAL_WYHASH_H_
+#define _USUAL_WYHASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Seeded 64-bit hash.  Use random seed for keys that
+ * come from clients, to avoid hash flooding.
+ */
+uint64_t hash_wy(const void *data, size_t len, uint64_t seed);
+
+/*
+ * Streaming version, gives same result as hash_wy()
+ * on concatenated data.
+ */
+struct WyHash {
+	uint64_t seed, see1, see2;
+	uint64_t total;
+	unsigned buflen;
+	/* last 16 bytes of previous chunk + current chunk */
+	uint8_t buf[16 + 48];
+};
+
+void wyhash_init(struct WyHash *st, uint64_t seed);
+void wyhash_update(struct WyHash *st, const void *data, size_t len);
+uint64_t wyhash_final(struct WyHash *st);
+
+#endif
+